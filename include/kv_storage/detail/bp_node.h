@@ -3,19 +3,43 @@
 
 #include <optional>
 
-#include "utils.h"
+#include "node_storage.h"
 
 namespace kv_storage {
 
 using Key = uint64_t;
 
+//-------------------------------------------------------------------------------
+// How many times reader repeats optimistic search before falling back to lock coupling.
+constexpr uint32_t OptimisticReadAttempts = 4;
+
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
 class BPNode;
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
-using BPCache = lfu_cache<FileIndex, std::shared_ptr<BPNode<V, BranchFactor>>>;
+using BPCache = cache_base<FileIndex, std::shared_ptr<BPNode<V, BranchFactor>>>;
+
+//-------------------------------------------------------------------------------
+// Eviction policy of nodes cache.
+enum class CachePolicy
+{
+    Lfu,          // Single lfu_cache. Eviction is O(N).
+    ShardedClock  // sharded_clock_cache. All operations are O(1).
+};
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+std::shared_ptr<BPCache<V, BranchFactor>> CreateBPCache(CachePolicy policy, size_t capacity, typename BPCache<V, BranchFactor>::disposer_type disposer)
+{
+    using Value = std::shared_ptr<BPNode<V, BranchFactor>>;
+
+    if (policy == CachePolicy::Lfu)
+        return std::make_shared<lfu_cache<FileIndex, Value>>(capacity, std::move(disposer));
+    else
+        return std::make_shared<sharded_clock_cache<FileIndex, Value>>(capacity, std::move(disposer));
+}
 
 //-------------------------------------------------------------------------------
 // ptr to new created BPNode & key to be inserted to parent node
@@ -61,31 +85,33 @@ class BPNode
 public:
     template<class, size_t> friend class VolumeEnumerator;
 
-    BPNode(const fs::path& dir, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx)
-        : m_dir(dir)
+    BPNode(std::shared_ptr<NodeStorage> storage, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx)
+        : m_storage(std::move(storage))
         , m_cache(cache)
         , m_index(idx)
-        , m_dirty(true)
     {
         m_keys.fill(0);
     }
 
-    BPNode(const fs::path& dir, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx, uint32_t newKeyCount, std::array<Key, BranchFactor - 1>&& newKeys)
-        : m_dir(dir)
+    BPNode(std::shared_ptr<NodeStorage> storage, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx, uint32_t newKeyCount, std::array<Key, BranchFactor - 1>&& newKeys)
+        : m_storage(std::move(storage))
         , m_cache(cache)
         , m_index(idx)
         , m_keyCount(newKeyCount)
         , m_keys(newKeys)
-        , m_dirty(true)
     {
+        MarkDirty();
     }
 
     virtual ~BPNode() = default;
 
-    virtual void Load() = 0;
-    virtual void Flush() = 0;
+    // Read node from serialized data which follows the type marker.
+    virtual void Load(std::istream& in) = 0;
     virtual std::optional<V> Get(Key key) const = 0;
     virtual std::shared_ptr<BPNode> GetFirstLeaf() = 0;
+
+    // Leaf which contains the key or the place for it.
+    virtual std::shared_ptr<BPNode> FindLeaf(Key key) = 0;
     virtual Key GetMinimum() const = 0;
     virtual bool IsLeaf() const = 0;
 
@@ -95,17 +121,51 @@ public:
     virtual void SetIndex(FileIndex index);
     virtual void MarkAsDeleted();
 
-    mutable boost::shared_mutex m_mutex;
+    // Node content in storage format including type marker.
+    virtual std::string Serialize() const = 0;
+
+    // True if node was changed after the last flush.
+    bool IsDirty() const;
+
+    // Node is changed and must be written to disk. Registers it for writeback.
+    void MarkDirty();
+
+    // Write node to disk if it is dirty.
+    void Flush();
+
+    // Flush node only if its latch is free. Returns false if node is used by some thread right now.
+    bool TryFlush();
+
+    // Hint CPU to load keys of the node to its cache, so search in the node doesn't wait for memory.
+    void Prefetch() const;
+
+    mutable NodeLatch m_mutex;
 
 protected:
-    const fs::path m_dir;
+    // Write node to disk if it is dirty. Caller must hold the latch.
+    void WriteToDisk();
+
+    const std::shared_ptr<NodeStorage> m_storage;
     std::weak_ptr<BPCache<V, BranchFactor>> m_cache;
     FileIndex m_index{ 0 };
     uint32_t m_keyCount{ 0 };
     std::array<Key, BranchFactor - 1> m_keys;
-    bool m_dirty;
+    std::atomic<bool> m_dirty{ false };
 };
 
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void BPNode<V, BranchFactor>::Prefetch() const
+{
+#if defined(__GNUC__) || defined(__clang__)
+    const char* data = reinterpret_cast<const char*>(m_keys.data());
+    for (size_t offset = 0; offset < m_keyCount * sizeof(Key); offset += 64)
+    {
+        __builtin_prefetch(data + offset);
+    }
+#endif
+}
+
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
 uint32_t BPNode<V, BranchFactor>::GetKeyCount() const
@@ -132,14 +192,72 @@ template<class V, size_t BranchFactor>
 void BPNode<V, BranchFactor>::SetIndex(FileIndex index)
 {
     m_index = index;
+
+    if (m_dirty)
+        m_storage->QueueDirty(m_index);
+    else
+        MarkDirty();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+bool BPNode<V, BranchFactor>::IsDirty() const
+{
+    return m_dirty;
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void BPNode<V, BranchFactor>::MarkDirty()
+{
+    if (m_dirty)
+        return;
+
     m_dirty = true;
+    m_storage->AddDirty(m_index);
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void BPNode<V, BranchFactor>::WriteToDisk()
+{
+    if (!m_dirty)
+        return;
+
+    m_storage->Write(m_index, Serialize());
+    m_dirty = false;
+    m_storage->RemoveDirty();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void BPNode<V, BranchFactor>::Flush()
+{
+    boost::unique_lock<NodeLatch> lock(m_mutex);
+    WriteToDisk();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+bool BPNode<V, BranchFactor>::TryFlush()
+{
+    boost::unique_lock<NodeLatch> lock(m_mutex, boost::try_to_lock);
+    if (!lock.owns_lock())
+        return false;
+
+    WriteToDisk();
+    return true;
 }
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
 void BPNode<V, BranchFactor>::MarkAsDeleted()
 {
+    if (!m_dirty)
+        return;
+
     m_dirty = false;
+    m_storage->RemoveDirty();
 }
 
 } // kv_storage
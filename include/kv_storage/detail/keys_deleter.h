@@ -1,6 +1,7 @@
 #ifndef OUTDATED_KEYS_DELETER_H
 #define OUTDATED_KEYS_DELETER_H
 
+#include <queue>
 #include <fstream>
 
 #include "leaf.h"
@@ -12,6 +13,13 @@ namespace kv_storage {
 //-------------------------------------------------------------------------------
 const std::chrono::duration AutoDeletePeriod = std::chrono::seconds(1);
 
+//-------------------------------------------------------------------------------
+constexpr const char* KeysTtlsFileName = "keys_ttls.dat";
+
+//-------------------------------------------------------------------------------
+// Log of TTLs is compacted when it has more outdated records than this and than live ones.
+constexpr uint64_t TtlLogCompactionGarbage = 1024 * 1024;
+
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
 class Volume;
@@ -19,6 +27,26 @@ class Volume;
 //-------------------------------------------------------------------------------
 //                            OutdatedKeysDeleter
 //-------------------------------------------------------------------------------
+// Keeps deletion time of keys with TTL and deletes outdated keys from the volume
+// in the worker thread. Besides the map of keys there is a min-heap of deletion
+// times, so the worker pops only outdated keys and holds the lock for this time
+// only. Heap entries of deleted keys are not removed, they are skipped when their
+// time comes or dropped when heap is rebuilt.
+//
+// TTLs are stored in the append-only log, Flush() appends records of changes
+// since the previous flush. The worker compacts the log when it has too many
+// outdated records: all TTLs are written to a new file which replaces the log.
+//
+// Log format:
+//  "KVTTLS\0\0"                 - Marker.
+//  Records of 17 bytes:
+//   'S' key time                - Set deletion time of key (unix time in seconds).
+//   'C' key 0                   - Clear deletion time of key.
+// Torn record at the end is ignored. File without marker is the old format
+// which is converted on load:
+//  0xXX 0xXX 0xXX 0xXX          - Key count.
+//  Key count of pairs <key, time>.
+//-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
 class OutdatedKeysDeleter
 {
@@ -32,12 +60,45 @@ public:
     void Flush();
     void Load();
 
+    // Stop the worker and drop changes which are not flushed, like after crash of the process.
+    void Abandon();
+
+    // Replace the log by TTLs of existing keys. Throws on error.
+    void Compact();
+
+private:
+    // Pop deadlines of keys which should be deleted at 'now' and return them. Keys stay in
+    // m_ttls until FinishOutdated() is called.
+    std::vector<std::pair<uint64_t, Key>> TakeOutdated(uint64_t now);
+
+    // Clear TTLs of deleted outdated keys. Keys from 'failed' keep their TTLs and are
+    // deleted again in the next period.
+    void FinishOutdated(const std::vector<std::pair<uint64_t, Key>>& outdated, std::vector<Key> failed);
+
+    // Caller must hold m_mutex.
+    void PushDeadline(Key key, uint64_t time);
+
+    // Write records to the end of file. Caller must hold m_fileMutex.
+    static void AppendRecords(const fs::path& path, const std::vector<std::pair<Key, uint64_t>>& records, bool create);
+
 private:
+    using Deadline = std::pair<uint64_t, Key>;
+
+    static constexpr const char* LogMarker = "KVTTLS";
+    static constexpr size_t RecordSize = 17;
+
     const fs::path m_dir;
 
     boost::shared_mutex m_mutex;
     std::unordered_map<Key, uint64_t> m_ttls;
-    bool m_dirty{ true };
+    std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>> m_deadlines;
+
+    // Changes since the last flush, time 0 clears TTL of key.
+    std::vector<std::pair<Key, uint64_t>> m_changes;
+
+    // Serializes writers of the file. Taken before m_mutex.
+    boost::mutex m_fileMutex;
+    uint64_t m_logRecords{ 0 };
 
     std::thread m_worker;
     std::atomic_bool m_stop{ false };
@@ -50,7 +111,7 @@ OutdatedKeysDeleter<V, BranchFactor>::OutdatedKeysDeleter(Volume<V, BranchFactor
     : m_dir(directory)
     , m_volume(volume)
 {
-    if (fs::exists(m_dir / "keys_ttls.dat"))
+    if (fs::exists(m_dir / KeysTtlsFileName))
         Load();
 }
 
@@ -65,6 +126,16 @@ void OutdatedKeysDeleter<V, BranchFactor>::Stop()
     }
 }
 
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void OutdatedKeysDeleter<V, BranchFactor>::Abandon()
+{
+    Stop();
+
+    boost::unique_lock<boost::shared_mutex> lock(m_mutex);
+    m_changes.clear();
+}
+
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
 OutdatedKeysDeleter<V, BranchFactor>::~OutdatedKeysDeleter()
@@ -93,44 +164,37 @@ void OutdatedKeysDeleter<V, BranchFactor>::Start()
             while (!m_stop)
             {
                 const std::chrono::time_point now = std::chrono::system_clock::now();
-                const std::chrono::system_clock::duration nowEpoch = now.time_since_epoch();
-                const uint64_t nowSeconds = nowEpoch.count() * std::chrono::system_clock::period::num / std::chrono::system_clock::period::den;
-
-                std::vector<Key> keysForDelete;
 
+                // Lock isn't held while the volume deletes keys, so writers don't wait for it.
+                const auto outdated = TakeOutdated(CurrentUnixTime());
+                if (!outdated.empty())
                 {
-                    boost::unique_lock<boost::shared_mutex> readLock(m_mutex);
-
-                    for (const auto& item : m_ttls)
+                    std::vector<Key> failed;
+                    if (m_volume)
                     {
-                        if (m_stop)
-                            break;
-
-                        if (nowSeconds >= item.second)
-                            keysForDelete.push_back(item.first);
+                        std::vector<Key> keys;
+                        keys.reserve(outdated.size());
+                        for (const auto& deadline : outdated)
+                        {
+                            keys.push_back(deadline.second);
+                        }
+
+                        failed = m_volume->DeleteOutdated(std::move(keys));
                     }
+
+                    FinishOutdated(outdated, std::move(failed));
                 }
 
-                for (const auto& key : keysForDelete)
+                bool compact;
                 {
-                    try
-                    {
-                        if (m_volume)
-                            m_volume->Delete(key);
-                        else
-                            continue;
-                    }
-                    catch (const std::exception&)
-                    {
-                        // key not found
-                        continue;
-                    }
-
                     boost::unique_lock<boost::shared_mutex> lock(m_mutex);
-                    m_ttls.erase(key);
-                    m_dirty = true;
+                    const auto garbage = m_logRecords - std::min<uint64_t>(m_logRecords, m_ttls.size());
+                    compact = garbage > TtlLogCompactionGarbage && garbage > m_ttls.size();
                 }
 
+                if (compact)
+                    Compact();
+
                 const auto elapsed = std::chrono::system_clock::now() - now;
                 if (elapsed < AutoDeletePeriod)
                     std::this_thread::sleep_for(AutoDeletePeriod - elapsed);
@@ -148,16 +212,15 @@ void OutdatedKeysDeleter<V, BranchFactor>::Start()
 template<class V, size_t BranchFactor>
 void OutdatedKeysDeleter<V, BranchFactor>::Put(Key key, uint32_t ttl)
 {
-    std::chrono::system_clock::time_point tp = std::chrono::system_clock::now();
-    std::chrono::system_clock::duration dur = tp.time_since_epoch();
-
-    uint64_t seconds = dur.count() * std::chrono::system_clock::period::num / std::chrono::system_clock::period::den;
-    seconds += ttl;
+    const uint64_t seconds = CurrentUnixTime() + ttl;
 
     boost::unique_lock<boost::shared_mutex> lock(m_mutex);
 
-    m_ttls.emplace(key, seconds);
-    m_dirty = true;
+    if (m_ttls.emplace(key, seconds).second)
+    {
+        PushDeadline(key, seconds);
+        m_changes.emplace_back(key, seconds);
+    }
 }
 
 //-------------------------------------------------------------------------------
@@ -166,36 +229,95 @@ void OutdatedKeysDeleter<V, BranchFactor>::Delete(Key key)
 {
     boost::unique_lock<boost::shared_mutex> lock(m_mutex);
 
-    m_ttls.erase(key);
-    m_dirty = true;
+    if (m_ttls.erase(key))
+        m_changes.emplace_back(key, 0);
 }
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
 void OutdatedKeysDeleter<V, BranchFactor>::Flush()
 {
-    boost::unique_lock<boost::shared_mutex> lock(m_mutex);
+    boost::unique_lock<boost::mutex> fileLock(m_fileMutex);
+
+    std::vector<std::pair<Key, uint64_t>> changes;
+    {
+        boost::unique_lock<boost::shared_mutex> lock(m_mutex);
+        changes.swap(m_changes);
+    }
 
-    if (!m_dirty)
+    const auto path = m_dir / KeysTtlsFileName;
+    const bool create = !fs::exists(path);
+    if (changes.empty() && !create)
         return;
 
-    std::ofstream out;
-    out.exceptions(~std::ofstream::goodbit);
-    out.open(m_dir / "keys_ttls.dat", std::ios::out | std::ios::binary | std::ios::trunc);
+    try
+    {
+        AppendRecords(path, changes, create);
+    }
+    catch (...)
+    {
+        // Changes are written again by the next flush.
+        boost::unique_lock<boost::shared_mutex> lock(m_mutex);
+        m_changes.insert(m_changes.begin(), changes.begin(), changes.end());
+        throw;
+    }
+
+    boost::unique_lock<boost::shared_mutex> lock(m_mutex);
+    m_logRecords += changes.size();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void OutdatedKeysDeleter<V, BranchFactor>::Compact()
+{
+    boost::unique_lock<boost::mutex> fileLock(m_fileMutex);
+
+    // Pending changes are in the map already, later ones are appended to the new file.
+    std::vector<std::pair<Key, uint64_t>> records;
+    {
+        boost::unique_lock<boost::shared_mutex> lock(m_mutex);
+        records.assign(m_ttls.begin(), m_ttls.end());
+        m_changes.clear();
+    }
+
+    const auto tmpPath = m_dir / (std::string(KeysTtlsFileName) + ".tmp");
+    fs::remove(tmpPath);
+    AppendRecords(tmpPath, records, true);
+
+    // The new file must be durable before it replaces the log, otherwise a crash may leave it empty.
+    PositionalFile(tmpPath, OpenMode::OpenExisting).Sync();
+    fs::rename(tmpPath, m_dir / KeysTtlsFileName);
+    SyncDirectory(m_dir);
+
+    boost::unique_lock<boost::shared_mutex> lock(m_mutex);
+    m_logRecords = records.size();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void OutdatedKeysDeleter<V, BranchFactor>::AppendRecords(const fs::path& path, const std::vector<std::pair<Key, uint64_t>>& records, bool create)
+{
+    std::string data;
+    data.reserve((create ? 8 : 0) + records.size() * RecordSize);
 
-    uint32_t count = boost::endian::native_to_little(static_cast<uint32_t>(m_ttls.size()));
-    out.write(reinterpret_cast<char*>(&count), sizeof(count));
+    if (create)
+        data.append(LogMarker, 8);
 
-    for (const auto& ttl : m_ttls)
+    for (const auto& record : records)
     {
-        auto key = boost::endian::native_to_little(ttl.first);
-        out.write(reinterpret_cast<char*>(&key), sizeof(key));
+        data.push_back(record.second ? 'S' : 'C');
+
+        const auto key = boost::endian::native_to_little(record.first);
+        data.append(reinterpret_cast<const char*>(&key), sizeof(key));
 
-        auto time = boost::endian::native_to_little(ttl.second);
-        out.write(reinterpret_cast<char*>(&time), sizeof(time));
+        const auto time = boost::endian::native_to_little(record.second);
+        data.append(reinterpret_cast<const char*>(&time), sizeof(time));
     }
 
-    m_dirty = false;
+    std::ofstream out;
+    out.exceptions(~std::ofstream::goodbit);
+    out.open(path, std::ios::out | std::ios::binary | std::ios::app);
+    out.write(data.data(), data.size());
     out.close();
 }
 
@@ -203,35 +325,139 @@ void OutdatedKeysDeleter<V, BranchFactor>::Flush()
 template<class V, size_t BranchFactor>
 void OutdatedKeysDeleter<V, BranchFactor>::Load()
 {
-    boost::unique_lock<boost::shared_mutex> lock(m_mutex);
-
-    if (!m_dirty)
-        return;
+    const auto path = m_dir / KeysTtlsFileName;
 
     std::ifstream in;
     in.exceptions(~std::ofstream::goodbit);
-    in.open(m_dir / "keys_ttls.dat", std::ios::in | std::ios::binary);
+    in.open(path, std::ios::in | std::ios::binary | std::ios::ate);
+
+    std::string data(static_cast<size_t>(in.tellg()), '\0');
+    in.seekg(0);
+    in.read(data.data(), data.size());
+    in.close();
 
-    uint32_t count;
-    in.read(reinterpret_cast<char*>(&(count)), sizeof(count));
+    const auto readNumber = [&data](size_t pos)
+    {
+        uint64_t value;
+        std::copy(data.data() + pos, data.data() + pos + sizeof(value), reinterpret_cast<char*>(&value));
+        return boost::endian::little_to_native(value);
+    };
 
-    boost::endian::little_to_native_inplace(count);
+    boost::unique_lock<boost::shared_mutex> lock(m_mutex);
+
+    if (data.size() >= 8 && data.compare(0, 8, std::string(LogMarker, 8)) == 0)
+    {
+        for (size_t pos = 8; pos + RecordSize <= data.size(); pos += RecordSize)
+        {
+            const auto key = readNumber(pos + 1);
+            if (data[pos] == 'S')
+                m_ttls[key] = readNumber(pos + 9);
+            else if (data[pos] == 'C')
+                m_ttls.erase(key);
+            else
+                throw std::runtime_error("Invalid TTL record in " + path.string());
+
+            m_logRecords++;
+        }
+
+        for (const auto& ttl : m_ttls)
+        {
+            PushDeadline(ttl.first, ttl.second);
+        }
+        return;
+    }
+
+    uint32_t count = 0;
+    if (data.size() >= sizeof(count))
+    {
+        std::copy(data.data(), data.data() + sizeof(count), reinterpret_cast<char*>(&count));
+        boost::endian::little_to_native_inplace(count);
+    }
+
+    if (data.size() < sizeof(count) + count * 16ull)
+        throw std::runtime_error("Invalid TTL file " + path.string());
 
     for (uint32_t i = 0; i < count; i++)
     {
-        Key key;
-        uint64_t time;
+        const auto key = readNumber(sizeof(count) + i * 16ull);
+        const auto time = readNumber(sizeof(count) + i * 16ull + 8);
+
+        if (m_ttls.emplace(key, time).second)
+            PushDeadline(key, time);
+    }
+
+    // Convert the old format to the log.
+    lock.unlock();
+    Compact();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+std::vector<std::pair<uint64_t, Key>> OutdatedKeysDeleter<V, BranchFactor>::TakeOutdated(uint64_t now)
+{
+    boost::unique_lock<boost::shared_mutex> lock(m_mutex);
+
+    std::vector<Deadline> outdated;
+    while (!m_deadlines.empty() && m_deadlines.top().first <= now)
+    {
+        const auto deadline = m_deadlines.top();
+        m_deadlines.pop();
+
+        // Key was deleted or put again after this entry.
+        const auto it = m_ttls.find(deadline.second);
+        if (it == m_ttls.end() || it->second != deadline.first)
+            continue;
 
-        in.read(reinterpret_cast<char*>(&(key)), sizeof(key));
-        in.read(reinterpret_cast<char*>(&(time)), sizeof(time));
+        outdated.push_back(deadline);
+    }
+
+    return outdated;
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void OutdatedKeysDeleter<V, BranchFactor>::FinishOutdated(const std::vector<std::pair<uint64_t, Key>>& outdated, std::vector<Key> failed)
+{
+    std::sort(failed.begin(), failed.end());
 
-        boost::endian::little_to_native_inplace(key);
-        boost::endian::little_to_native_inplace(time);
+    boost::unique_lock<boost::shared_mutex> lock(m_mutex);
 
-        m_ttls.emplace(key, time);
+    for (const auto& [time, key] : outdated)
+    {
+        // Key was deleted or put again while the volume deleted it.
+        const auto it = m_ttls.find(key);
+        if (it == m_ttls.end() || it->second != time)
+            continue;
+
+        if (std::binary_search(failed.begin(), failed.end(), key))
+        {
+            PushDeadline(key, time);
+            continue;
+        }
+
+        m_ttls.erase(it);
+        m_changes.emplace_back(key, 0);
     }
+}
 
-    m_dirty = false;
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void OutdatedKeysDeleter<V, BranchFactor>::PushDeadline(Key key, uint64_t time)
+{
+    m_deadlines.emplace(time, key);
+
+    // Entries of deleted keys are dropped when they are a half of the heap.
+    if (m_deadlines.size() > 2 * m_ttls.size() + 1024)
+    {
+        std::vector<Deadline> deadlines;
+        deadlines.reserve(m_ttls.size());
+        for (const auto& ttl : m_ttls)
+        {
+            deadlines.emplace_back(ttl.second, ttl.first);
+        }
+
+        m_deadlines = decltype(m_deadlines)(std::greater<Deadline>(), std::move(deadlines));
+    }
 }
 
 } // kv_storage
@@ -1,7 +1,7 @@
 #ifndef LEAF_H
 #define LEAF_H
 
-#include <fstream>
+#include <sstream>
 #include <optional>
 #include <type_traits>
 
@@ -12,6 +12,11 @@ namespace kv_storage {
 //-------------------------------------------------------------------------------
 //                                  Leaf
 //-------------------------------------------------------------------------------
+// Key may have deletion time (unix time in seconds) which is kept next to its
+// value. Outdated keys are absent for Get() at once and are removed when the
+// leaf is changed (see RemoveOutdated()). Times are kept only by leaves which
+// have such keys, they are written with another leaf marker.
+//-------------------------------------------------------------------------------
 template <class V, size_t BranchFactor>
 class Leaf
     : public BPNode<V, BranchFactor>
@@ -19,46 +24,108 @@ class Leaf
 {
 public:
     template<class, size_t> friend class VolumeEnumerator;
+    template<class, size_t> friend class Volume;
 
-    Leaf(const fs::path& dir, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx)
-        : BPNode<V, BranchFactor>(dir, cache, idx)
+    Leaf(std::shared_ptr<NodeStorage> storage, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx)
+        : BPNode<V, BranchFactor>(std::move(storage), cache, idx)
     {
     }
 
-    Leaf(const fs::path& dir, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx, uint32_t newKeyCount, std::array<Key, BranchFactor - 1>&& newKeys, std::vector<V>&& newValues, FileIndex newNextBatch)
-        : BPNode<V, BranchFactor>(dir, cache, idx, newKeyCount, std::move(newKeys))
-        , m_values(newValues)
+    Leaf(std::shared_ptr<NodeStorage> storage, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx, uint32_t newKeyCount, std::array<Key, BranchFactor - 1>&& newKeys, std::vector<V>&& newValues, FileIndex newNextBatch)
+        : BPNode<V, BranchFactor>(std::move(storage), cache, idx, newKeyCount, std::move(newKeys))
         , m_nextBatch(newNextBatch)
-    {}
+    {
+        m_values.assign(std::move(newValues));
+    }
 
     virtual ~Leaf();
-    virtual void Flush() override;
-    virtual void Load() override;
+    virtual void Load(std::istream& in) override;
+    void Load(std::istream& in, bool withExpiries);
     virtual std::optional<V> Get(Key key) const override;
     virtual Key GetMinimum() const override;
     virtual std::shared_ptr<BPNode<V, BranchFactor>> GetFirstLeaf() override;
+    virtual std::shared_ptr<BPNode<V, BranchFactor>> FindLeaf(Key key) override;
     virtual bool IsLeaf() const override;
+    virtual std::string Serialize() const override;
+
+    using BPNode<V, BranchFactor>::Flush;
 
     DeleteResult<V, BranchFactor> Delete(Key key, std::optional<Sibling> leftSibling, std::optional<Sibling> rightSibling, IndexManager& indexManager);
-    std::optional<CreatedBPNode<V, BranchFactor>> Put(Key key, const V& val, IndexManager& indexManager);
+
+    // expiry - Input parameter. Deletion time of key or 0 if key has no TTL.
+    std::optional<CreatedBPNode<V, BranchFactor>> Put(Key key, const V& val, IndexManager& indexManager, uint64_t expiry = 0);
+
+    // Remove keys outdated at 'now' while leaf keeps enough keys without rebalancing. Outdated
+    // 'key' is removed anyway, caller inserts it again. Caller must hold exclusive latch.
+    // Returns count of removed keys.
+    uint32_t RemoveOutdated(uint64_t now, std::optional<Key> key = std::nullopt);
+
+    // Delete keys of sorted range [first, last) while leaf keeps enough keys without rebalancing.
+    // The first key must be routed to this leaf, the next ones are processed while they don't exceed
+    // the last key of the leaf. Absent keys are skipped. 'first' is moved to the first unprocessed key.
+    // Caller must hold exclusive latch. Returns deleted keys.
+    template<class It>
+    std::vector<Key> DeleteSorted(It& first, It last);
+
+    // Add values of positions [first, last) to aggregates, outdated keys are skipped. Values must be numeric.
+    // Returns count of added values.
+    uint32_t Aggregate(uint32_t first, uint32_t last, uint64_t now, AggregateSum<V>& sum, V& min, V& max) const;
+
+    // Value of key or nullptr if there is no such key. Outdated key is absent. Caller must hold latch.
+    const V* Find(Key key, uint64_t now) const;
+
+    // True if leaf has the key, outdated key too. Caller must hold latch.
+    bool Contains(Key key) const;
+
+    // Replace value of existing key in place, structure of the leaf is not changed. Outdated key is absent.
+    // expiry - Input parameter. New deletion time of key or 0. Time of key is kept if it is empty.
+    // Returns deletion time of key after update or std::nullopt if there is no such key.
+    // Caller must hold exclusive latch.
+    std::optional<uint64_t> Update(Key key, const V& value, std::optional<uint64_t> expiry, uint64_t now);
+
+    // Put value of key or delete key if value is empty without split and rebalancing. Put replaces
+    // value of existing key and clears its deletion time, delete of absent key does nothing.
+    // found - Output parameter. True if key was in the leaf.
+    // Returns false if leaf must be split or rebalanced, leaf is not changed then.
+    // Caller must hold exclusive latch.
+    bool TryApply(Key key, const std::optional<V>& value, bool& found);
 
 private:
-    CreatedBPNode<V, BranchFactor> SplitAndPut(Key key, const V& value, IndexManager& indexManager);
+    CreatedBPNode<V, BranchFactor> SplitAndPut(Key key, const V& value, IndexManager& indexManager, uint64_t expiry);
     void LeftJoin(const Leaf<V, BranchFactor>& leaf);
     void RightJoin(const Leaf<V, BranchFactor>& leaf);
-    void Insert(Key key, const V& value, uint32_t pos);
+    void Insert(Key key, const V& value, uint32_t pos, uint64_t expiry = 0);
+    void Remove(uint32_t pos);
+
+    uint64_t GetExpiry(uint32_t pos) const
+    {
+        return m_expiries.empty() ? 0 : m_expiries[pos];
+    }
+
+    bool IsOutdated(uint32_t pos, uint64_t now) const
+    {
+        const auto expiry = GetExpiry(pos);
+        return expiry != 0 && expiry <= now;
+    }
+
+    // Deletion times of keys of 'left' followed by times of 'right'. Empty if both leaves have no times.
+    static std::vector<uint64_t> JoinExpiries(const Leaf<V, BranchFactor>& left, const Leaf<V, BranchFactor>& right);
 
     using std::enable_shared_from_this<BPNode<V, BranchFactor>>::shared_from_this;
     using BPNode<V, BranchFactor>::m_keyCount;
     using BPNode<V, BranchFactor>::m_keys;
     using BPNode<V, BranchFactor>::m_dirty;
+    using BPNode<V, BranchFactor>::MarkDirty;
+    using BPNode<V, BranchFactor>::SetIndex;
     using BPNode<V, BranchFactor>::m_index;
-    using BPNode<V, BranchFactor>::m_dir;
+    using BPNode<V, BranchFactor>::m_storage;
     using BPNode<V, BranchFactor>::m_cache;
     using BPNode<V, BranchFactor>::m_mutex;
 
-    void ReadValues(std::ifstream& in)
+    void ReadValues(std::istream& in)
     {
+        std::vector<V> values;
+
         if constexpr (std::is_same_v<V, std::string>)
         {
             for (uint32_t i = 0; i < m_keyCount; i++)
@@ -70,7 +137,7 @@ private:
                 auto buf = std::make_unique<char[]>(size + 1);
                 in.read(buf.get(), size);
                 buf.get()[size] = '\0';
-                m_values.emplace_back(buf.get());
+                values.emplace_back(buf.get());
             }
         }
         else if constexpr (std::is_same_v<V, std::vector<char>>)
@@ -83,27 +150,29 @@ private:
 
                 auto buf = std::make_unique<char[]>(size);
                 in.read(buf.get(), size);
-                m_values.emplace_back(buf.get(), buf.get() + size);
+                values.emplace_back(buf.get(), buf.get() + size);
             }
         }
         else if constexpr (std::is_same_v<V, float> || std::is_same_v<V, double> || std::is_same_v<V, uint32_t> || std::is_same_v<V, uint64_t>)
         {
             uint32_t sz = static_cast<uint32_t>(sizeof(V)) * m_keyCount;
-            m_values.resize(sz);
-            in.read(reinterpret_cast<char*>(m_values.data()), sz);
+            values.resize(m_keyCount);
+            in.read(reinterpret_cast<char*>(values.data()), sz);
 
             for (uint32_t i = 0; i < m_keyCount; i++)
             {
-                LittleToNativeEndianInplace(m_values[i]);
+                LittleToNativeEndianInplace(values[i]);
             }
         }
         else
         {
-            static_assert(false, "Type must be string, blob, float, double or uint");
+            static_assert(AlwaysFalse<V>, "Type must be string, blob, float, double or uint");
         }
+
+        m_values.assign(std::move(values));
     }
 
-    void WriteValues(std::ofstream& out)
+    void WriteValues(std::ostream& out) const
     {
         if constexpr (std::is_same_v<V, std::string> || std::is_same_v<V , std::vector<char>>)
         {
@@ -124,13 +193,16 @@ private:
         }
         else
         {
-            static_assert(false, "Type must be string, blob, float, double or uint");
+            static_assert(AlwaysFalse<V>, "Type must be string, blob, float, double or uint");
         }
     }
 
 private:
-    std::vector<V> m_values;
+    LeafValues<V, BranchFactor - 1> m_values;
     FileIndex m_nextBatch{ 0 };
+
+    // Deletion time of every key, 0 if key has no TTL. Empty if no key has TTL.
+    std::vector<uint64_t> m_expiries;
 };
 
 //-------------------------------------------------------------------------------
@@ -162,68 +234,244 @@ std::shared_ptr<BPNode<V, BranchFactor>> Leaf<V, BranchFactor>::GetFirstLeaf()
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
-void Leaf<V, BranchFactor>::Insert(Key key, const V& value, uint32_t pos)
+std::shared_ptr<BPNode<V, BranchFactor>> Leaf<V, BranchFactor>::FindLeaf(Key)
+{
+    return shared_from_this();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Leaf<V, BranchFactor>::Insert(Key key, const V& value, uint32_t pos, uint64_t expiry)
 {
-    InsertToArray(m_keys, pos, key);
-    m_values.insert(m_values.begin() + pos, value);
+    if (expiry != 0 || !m_expiries.empty())
+    {
+        m_expiries.resize(m_keyCount);
+        m_expiries.insert(m_expiries.begin() + pos, expiry);
+    }
+
+    InsertToArray(m_keys, m_keyCount, pos, key);
+    m_values.insert(pos, value);
     m_keyCount++;
-    m_dirty = true;
+    MarkDirty();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Leaf<V, BranchFactor>::Remove(uint32_t pos)
+{
+    if (!m_expiries.empty())
+        m_expiries.erase(m_expiries.begin() + pos);
+
+    RemoveFromArray(m_keys, m_keyCount, pos);
+    m_values.erase(pos);
+    m_keyCount--;
+    MarkDirty();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+uint32_t Leaf<V, BranchFactor>::RemoveOutdated(uint64_t now, std::optional<Key> key)
+{
+    if (m_expiries.empty())
+        return 0;
+
+    uint32_t removed = 0;
+    for (uint32_t i = m_keyCount; i-- > 0;)
+    {
+        if (!IsOutdated(i, now))
+            continue;
+
+        if (m_index != 1 && m_keyCount <= Half(BranchFactor) && m_keys[i] != key)
+            continue;
+
+        Remove(i);
+        removed++;
+    }
+
+    if (std::all_of(m_expiries.begin(), m_expiries.end(), [](uint64_t expiry) { return expiry == 0; }))
+        m_expiries.clear();
+
+    return removed;
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+template<class It>
+std::vector<Key> Leaf<V, BranchFactor>::DeleteSorted(It& first, It last)
+{
+    std::vector<Key> deleted;
+
+    for (bool routed = true; first != last; ++first, routed = false)
+    {
+        const Key key = *first;
+        if (!routed && (m_keyCount == 0 || key > m_keys[m_keyCount - 1]))
+            break;
+
+        const uint32_t pos = LowerBound(m_keys, m_keyCount, key);
+        if (pos == m_keyCount || m_keys[pos] != key)
+            continue;
+
+        // Rebalancing is left to the caller.
+        if (m_index != 1 && m_keyCount <= Half(BranchFactor))
+            break;
+
+        Remove(pos);
+        deleted.push_back(key);
+    }
+
+    return deleted;
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+uint32_t Leaf<V, BranchFactor>::Aggregate(uint32_t first, uint32_t last, uint64_t now, AggregateSum<V>& sum, V& min, V& max) const
+{
+    if (first >= last)
+        return 0;
+
+    if (m_expiries.empty())
+    {
+        AggregateValues(m_values.data() + first, last - first, sum, min, max);
+        return last - first;
+    }
+
+    uint32_t count = 0;
+    for (uint32_t i = first; i < last; i++)
+    {
+        if (!IsOutdated(i, now))
+        {
+            AggregateValues(&m_values[i], 1, sum, min, max);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+const V* Leaf<V, BranchFactor>::Find(Key key, uint64_t now) const
+{
+    const uint32_t pos = LowerBound(m_keys, m_keyCount, key);
+    if (pos == m_keyCount || m_keys[pos] != key || IsOutdated(pos, now))
+        return nullptr;
+
+    return &m_values[pos];
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+bool Leaf<V, BranchFactor>::Contains(Key key) const
+{
+    const uint32_t pos = LowerBound(m_keys, m_keyCount, key);
+    return pos < m_keyCount && m_keys[pos] == key;
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+std::optional<uint64_t> Leaf<V, BranchFactor>::Update(Key key, const V& value, std::optional<uint64_t> expiry, uint64_t now)
+{
+    const uint32_t pos = LowerBound(m_keys, m_keyCount, key);
+    if (pos == m_keyCount || m_keys[pos] != key || IsOutdated(pos, now))
+        return std::nullopt;
+
+    m_values[pos] = value;
+    if (expiry && (*expiry != 0 || !m_expiries.empty()))
+    {
+        m_expiries.resize(m_keyCount);
+        m_expiries[pos] = *expiry;
+    }
+
+    MarkDirty();
+    return GetExpiry(pos);
 }
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
-std::optional<CreatedBPNode<V, BranchFactor>> Leaf<V, BranchFactor>::Put(Key key, const V& val, IndexManager& indexManager)
+bool Leaf<V, BranchFactor>::TryApply(Key key, const std::optional<V>& value, bool& found)
 {
     constexpr auto MaxKeys = BranchFactor - 1;
-    if (m_keyCount == MaxKeys)
+
+    const uint32_t pos = LowerBound(m_keys, m_keyCount, key);
+    found = pos < m_keyCount && m_keys[pos] == key;
+
+    if (value)
     {
-        if (m_index == 1)
+        if (found)
         {
-            m_index = indexManager.FindFreeIndex(m_dir);
+            m_values[pos] = *value;
+            if (!m_expiries.empty())
+                m_expiries[pos] = 0;
+            MarkDirty();
+            return true;
         }
 
-        return SplitAndPut(key, val, indexManager);
+        if (m_keyCount == MaxKeys)
+            return false;
+
+        Insert(key, *value, pos);
+        return true;
     }
 
-    if (m_keyCount == 0)
+    if (!found)
+        return true;
+
+    if (m_index != 1 && m_keyCount <= Half(BranchFactor))
+        return false;
+
+    Remove(pos);
+    return true;
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+std::vector<uint64_t> Leaf<V, BranchFactor>::JoinExpiries(const Leaf<V, BranchFactor>& left, const Leaf<V, BranchFactor>& right)
+{
+    std::vector<uint64_t> expiries;
+    if (left.m_expiries.empty() && right.m_expiries.empty())
+        return expiries;
+
+    expiries.reserve(left.m_keyCount + right.m_keyCount);
+    for (uint32_t i = 0; i < left.m_keyCount; i++)
     {
-        Insert(key, val, 0);
+        expiries.push_back(left.GetExpiry(i));
     }
-    else
+    for (uint32_t i = 0; i < right.m_keyCount; i++)
     {
-        for (uint32_t i = 0; i < m_keyCount; i++)
-        {
-            auto currentKey = m_keys[i];
+        expiries.push_back(right.GetExpiry(i));
+    }
 
-            if (key < currentKey)
-            {
-                if (m_keyCount != MaxKeys)
-                {
-                    Insert(key, val, i);
-                }
-                else
-                {
-                    throw std::runtime_error("Try to insert value to fullfilled Leaf");
-                }
-
-                return std::nullopt;
-            }
+    return expiries;
+}
 
-            if (currentKey == key)
-            {
-                throw std::runtime_error("Couldn't insert exising key");
-            }
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+std::optional<CreatedBPNode<V, BranchFactor>> Leaf<V, BranchFactor>::Put(Key key, const V& val, IndexManager& indexManager, uint64_t expiry)
+{
+    constexpr auto MaxKeys = BranchFactor - 1;
+
+    const uint32_t pos = LowerBound(m_keys, m_keyCount, key);
+    if (pos < m_keyCount && m_keys[pos] == key)
+        throw std::runtime_error("Couldn't insert exising key");
+
+    if (m_keyCount == MaxKeys)
+    {
+        if (m_index == 1)
+        {
+            SetIndex(indexManager.FindFreeIndex());
         }
 
-        Insert(key, val, m_keyCount);
+        return SplitAndPut(key, val, indexManager, expiry);
     }
 
+    Insert(key, val, pos, expiry);
+
     return std::nullopt;
 }
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
-CreatedBPNode<V, BranchFactor> Leaf<V, BranchFactor>::SplitAndPut(Key key, const V& value, IndexManager& indexManager)
+CreatedBPNode<V, BranchFactor> Leaf<V, BranchFactor>::SplitAndPut(Key key, const V& value, IndexManager& indexManager, uint64_t expiry)
 {
     constexpr auto MaxKeys = BranchFactor - 1;
 
@@ -232,13 +480,16 @@ CreatedBPNode<V, BranchFactor> Leaf<V, BranchFactor>::SplitAndPut(Key key, const
     std::array<Key, MaxKeys> newKeys;
     newKeys.fill(0);
 
-    std::vector<V> newValues;
-
     uint32_t borderIndex = static_cast<uint32_t>(m_values.size()) - copyCount;
 
-    newValues.insert(newValues.end(), std::make_move_iterator(m_values.begin() + borderIndex),
-        std::make_move_iterator(m_values.end()));
-    m_values.erase(m_values.begin() + borderIndex, m_values.end());
+    std::vector<V> newValues = m_values.take_tail(borderIndex);
+
+    std::vector<uint64_t> newExpiries;
+    if (!m_expiries.empty())
+    {
+        newExpiries.assign(m_expiries.begin() + borderIndex, m_expiries.end());
+        m_expiries.resize(borderIndex);
+    }
 
     std::swap(m_keys[borderIndex], newKeys[0]);
 
@@ -248,21 +499,23 @@ CreatedBPNode<V, BranchFactor> Leaf<V, BranchFactor>::SplitAndPut(Key key, const
     }
 
     m_keyCount -= copyCount;
+    MarkDirty();
 
     Key firstNewKey = newKeys[0];
 
-    auto nodesCount = indexManager.FindFreeIndex(m_dir);
-    auto newLeaf = std::make_shared<Leaf>(m_dir, m_cache, nodesCount, copyCount, std::move(newKeys), std::move(newValues), m_nextBatch);
+    auto nodesCount = indexManager.FindFreeIndex();
+    auto newLeaf = std::make_shared<Leaf>(m_storage, m_cache, nodesCount, copyCount, std::move(newKeys), std::move(newValues), m_nextBatch);
+    newLeaf->m_expiries = std::move(newExpiries);
 
     m_nextBatch = newLeaf->m_index;
 
     if (key < firstNewKey)
     {
-        Put(key, value, indexManager);
+        Put(key, value, indexManager, expiry);
     }
     else
     {
-        newLeaf->Put(key, value, indexManager);
+        newLeaf->Put(key, value, indexManager, expiry);
     }
 
     m_cache.lock()->insert(nodesCount, newLeaf);
@@ -273,13 +526,9 @@ CreatedBPNode<V, BranchFactor> Leaf<V, BranchFactor>::SplitAndPut(Key key, const
 template<class V, size_t BranchFactor>
 std::optional<V> Leaf<V, BranchFactor>::Get(Key key) const
 {
-    for (size_t i = 0; i < m_keyCount; i++)
-    {
-        if (m_keys[i] == key)
-        {
-            return m_values[i];
-        }
-    }
+    const uint32_t pos = LowerBound(m_keys, m_keyCount, key);
+    if (pos < m_keyCount && m_keys[pos] == key && (m_expiries.empty() || !IsOutdated(pos, CurrentUnixTime())))
+        return m_values[pos];
 
     return std::nullopt;
 }
@@ -294,111 +543,113 @@ void Leaf<V, BranchFactor>::LeftJoin(const Leaf<V, BranchFactor>& leaf)
     {
         newKeys[i] = m_keys[i - leaf.m_keyCount];
     }
+    m_expiries = JoinExpiries(leaf, *this);
     m_keys = std::move(newKeys);
-    m_values.insert(m_values.begin(), leaf.m_values.begin(), leaf.m_values.end());
+    m_values.insert(0, leaf.m_values);
     m_keyCount += leaf.m_keyCount;
-    m_index = leaf.m_index;
+    SetIndex(leaf.m_index);
 }
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
 void Leaf<V, BranchFactor>::RightJoin(const Leaf<V, BranchFactor>& leaf)
 {
+    m_expiries = JoinExpiries(*this, leaf);
     for (uint32_t i = m_keyCount; i <= m_keyCount + leaf.m_keyCount - 1; i++)
     {
         m_keys[i] = leaf.m_keys[i - m_keyCount];
     }
 
-    m_values.insert(m_values.end(), leaf.m_values.begin(), leaf.m_values.end());
+    m_values.insert(m_values.size(), leaf.m_values);
     m_keyCount += leaf.m_keyCount;
     m_nextBatch = leaf.m_nextBatch;
 }
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
-std::shared_ptr<BPNode<V, BranchFactor>> CreateBPNode(const fs::path& dir, BPCache<V, BranchFactor>& cache, FileIndex idx);
+std::shared_ptr<BPNode<V, BranchFactor>> CreateBPNode(const std::shared_ptr<NodeStorage>& storage, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx);
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
 DeleteResult<V, BranchFactor> Leaf<V, BranchFactor>::Delete(Key key, std::optional<Sibling> leftSibling, std::optional<Sibling> rightSibling, IndexManager& indexManager)
 {
-    for (size_t i = 0; i < m_keyCount; i++)
+    const uint32_t i = LowerBound(m_keys, m_keyCount, key);
+    if (i == m_keyCount || m_keys[i] != key)
+        throw std::runtime_error("Failed to remove unexisted value of key '" + std::to_string(key) + "'");
+
+    // 1. First of all remove key and value.
+    Remove(i);
+
+    // 2. Check key count.
+    // If we have too few keys and this leaf is not root we should make some additional changes.
+    if (m_index == 1 || m_keyCount >= Half(BranchFactor))
     {
-        if (m_keys[i] == key)
-        {
-            // 1. First of all remove key and value.
-            RemoveFromArray(m_keys, i);
-            m_values.erase(m_values.begin() + i);
-            m_keyCount--;
-            m_dirty = true;
-
-            // 2. Check key count.
-            // If we have too few keys and this leaf is not root we should make some additional changes.
-            if (m_index == 1 || m_keyCount >= Half(BranchFactor))
-            {
-                return { DeleteType::Deleted, std::nullopt };
-            }
+        return { DeleteType::Deleted, std::nullopt };
+    }
 
-            std::shared_ptr<Leaf> leftSiblingLeaf;
-            std::shared_ptr<Leaf> rightSiblingLeaf;
+    std::shared_ptr<Leaf> leftSiblingLeaf;
+    std::shared_ptr<Leaf> rightSiblingLeaf;
 
-            // 3. If left sibling has enough keys we can simple borrow the entry.
-            if (leftSibling)
-            {
-                leftSiblingLeaf = std::static_pointer_cast<Leaf<V, BranchFactor>>(CreateBPNode<V, BranchFactor>(m_dir, m_cache, leftSibling->index));
-
-                if (leftSiblingLeaf->m_keyCount > Half(BranchFactor))
-                {
-                    auto key = leftSiblingLeaf->GetLastKey();
-                    auto value = leftSiblingLeaf->m_values[leftSiblingLeaf->m_keyCount - 1];
-                    Insert(key, value, 0);
-                    leftSiblingLeaf->Delete(key, std::nullopt, std::nullopt, indexManager);
-                    return { DeleteType::BorrowedLeft, m_keys[0] };
-                }
-            }
+    // Siblings may be modified by writers which have already released the parent, so lock them too.
+    boost::unique_lock<NodeLatch> leftSiblingLock;
+    boost::unique_lock<NodeLatch> rightSiblingLock;
 
-            // 4. If right sibling has enough keys we can simple borrow the entry.
-            if (rightSibling)
-            {
-                rightSiblingLeaf = std::static_pointer_cast<Leaf>(CreateBPNode<V, BranchFactor>(m_dir, m_cache, rightSibling->index));
-
-                if (rightSiblingLeaf->m_keyCount > Half(BranchFactor))
-                {
-                    auto key = rightSiblingLeaf->m_keys[0];
-                    auto value = rightSiblingLeaf->m_values[0];
-                    Insert(key, value, m_keyCount);
-                    rightSiblingLeaf->Delete(key, std::nullopt, std::nullopt, indexManager);
-                    return { DeleteType::BorrowedRight, rightSiblingLeaf->m_keys[0] };
-                }
-            }
+    // 3. If left sibling has enough keys we can simple borrow the entry.
+    if (leftSibling)
+    {
+        leftSiblingLeaf = std::static_pointer_cast<Leaf<V, BranchFactor>>(CreateBPNode<V, BranchFactor>(m_storage, m_cache, leftSibling->index));
+        leftSiblingLock = boost::unique_lock<NodeLatch>(leftSiblingLeaf->m_mutex);
 
-            // 5. Both siblngs have too few keys. We should merge this leaf and sibling.
-            if (leftSibling)
-            {
-                const auto currentIndex = m_index;
-                LeftJoin(*leftSiblingLeaf);
-                m_cache.lock()->erase(currentIndex);
-                indexManager.Remove(m_dir, currentIndex);
+        if (leftSiblingLeaf->m_keyCount > Half(BranchFactor))
+        {
+            auto key = leftSiblingLeaf->GetLastKey();
+            auto value = leftSiblingLeaf->m_values[leftSiblingLeaf->m_keyCount - 1];
+            Insert(key, value, 0, leftSiblingLeaf->GetExpiry(leftSiblingLeaf->m_keyCount - 1));
+            leftSiblingLeaf->Delete(key, std::nullopt, std::nullopt, indexManager);
+            return { DeleteType::BorrowedLeft, m_keys[0] };
+        }
+    }
 
-                return { DeleteType::MergedLeft, m_keys[0] };
-            }
-            else if (rightSibling)
-            {
-                RightJoin(*rightSiblingLeaf);
-                m_cache.lock()->erase(rightSiblingLeaf->GetIndex());
-                indexManager.Remove(m_dir, rightSiblingLeaf->GetIndex());
-                rightSiblingLeaf->MarkAsDeleted();
+    // 4. If right sibling has enough keys we can simple borrow the entry.
+    if (rightSibling)
+    {
+        rightSiblingLeaf = std::static_pointer_cast<Leaf>(CreateBPNode<V, BranchFactor>(m_storage, m_cache, rightSibling->index));
+        rightSiblingLock = boost::unique_lock<NodeLatch>(rightSiblingLeaf->m_mutex);
 
-                return { DeleteType::MergedRight, m_keys[0] };
-            }
-            else
-            {
-                throw std::runtime_error("Bad leaf status");
-            }
+        if (rightSiblingLeaf->m_keyCount > Half(BranchFactor))
+        {
+            auto key = rightSiblingLeaf->m_keys[0];
+            auto value = rightSiblingLeaf->m_values[0];
+            Insert(key, value, m_keyCount, rightSiblingLeaf->GetExpiry(0));
+            rightSiblingLeaf->Delete(key, std::nullopt, std::nullopt, indexManager);
+            return { DeleteType::BorrowedRight, rightSiblingLeaf->m_keys[0] };
         }
     }
 
-    throw std::runtime_error("Failed to remove unexisted value of key '" + std::to_string(key) + "'");
+    // 5. Both siblngs have too few keys. We should merge this leaf and sibling.
+    if (leftSibling)
+    {
+        const auto currentIndex = m_index;
+        LeftJoin(*leftSiblingLeaf);
+        m_cache.lock()->erase(currentIndex);
+        indexManager.Remove(currentIndex);
+        leftSiblingLeaf->MarkAsDeleted();
+
+        return { DeleteType::MergedLeft, m_keys[0] };
+    }
+    else if (rightSibling)
+    {
+        RightJoin(*rightSiblingLeaf);
+        m_cache.lock()->erase(rightSiblingLeaf->GetIndex());
+        indexManager.Remove(rightSiblingLeaf->GetIndex());
+        rightSiblingLeaf->MarkAsDeleted();
+
+        return { DeleteType::MergedRight, m_keys[0] };
+    }
+    else
+    {
+        throw std::runtime_error("Bad leaf status");
+    }
 }
 
 //-------------------------------------------------------------------------------
@@ -410,18 +661,12 @@ Key Leaf<V, BranchFactor>::GetMinimum() const
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
-void Leaf<V, BranchFactor>::Flush()
+std::string Leaf<V, BranchFactor>::Serialize() const
 {
-    boost::unique_lock<boost::shared_mutex> lock(m_mutex);
-
-    if (!m_dirty)
-        return;
-
-    std::ofstream out;
-    out.exceptions(~std::ofstream::goodbit);
-    out.open(m_dir / ("batch_" + std::to_string(m_index) + ".dat"), std::ios::out | std::ios::binary | std::ios::trunc);
+    std::ostringstream out(std::ios::out | std::ios::binary);
 
-    out.write("9", 1);
+    const bool withExpiries = std::any_of(m_expiries.begin(), m_expiries.end(), [](uint64_t expiry) { return expiry != 0; });
+    out.write(withExpiries ? "T" : "9", 1);
 
     auto keyCount = boost::endian::native_to_little(m_keyCount);
     out.write(reinterpret_cast<char*>(&keyCount), sizeof(keyCount));
@@ -436,22 +681,31 @@ void Leaf<V, BranchFactor>::Flush()
 
     auto nextBatch = boost::endian::native_to_little(m_nextBatch);
     out.write(reinterpret_cast<char*>(&(nextBatch)), sizeof(nextBatch));
-    out.close();
-    m_dirty = false;
+
+    if (withExpiries)
+    {
+        for (uint32_t i = 0; i < m_keyCount; i++)
+        {
+            auto expiry = boost::endian::native_to_little(m_expiries[i]);
+            out.write(reinterpret_cast<char*>(&expiry), sizeof(expiry));
+        }
+    }
+
+    return out.str();
 }
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
-void Leaf<V, BranchFactor>::Load()
+void Leaf<V, BranchFactor>::Load(std::istream& in)
 {
-    boost::unique_lock<boost::shared_mutex> lock(m_mutex);
-
-    std::ifstream in;
-    in.exceptions(~std::ofstream::goodbit);
-    in.open(m_dir / ("batch_" + std::to_string(m_index) + ".dat"), std::ios::in | std::ios::binary);
+    Load(in, false);
+}
 
-    // TODO: check first char is "9"
-    in.seekg(1);
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Leaf<V, BranchFactor>::Load(std::istream& in, bool withExpiries)
+{
+    boost::unique_lock<NodeLatch> lock(m_mutex);
 
     in.read(reinterpret_cast<char*>(&(m_keyCount)), sizeof(m_keyCount));
     in.read(reinterpret_cast<char*>(&(m_keys)), sizeof(m_keys));
@@ -467,6 +721,19 @@ void Leaf<V, BranchFactor>::Load()
 
     in.read(reinterpret_cast<char*>(&(m_nextBatch)), sizeof(m_nextBatch));
     boost::endian::little_to_native_inplace(m_nextBatch);
+
+    m_expiries.clear();
+    if (withExpiries)
+    {
+        m_expiries.resize(m_keyCount);
+        in.read(reinterpret_cast<char*>(m_expiries.data()), m_keyCount * sizeof(uint64_t));
+
+        for (auto& expiry : m_expiries)
+        {
+            boost::endian::little_to_native_inplace(expiry);
+        }
+    }
+
     m_dirty = false;
 }
 
@@ -1,7 +1,9 @@
 #ifndef NODE_H
 #define NODE_H
 
-#include <fstream>
+#include <sstream>
+#include <thread>
+#include <algorithm>
 
 #include "leaf.h"
 
@@ -16,31 +18,43 @@ template<class V, size_t BranchFactor>
 class Node : public BPNode<V, BranchFactor>, public std::enable_shared_from_this<BPNode<V, BranchFactor>>
 {
 public:
-    Node(const fs::path& dir, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx)
-        : BPNode<V, BranchFactor>(dir, cache, idx)
+    template<class, size_t> friend class Volume;
+
+    Node(std::shared_ptr<NodeStorage> storage, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx)
+        : BPNode<V, BranchFactor>(std::move(storage), cache, idx)
     {
         m_ptrs.fill(0);
     }
 
-    Node(const fs::path& dir, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx, uint32_t newKeyCount, std::array<Key, BranchFactor - 1>&& newKeys, std::array<FileIndex, BranchFactor>&& newPtrs)
-        : BPNode<V, BranchFactor>(dir, cache, idx, newKeyCount, std::move(newKeys))
+    Node(std::shared_ptr<NodeStorage> storage, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx, uint32_t newKeyCount, std::array<Key, BranchFactor - 1>&& newKeys, std::array<FileIndex, BranchFactor>&& newPtrs)
+        : BPNode<V, BranchFactor>(std::move(storage), cache, idx, newKeyCount, std::move(newKeys))
         , m_ptrs(newPtrs)
     {}
 
     virtual ~Node();
 
-    virtual void Load() override;
-    virtual void Flush() override;
+    virtual void Load(std::istream& in) override;
     virtual std::optional<V> Get(Key key) const override;
     virtual Key GetMinimum() const override;
     virtual std::shared_ptr<BPNode<V, BranchFactor>> GetFirstLeaf() override;
+    virtual std::shared_ptr<BPNode<V, BranchFactor>> FindLeaf(Key key) override;
     virtual bool IsLeaf() const override;
+    virtual std::string Serialize() const override;
+
+    using BPNode<V, BranchFactor>::Flush;
 
     std::optional<CreatedBPNode<V, BranchFactor>> Put(Key key, const CreatedBPNode<V, BranchFactor>& newNode, IndexManager& indexManager);
     DeleteResult<V, BranchFactor> Delete(Key key, std::optional<Sibling> leftSibling, std::optional<Sibling> rightSibling, const DeleteResult<V, BranchFactor>& deleteResult, uint32_t childPos, std::shared_ptr<BPNode<V, BranchFactor>> foundChild, IndexManager& indexManager);
     std::shared_ptr<BPNode<V, BranchFactor>> GetChildByKey(Key key) const;
+
+    // File index of the child which may contain the key. Can be called without the latch during
+    // optimistic reads, so result must be validated with node version before use.
+    FileIndex GetChildIndex(Key key) const;
     std::shared_ptr<BPNode<V, BranchFactor>> GetChildByKey(Key key, std::optional<Sibling>& leftSibling, std::optional<Sibling>& rightSibling, uint32_t& childPos) const;
 
+    // Key after the range of the child which may contain the key. Empty for the last child.
+    std::optional<Key> GetUpperBound(Key key) const;
+
 private:
     uint32_t FindKeyPosition(Key key) const;
 
@@ -48,8 +62,10 @@ private:
     using BPNode<V, BranchFactor>::m_keyCount;
     using BPNode<V, BranchFactor>::m_keys;
     using BPNode<V, BranchFactor>::m_dirty;
+    using BPNode<V, BranchFactor>::MarkDirty;
+    using BPNode<V, BranchFactor>::SetIndex;
     using BPNode<V, BranchFactor>::m_index;
-    using BPNode<V, BranchFactor>::m_dir;
+    using BPNode<V, BranchFactor>::m_storage;
     using BPNode<V, BranchFactor>::m_cache;
     using BPNode<V, BranchFactor>::m_mutex;
 
@@ -98,14 +114,14 @@ std::shared_ptr<BPNode<V, BranchFactor>> Node<V, BranchFactor>::GetChildByKey(Ke
         }
     }
 
-    return CreateBPNode<V, BranchFactor>(m_dir, m_cache, m_ptrs[childPos]);
+    return CreateBPNode<V, BranchFactor>(m_storage, m_cache, m_ptrs[childPos]);
 }
 
 //-------------------------------------------------------------------------------
 template <class V, size_t BranchFactor>
 std::shared_ptr<BPNode<V, BranchFactor>> Node<V, BranchFactor>::GetChildByKey(Key key) const
 {
-    return CreateBPNode<V, BranchFactor>(m_dir, m_cache, m_ptrs[FindKeyPosition(key)]);
+    return CreateBPNode<V, BranchFactor>(m_storage, m_cache, m_ptrs[FindKeyPosition(key)]);
 }
 
 //-------------------------------------------------------------------------------
@@ -137,53 +153,24 @@ std::optional<CreatedBPNode<V, BranchFactor>> Node<V, BranchFactor>::Put(Key key
         }
 
         m_keyCount -= copyCount;
-        m_dirty = true;
+        MarkDirty();
 
         const auto insert = [](uint32_t& count, std::array<Key, MaxKeys>& keys, std::array<FileIndex, B>& ptrs, Key newKey, FileIndex newIdx)
         {
-            for (uint32_t i = 0; i < count; i++)
-            {
-                auto currentKey = keys[i];
-
-                if (newKey >= currentKey)
-                    continue;
-
-                InsertToArray(keys, i, newKey);
-                InsertToArray(ptrs, i, newIdx);
-                count++;
-                return;
-            }
-
-            InsertToArray(keys, count, newKey);
-            InsertToArray(ptrs, count, newIdx);
+            const auto pos = UpperBound(keys, count, newKey);
+            InsertToArray(keys, count, pos, newKey);
+            InsertToArray(ptrs, count, pos, newIdx);
             count++;
         };
 
         Key firstNewKey = newNode.key;
         if (key < newKeys[0])
         {
-            bool found = false;
             // insert to this
-            for (uint32_t i = 0; i < m_keyCount; i++)
-            {
-                auto currentKey = m_keys[i];
-
-                if (firstNewKey >= currentKey)
-                    continue;
-
-                InsertToArray(m_keys, i, firstNewKey);
-                InsertToArray(m_ptrs, i + 1, newNode.node->GetIndex());
-                m_keyCount++;
-                found = true;
-                break;
-            }
-
-            if (!found)
-            {
-                InsertToArray(m_keys, m_keyCount, firstNewKey);
-                InsertToArray(m_ptrs, m_keyCount + 1, newNode.node->GetIndex());
-                m_keyCount++;
-            }
+            const auto pos = FindKeyPosition(firstNewKey);
+            InsertToArray(m_keys, m_keyCount, pos, firstNewKey);
+            InsertToArray(m_ptrs, m_keyCount + 1, pos + 1, newNode.node->GetIndex());
+            m_keyCount++;
         }
         else
         {
@@ -192,39 +179,28 @@ std::optional<CreatedBPNode<V, BranchFactor>> Node<V, BranchFactor>::Put(Key key
         }
 
         auto keyToDelete = newKeys[0];
-        RemoveFromArray(newKeys, 0);
+        RemoveFromArray(newKeys, copyCount, 0);
         copyCount--;
 
-        auto nodesCount = indexManager.FindFreeIndex(m_dir);
-        auto newNode = std::make_shared<Node>(m_dir, m_cache, nodesCount, copyCount, std::move(newKeys), std::move(newPtrs));
+        auto nodesCount = indexManager.FindFreeIndex();
+        auto newNode = std::make_shared<Node>(m_storage, m_cache, nodesCount, copyCount, std::move(newKeys), std::move(newPtrs));
         m_cache.lock()->insert(nodesCount, newNode);
 
         if (m_index == 1)
         {
-            m_index = indexManager.FindFreeIndex(m_dir);
+            SetIndex(indexManager.FindFreeIndex());
         }
 
         return std::optional<CreatedBPNode<V, BranchFactor>>({ std::move(newNode), keyToDelete });
     }
     else
     {
-        m_dirty = true;
+        MarkDirty();
         Key keyForInsert = newNode.key;
 
-        for (uint32_t i = 0; i < m_keyCount; i++)
-        {
-            if (keyForInsert < m_keys[i])
-            {
-                InsertToArray(m_keys, i, keyForInsert);
-                InsertToArray(m_ptrs, i + 1, newNode.node->GetIndex());
-                m_keyCount++;
-
-                return std::nullopt;
-            }
-        }
-
-        InsertToArray(m_keys, m_keyCount, keyForInsert);
-        InsertToArray(m_ptrs, m_keyCount + 1, newNode.node->GetIndex());
+        const auto pos = FindKeyPosition(keyForInsert);
+        InsertToArray(m_keys, m_keyCount, pos, keyForInsert);
+        InsertToArray(m_ptrs, m_keyCount + 1, pos + 1, newNode.node->GetIndex());
         m_keyCount++;
 
         return std::nullopt;
@@ -235,45 +211,160 @@ std::optional<CreatedBPNode<V, BranchFactor>> Node<V, BranchFactor>::Put(Key key
 template<class V, size_t BranchFactor>
 uint32_t Node<V, BranchFactor>::FindKeyPosition(Key key) const
 {
-    for (uint32_t i = 0; i < m_keyCount; i++)
+    return UpperBound(m_keys, m_keyCount, key);
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+std::optional<Key> Node<V, BranchFactor>::GetUpperBound(Key key) const
+{
+    const uint32_t pos = FindKeyPosition(key);
+    if (pos == m_keyCount)
+        return std::nullopt;
+
+    return m_keys[pos];
+}
+
+//-------------------------------------------------------------------------------
+template <class V, size_t BranchFactor>
+FileIndex Node<V, BranchFactor>::GetChildIndex(Key key) const
+{
+    return m_ptrs[FindKeyPosition(key)];
+}
+
+//-------------------------------------------------------------------------------
+// Search key in the subtree with shared lock coupling. 'lock' must hold latch of 'node'.
+template<class V, size_t BranchFactor>
+std::optional<V> LockedGet(const BPNode<V, BranchFactor>* node, boost::shared_lock<NodeLatch> lock, Key key)
+{
+    std::shared_ptr<const BPNode<V, BranchFactor>> holder;
+
+    while (!node->IsLeaf())
     {
-        if (key < m_keys[i])
+        auto child = static_cast<const Node<V, BranchFactor>*>(node)->GetChildByKey(key);
+
+        boost::shared_lock<NodeLatch> childLock(child->m_mutex);
+        lock = std::move(childLock);
+
+        holder = std::move(child);
+        node = holder.get();
+    }
+
+    return node->Get(key);
+}
+
+//-------------------------------------------------------------------------------
+// Search sorted keys [first, last) in the subtree with shared lock coupling. Keys are split
+// between children, so every node is visited once. All needed children of a node are loaded
+// before the first of them is searched, keys of the next child are prefetched. 'node' must be latched by caller. Pairs of keys and
+// positions in 'values' where their results are stored.
+template<class V, size_t BranchFactor>
+void LockedMultiGet(const BPNode<V, BranchFactor>* node, const std::pair<Key, size_t>* first, const std::pair<Key, size_t>* last, std::vector<std::optional<V>>& values)
+{
+    if (node->IsLeaf())
+    {
+        for (; first != last; ++first)
         {
-            return i;
+            values[first->second] = node->Get(first->first);
         }
+        return;
     }
 
-    return m_keyCount;
+    const auto parent = static_cast<const Node<V, BranchFactor>*>(node);
+
+    // Children with the first key of their group.
+    std::vector<std::pair<std::shared_ptr<BPNode<V, BranchFactor>>, const std::pair<Key, size_t>*>> children;
+    for (auto it = first; it != last;)
+    {
+        children.emplace_back(parent->GetChildByKey(it->first), it);
+
+        const auto bound = parent->GetUpperBound(it->first);
+        it = bound ? std::lower_bound(it, last, *bound, [](const std::pair<Key, size_t>& lhs, Key rhs) { return lhs.first < rhs; }) : last;
+    }
+
+    // Keys of the next child are loaded to CPU cache while the current one is searched.
+    if (!children.empty())
+        children.front().first->Prefetch();
+
+    for (size_t i = 0; i < children.size(); i++)
+    {
+        const auto& [child, groupFirst] = children[i];
+        const auto groupLast = i + 1 < children.size() ? children[i + 1].second : last;
+        if (i + 1 < children.size())
+            children[i + 1].first->Prefetch();
+
+        boost::shared_lock<NodeLatch> lock(child->m_mutex);
+        LockedMultiGet<V, BranchFactor>(child.get(), groupFirst, groupLast, values);
+    }
 }
 
 //-------------------------------------------------------------------------------
+// Search key in the subtree without locking internal nodes. Every node is validated by its
+// version after reading, leaf is read under shared latch because values may be reallocated
+// by writers. 'version' is version of 'node' which is read by caller.
+// Return false if some node has been modified by a writer - caller should repeat search.
 template<class V, size_t BranchFactor>
-std::optional<V> Node<V, BranchFactor>::Get(Key key) const
+bool TryOptimisticGet(const BPNode<V, BranchFactor>* node, uint64_t version, BPCache<V, BranchFactor>& cache, Key key, std::optional<V>& value)
 {
-    std::shared_ptr<const BPNode<V, BranchFactor>> current = shared_from_this();
-    auto firstLock = std::make_unique<boost::shared_lock<boost::shared_mutex>>(current->m_mutex);
-    std::unique_ptr<boost::shared_lock<boost::shared_mutex>> secondLock;
+    std::shared_ptr<const BPNode<V, BranchFactor>> holder;
 
-    while (true)
+    while (!node->IsLeaf())
     {
-        if (!current->IsLeaf())
+        const auto childIndex = static_cast<const Node<V, BranchFactor>*>(node)->GetChildIndex(key);
+        if (!node->m_mutex.Validate(version))
+            return false;
+
+        auto child = cache.get(childIndex);
+        if (!child)
         {
-            auto currentNode = std::static_pointer_cast<const Node<V, BranchFactor>>(current);
+            // Child must be loaded from disk. Continue with lock coupling from the current node.
+            boost::shared_lock<NodeLatch> lock(node->m_mutex);
+            if (!node->m_mutex.Validate(version))
+                return false;
+
+            value = LockedGet<V, BranchFactor>(node, std::move(lock), key);
+            return true;
+        }
 
-            auto child = currentNode->GetChildByKey(key);
+        const auto childVersion = (*child)->m_mutex.ReadVersion();
+        if (!childVersion || !node->m_mutex.Validate(version))
+            return false;
 
-            secondLock = std::make_unique<boost::shared_lock<boost::shared_mutex>>(child->m_mutex);
-            firstLock = std::move(secondLock);
+        holder = std::move(*child);
+        node = holder.get();
+        version = *childVersion;
+    }
 
-            current = child;
-        }
-        else
+    boost::shared_lock<NodeLatch> lock(node->m_mutex);
+    if (!node->m_mutex.Validate(version))
+        return false;
+
+    value = node->Get(key);
+    return true;
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+std::optional<V> Node<V, BranchFactor>::Get(Key key) const
+{
+    auto cache = m_cache.lock();
+
+    for (uint32_t i = 0; i < OptimisticReadAttempts; i++)
+    {
+        const auto version = m_mutex.ReadVersion();
+        if (!version)
         {
-            break;
+            std::this_thread::yield();
+            continue;
         }
+
+        std::optional<V> value;
+        if (TryOptimisticGet<V, BranchFactor>(this, *version, *cache, key, value))
+            return value;
     }
 
-    return current->Get(key);
+    // Too many conflicts with writers. Fall back to shared lock coupling.
+    return LockedGet<V, BranchFactor>(this, boost::shared_lock<NodeLatch>(m_mutex), key);
 }
 
 //-------------------------------------------------------------------------------
@@ -290,7 +381,7 @@ DeleteResult<V, BranchFactor> Node<V, BranchFactor>::Delete(Key key, std::option
         // Almost nothing to do. Updating key if need and returning.
         if (childPos && key == m_keys[childPos - 1])
         {
-            m_dirty = true;
+            MarkDirty();
             m_keys[childPos - 1] = foundChild->GetMinimum();
         }
         return deleteResult;
@@ -304,7 +395,7 @@ DeleteResult<V, BranchFactor> Node<V, BranchFactor>::Delete(Key key, std::option
         else
             throw std::runtime_error("Bad tree status - leftmost child returned BorrowedLeft, but it is impossible.");
 
-        m_dirty = true;
+        MarkDirty();
         return { DeleteType::Deleted };
     }
     else if (deleteResult.type == DeleteType::BorrowedRight)
@@ -312,28 +403,28 @@ DeleteResult<V, BranchFactor> Node<V, BranchFactor>::Delete(Key key, std::option
         // Key deleted and one key has been borrowed from right sibling.
         // Almost nothing to do. Updating key and returning.
         m_keys[childPos] = *deleteResult.key;
-        m_dirty = true;
+        MarkDirty();
         return { DeleteType::Deleted };
     }
     else if (deleteResult.type == DeleteType::MergedRight)
     {
         // Key deleted but right sibling node has been merged with the child node.
         // Removing merged sibling.
-        m_dirty = true;
+        MarkDirty();
         if (childPos > 1)
         {
             m_keys[childPos - 1] = *deleteResult.key;
         }
 
-        RemoveFromArray(m_keys, childPos);
-        RemoveFromArray(m_ptrs, childPos + 1);
+        RemoveFromArray(m_keys, m_keyCount, childPos);
+        RemoveFromArray(m_ptrs, m_keyCount + 1, childPos + 1);
     }
     else // MergedLeft
     {
         // Key deleted but left sibling node has been merged with the child node.
         // Original child index has been changed. Removing merged sibling.
 
-        m_dirty = true;
+        MarkDirty();
         m_cache.lock()->insert(foundChild->GetIndex(), foundChild);
 
         if (childPos > 2)
@@ -341,17 +432,17 @@ DeleteResult<V, BranchFactor> Node<V, BranchFactor>::Delete(Key key, std::option
             m_keys[childPos - 2] = *deleteResult.key;
         }
 
-        RemoveFromArray(m_keys, childPos - 1);
-        RemoveFromArray(m_ptrs, childPos);
+        RemoveFromArray(m_keys, m_keyCount, childPos - 1);
+        RemoveFromArray(m_ptrs, m_keyCount + 1, childPos);
     }
     m_keyCount--;
-    m_dirty = true;
+    MarkDirty();
 
     // Special handling for situation when this node is root and child node has been merged with sibling.
     // Tree shrinked and child node becomes new root.
     if (m_index == 1 && m_keyCount == 0)
     {
-        indexManager.Remove(m_dir, foundChild->GetIndex());
+        indexManager.Remove(foundChild->GetIndex());
         m_cache.lock()->erase(foundChild->GetIndex());
         foundChild->SetIndex(1);
         return { deleteResult.type, std::nullopt, std::move(foundChild) };
@@ -364,48 +455,58 @@ DeleteResult<V, BranchFactor> Node<V, BranchFactor>::Delete(Key key, std::option
     }
 
     std::shared_ptr<Node> leftSiblingNode;
+    std::shared_ptr<Node> rightSiblingNode;
+
+    // Siblings may be modified by writers which have already released this node's parent, so lock them too.
+    boost::unique_lock<NodeLatch> leftSiblingLock;
+    boost::unique_lock<NodeLatch> rightSiblingLock;
 
     // Try to borrow left sibling's key...
     if (leftSibling)
     {
-        leftSiblingNode = std::static_pointer_cast<Node>(CreateBPNode<V, BranchFactor>(m_dir, m_cache, leftSibling->index));
+        leftSiblingNode = std::static_pointer_cast<Node>(CreateBPNode<V, BranchFactor>(m_storage, m_cache, leftSibling->index));
+        leftSiblingLock = boost::unique_lock<NodeLatch>(leftSiblingNode->m_mutex);
 
         if (leftSiblingNode->m_keyCount > MinKeys)
         {
+            // Last key of the left sibling becomes a new separator. Exact minimum of the borrowed
+            // subtree can't be used here because this subtree isn't locked.
+            auto separator = leftSiblingNode->m_keys[leftSiblingNode->m_keyCount - 1];
             auto ptr = leftSiblingNode->m_ptrs[leftSiblingNode->m_keyCount];
-            RemoveFromArray(leftSiblingNode->m_keys, leftSiblingNode->m_keyCount - 1);
-            RemoveFromArray(leftSiblingNode->m_ptrs, leftSiblingNode->m_keyCount);
+            RemoveFromArray(leftSiblingNode->m_keys, leftSiblingNode->m_keyCount, leftSiblingNode->m_keyCount - 1);
+            RemoveFromArray(leftSiblingNode->m_ptrs, leftSiblingNode->m_keyCount + 1, leftSiblingNode->m_keyCount);
             leftSiblingNode->m_keyCount--;
-            leftSiblingNode->m_dirty = true;
+            leftSiblingNode->MarkDirty();
 
-            InsertToArray(m_keys, 0, leftSibling->key);
-            InsertToArray(m_ptrs, 0, ptr);
+            InsertToArray(m_keys, m_keyCount, 0, leftSibling->key);
+            InsertToArray(m_ptrs, m_keyCount + 1, 0, ptr);
             m_keyCount++;
 
-            return { DeleteType::BorrowedLeft, GetMinimum() };
+            return { DeleteType::BorrowedLeft, separator };
         }
     }
 
-    std::shared_ptr<Node> rightSiblingNode;
-
     // Try to borrow right sibling's key...
     if (rightSibling)
     {
-        rightSiblingNode = std::static_pointer_cast<Node>(CreateBPNode<V, BranchFactor>(m_dir, m_cache, rightSibling->index));
+        rightSiblingNode = std::static_pointer_cast<Node>(CreateBPNode<V, BranchFactor>(m_storage, m_cache, rightSibling->index));
+        rightSiblingLock = boost::unique_lock<NodeLatch>(rightSiblingNode->m_mutex);
 
         if (rightSiblingNode->m_keyCount > MinKeys)
         {
+            // First key of the right sibling becomes a new separator.
+            auto separator = rightSiblingNode->m_keys[0];
             auto ptr = rightSiblingNode->m_ptrs[0];
-            RemoveFromArray(rightSiblingNode->m_keys, 0);
-            RemoveFromArray(rightSiblingNode->m_ptrs, 0);
+            RemoveFromArray(rightSiblingNode->m_keys, rightSiblingNode->m_keyCount, 0);
+            RemoveFromArray(rightSiblingNode->m_ptrs, rightSiblingNode->m_keyCount + 1, 0);
             rightSiblingNode->m_keyCount--;
-            rightSiblingNode->m_dirty = true;
+            rightSiblingNode->MarkDirty();
 
-            InsertToArray(m_keys, m_keyCount, rightSibling->key);
-            InsertToArray(m_ptrs, m_keyCount + 1, ptr);
+            InsertToArray(m_keys, m_keyCount, m_keyCount, rightSibling->key);
+            InsertToArray(m_ptrs, m_keyCount + 1, m_keyCount + 1, ptr);
             m_keyCount++;
 
-            return { DeleteType::BorrowedRight, rightSiblingNode->GetMinimum() };
+            return { DeleteType::BorrowedRight, separator };
         }
     }
 
@@ -432,10 +533,11 @@ DeleteResult<V, BranchFactor> Node<V, BranchFactor>::Delete(Key key, std::option
         m_keyCount += leftSiblingNode->m_keyCount;
 
         const auto currentIndex = m_index;
-        m_index = leftSiblingNode->GetIndex();
+        SetIndex(leftSiblingNode->GetIndex());
 
         m_cache.lock()->erase(currentIndex);
-        indexManager.Remove(m_dir, currentIndex);
+        indexManager.Remove(currentIndex);
+        leftSiblingNode->MarkAsDeleted();
 
         return { DeleteType::MergedLeft, GetMinimum() };
     }
@@ -456,7 +558,7 @@ DeleteResult<V, BranchFactor> Node<V, BranchFactor>::Delete(Key key, std::option
         m_ptrs[m_keyCount] = rightSiblingNode->m_ptrs[rightSiblingNode->m_keyCount];
 
         m_cache.lock()->erase(rightSiblingNode->GetIndex());
-        indexManager.Remove(m_dir, rightSiblingNode->GetIndex());
+        indexManager.Remove(rightSiblingNode->GetIndex());
         rightSiblingNode->MarkAsDeleted();
         return { DeleteType::MergedRight, GetMinimum() };
     }
@@ -470,7 +572,7 @@ DeleteResult<V, BranchFactor> Node<V, BranchFactor>::Delete(Key key, std::option
 template<class V, size_t BranchFactor>
 Key Node<V, BranchFactor>::GetMinimum() const
 {
-    auto child = CreateBPNode<V, BranchFactor>(m_dir, m_cache, m_ptrs[0]);
+    auto child = CreateBPNode<V, BranchFactor>(m_storage, m_cache, m_ptrs[0]);
     return child->GetMinimum();
 }
 
@@ -478,22 +580,22 @@ Key Node<V, BranchFactor>::GetMinimum() const
 template<class V, size_t BranchFactor>
 std::shared_ptr<BPNode<V, BranchFactor>> Node<V, BranchFactor>::GetFirstLeaf()
 {
-    auto child = CreateBPNode<V, BranchFactor>(m_dir, m_cache, m_ptrs[0]);
+    auto child = CreateBPNode<V, BranchFactor>(m_storage, m_cache, m_ptrs[0]);
     return child->GetFirstLeaf();
 }
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
-void Node<V, BranchFactor>::Load()
+std::shared_ptr<BPNode<V, BranchFactor>> Node<V, BranchFactor>::FindLeaf(Key key)
 {
-    boost::unique_lock<boost::shared_mutex> lock(m_mutex);
-
-    std::ifstream in;
-    in.exceptions(~std::ofstream::goodbit);
-    in.open(m_dir / ("batch_" + std::to_string(m_index) + ".dat"), std::ios::in | std::ios::binary);
+    return GetChildByKey(key)->FindLeaf(key);
+}
 
-    // TODO: check first char is "8"
-    in.seekg(1);
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Node<V, BranchFactor>::Load(std::istream& in)
+{
+    boost::unique_lock<NodeLatch> lock(m_mutex);
 
     in.read(reinterpret_cast<char*>(&(m_keyCount)), sizeof(m_keyCount));
     in.read(reinterpret_cast<char*>(&(m_keys)), sizeof(m_keys));
@@ -512,16 +614,9 @@ void Node<V, BranchFactor>::Load()
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
-void Node<V, BranchFactor>::Flush()
+std::string Node<V, BranchFactor>::Serialize() const
 {
-    boost::unique_lock<boost::shared_mutex> lock(m_mutex);
-
-    if (!m_dirty)
-        return;
-
-    std::ofstream out;
-    out.exceptions(~std::ofstream::goodbit);
-    out.open(m_dir / ("batch_" + std::to_string(m_index) + ".dat"), std::ios::out | std::ios::binary | std::ios::trunc);
+    std::ostringstream out(std::ios::out | std::ios::binary);
 
     out.write("8", 1);
 
@@ -539,55 +634,75 @@ void Node<V, BranchFactor>::Flush()
         auto ptr = boost::endian::native_to_little(m_ptrs[i]);
         out.write(reinterpret_cast<char*>(&ptr), sizeof(ptr));
     }
-    out.close();
-    m_dirty = false;
+
+    return out.str();
 }
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
-std::shared_ptr<BPNode<V, BranchFactor>> CreateEmptyBPNode(const fs::path& dir, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx)
+std::shared_ptr<BPNode<V, BranchFactor>> CreateEmptyBPNode(const std::shared_ptr<NodeStorage>& storage, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx)
 {
-    auto leaf = std::make_shared<Leaf<V, BranchFactor>>(dir, cache, idx);
+    std::shared_ptr<BPNode<V, BranchFactor>> leaf = std::make_shared<Leaf<V, BranchFactor>>(storage, cache, idx);
+    leaf->MarkDirty();
     cache.lock()->insert(idx, leaf);
     return leaf;
 }
 
 //-------------------------------------------------------------------------------
+// Node from cache or storage. Node which is read from storage is inserted to cache with
+// cold priority if 'cold' is true, see cache_base::get_or_insert_cold().
 template<class V, size_t BranchFactor>
-std::shared_ptr<BPNode<V, BranchFactor>> CreateBPNode(const fs::path& dir, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx)
+std::shared_ptr<BPNode<V, BranchFactor>> LoadBPNode(const std::shared_ptr<NodeStorage>& storage, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx, bool cold)
 {
     auto bpNode = cache.lock()->get(idx);
     if (bpNode)
         return *bpNode;
 
-    std::ifstream in;
-    in.exceptions(~std::ifstream::goodbit);
-    in.open(fs::path(dir) / ("batch_" + std::to_string(idx) + ".dat"), std::ios::in | std::ios::binary);
+    // Node is read at once, type marker and data are parsed from memory.
+    std::istringstream in(storage->Read(idx), std::ios::in | std::ios::binary);
+    in.exceptions(~std::istringstream::goodbit);
 
     char type;
     in.read(&type, 1);
 
-    // TODO: reuse ifstream instead of closing
+    std::shared_ptr<BPNode<V, BranchFactor>> node;
     if (type == '8')
     {
-        in.close();
-        auto node = std::make_shared<Node<V, BranchFactor>>(dir, cache, idx);
-        node->Load();
-        cache.lock()->insert(idx, node);
-        return node;
+        node = std::make_shared<Node<V, BranchFactor>>(storage, cache, idx);
+        node->Load(in);
     }
-    else if (type == '9')
+    else if (type == '9' || type == 'T')
     {
-        in.close();
-        auto leaf = std::make_shared<Leaf<V, BranchFactor>>(dir, cache, idx);
-        leaf->Load();
-        cache.lock()->insert(idx, leaf);
-        return leaf;
+        auto leaf = std::make_shared<Leaf<V, BranchFactor>>(storage, cache, idx);
+        leaf->Load(in, type == 'T');
+        node = std::move(leaf);
     }
     else
     {
         throw std::runtime_error("Invalid file format");
     }
+
+    // Other thread may load the same node concurrently. Only one instance must be used, so
+    // the node which is already in cache wins.
+    if (cold)
+        return cache.lock()->get_or_insert_cold(idx, node);
+    else
+        return cache.lock()->get_or_insert(idx, node);
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+std::shared_ptr<BPNode<V, BranchFactor>> CreateBPNode(const std::shared_ptr<NodeStorage>& storage, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx)
+{
+    return LoadBPNode<V, BranchFactor>(storage, cache, idx, false);
+}
+
+//-------------------------------------------------------------------------------
+// Leaf which is read by enumeration of leaves. It doesn't evict nodes of point operations from cache.
+template<class V, size_t BranchFactor>
+std::shared_ptr<Leaf<V, BranchFactor>> LoadScannedLeaf(const std::shared_ptr<NodeStorage>& storage, std::weak_ptr<BPCache<V, BranchFactor>> cache, FileIndex idx)
+{
+    return std::static_pointer_cast<Leaf<V, BranchFactor>>(LoadBPNode<V, BranchFactor>(storage, cache, idx, true));
 }
 
 } // kv_storage
@@ -0,0 +1,1253 @@
+#ifndef NODE_STORAGE_H
+#define NODE_STORAGE_H
+
+#include <cerrno>
+#include <set>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <list>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "utils.h"
+
+namespace kv_storage {
+
+//-------------------------------------------------------------------------------
+// On-disk layout of volume nodes.
+enum class StorageFormat
+{
+    Files,  // Every node is a separate file "batch_%d.dat".
+    Paged   // Nodes are fixed-size pages of the single file "volume.dat".
+};
+
+//-------------------------------------------------------------------------------
+// Page size of new paged volumes. Opened volumes keep their own page size.
+constexpr uint32_t DefaultPageSize = 4096;
+
+//-------------------------------------------------------------------------------
+constexpr const char* PagedStorageFileName = "volume.dat";
+
+//-------------------------------------------------------------------------------
+constexpr const char* FileIndicesFileName = "indices.dat";
+
+//-------------------------------------------------------------------------------
+// How many node files FileNodeStorage keeps open. Several volumes fit the usual limit of 1024 open files.
+constexpr size_t FilePoolSize = 64;
+
+//-------------------------------------------------------------------------------
+// Counts of system calls which storage made to read and write nodes.
+struct IoStats
+{
+    uint64_t loads{ 0 };   // Nodes read from storage
+    uint64_t opens{ 0 };   // Every opened file is also closed when it leaves the pool
+    uint64_t reads{ 0 };
+    uint64_t writes{ 0 };  // Writes including truncation of files
+    uint64_t syncs{ 0 };   // Syncs of files and directories
+};
+
+//-------------------------------------------------------------------------------
+//                               NodeStorage
+//-------------------------------------------------------------------------------
+// NodeStorage keeps serialized nodes of B+ tree addressed by FileIndex.
+// Index 1 is always root. All methods are thread safe.
+//-------------------------------------------------------------------------------
+class NodeStorage
+{
+public:
+    virtual ~NodeStorage() = default;
+
+    // Read serialized node. Throws if node doesn't exist.
+    virtual std::string Read(FileIndex idx) = 0;
+
+    // Replace serialized node.
+    virtual void Write(FileIndex idx, const std::string& data) = 0;
+
+    // Find index which is not used by any node.
+    virtual FileIndex Allocate() = 0;
+
+    // Remove node and make its index free.
+    virtual void Free(FileIndex idx) = 0;
+
+    // True if root was never written.
+    virtual bool IsEmpty() const = 0;
+
+    // Indices of all stored nodes.
+    virtual std::vector<FileIndex> GetIndices() const = 0;
+
+    // Exclude indices from allocation. Used to copy nodes from another storage as is.
+    virtual void Reserve(const std::vector<FileIndex>& indices) = 0;
+
+    // Persist all written data. Throws on error.
+    virtual void Sync() = 0;
+
+    // Dirty nodes bookkeeping for background writeback. Node calls AddDirty() when it becomes
+    // dirty, QueueDirty() when it gets another index while dirty and RemoveDirty() when it is
+    // written or deleted.
+    void AddDirty(FileIndex idx);
+    void QueueDirty(FileIndex idx);
+    void RemoveDirty();
+
+    // Count of nodes which have changes not written to storage.
+    size_t GetDirtyCount() const;
+
+    // Take up to maxCount queued indices in ascending order. The next call continues after
+    // the last taken index, so all queued nodes are written in turn.
+    std::vector<FileIndex> TakeDirty(size_t maxCount);
+
+    IoStats GetIoStats() const;
+
+protected:
+    std::atomic<uint64_t> m_loads{ 0 };
+    std::atomic<uint64_t> m_opens{ 0 };
+    std::atomic<uint64_t> m_reads{ 0 };
+    std::atomic<uint64_t> m_writes{ 0 };
+    std::atomic<uint64_t> m_syncs{ 0 };
+
+private:
+    std::atomic<size_t> m_dirtyCount{ 0 };
+    boost::mutex m_dirtyMutex;
+    std::set<FileIndex> m_dirty;
+    FileIndex m_dirtyCursor{ 0 };
+};
+
+//-------------------------------------------------------------------------------
+inline void NodeStorage::AddDirty(FileIndex idx)
+{
+    m_dirtyCount++;
+    QueueDirty(idx);
+}
+
+//-------------------------------------------------------------------------------
+inline void NodeStorage::QueueDirty(FileIndex idx)
+{
+    boost::unique_lock<boost::mutex> lock(m_dirtyMutex);
+    m_dirty.insert(idx);
+}
+
+//-------------------------------------------------------------------------------
+inline void NodeStorage::RemoveDirty()
+{
+    m_dirtyCount--;
+}
+
+//-------------------------------------------------------------------------------
+inline size_t NodeStorage::GetDirtyCount() const
+{
+    return m_dirtyCount.load();
+}
+
+//-------------------------------------------------------------------------------
+inline IoStats NodeStorage::GetIoStats() const
+{
+    return { m_loads.load(), m_opens.load(), m_reads.load(), m_writes.load(), m_syncs.load() };
+}
+
+//-------------------------------------------------------------------------------
+inline std::vector<FileIndex> NodeStorage::TakeDirty(size_t maxCount)
+{
+    boost::unique_lock<boost::mutex> lock(m_dirtyMutex);
+
+    auto it = m_dirty.upper_bound(m_dirtyCursor);
+    if (it == m_dirty.end())
+        it = m_dirty.begin();
+
+    std::vector<FileIndex> indices;
+    while (it != m_dirty.end() && indices.size() < maxCount)
+    {
+        indices.push_back(*it);
+        it = m_dirty.erase(it);
+    }
+
+    if (!indices.empty())
+        m_dirtyCursor = indices.back();
+
+    return indices;
+}
+
+//-------------------------------------------------------------------------------
+//                              IndexManager
+//-------------------------------------------------------------------------------
+// Allocates indices for new nodes and frees indices of removed nodes. With
+// deferred removal freed indices are kept until TakeRemoved() is called, so
+// removed nodes stay on disk until the new tree is written completely.
+//-------------------------------------------------------------------------------
+class IndexManager
+{
+public:
+    IndexManager(std::shared_ptr<NodeStorage> storage, bool deferRemove = false)
+        : m_storage(std::move(storage))
+        , m_deferRemove(deferRemove)
+    {}
+
+    IndexManager(IndexManager&& other)
+        : m_storage(std::move(other.m_storage))
+        , m_deferRemove(other.m_deferRemove)
+    {
+        boost::unique_lock<boost::mutex> lock(other.m_mutex);
+        m_removed = std::move(other.m_removed);
+    }
+
+    IndexManager& operator= (IndexManager&& other)
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+        boost::unique_lock<boost::mutex> otherLock(other.m_mutex);
+        m_storage = std::move(other.m_storage);
+        m_deferRemove = other.m_deferRemove;
+        m_removed = std::move(other.m_removed);
+        return *this;
+    }
+
+    FileIndex FindFreeIndex()
+    {
+        return m_storage->Allocate();
+    }
+
+    void Remove(FileIndex index)
+    {
+        if (!m_deferRemove)
+        {
+            m_storage->Free(index);
+            return;
+        }
+
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+        m_removed.push_back(index);
+    }
+
+    // Indices removed since the last call. Caller must free them in storage.
+    std::vector<FileIndex> TakeRemoved()
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+        std::vector<FileIndex> removed;
+        removed.swap(m_removed);
+        return removed;
+    }
+
+private:
+    std::shared_ptr<NodeStorage> m_storage;
+    bool m_deferRemove;
+    boost::mutex m_mutex;
+    std::vector<FileIndex> m_removed;
+};
+
+//-------------------------------------------------------------------------------
+// How PositionalFile opens the file.
+enum class OpenMode
+{
+    OpenOrCreate,  // Create the file if it doesn't exist.
+    OpenExisting,  // Throw if the file doesn't exist.
+    Truncate       // Create the file or make the existing one empty.
+};
+
+//-------------------------------------------------------------------------------
+//                             PositionalFile
+//-------------------------------------------------------------------------------
+// Binary file with positional reads and writes. Several threads may read and
+// write different ranges of the file at the same time.
+//-------------------------------------------------------------------------------
+class PositionalFile
+{
+public:
+    // path - Input parameter. File to open.
+    // mode - Input parameter. What to do with missing or existing file.
+    PositionalFile(const fs::path& path, OpenMode mode = OpenMode::OpenOrCreate)
+    {
+#ifdef _WIN32
+        const DWORD disposition = mode == OpenMode::OpenOrCreate ? OPEN_ALWAYS : (mode == OpenMode::OpenExisting ? OPEN_EXISTING : CREATE_ALWAYS);
+        m_handle = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, disposition, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_handle == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Failed to open file " + path.string());
+#else
+        const int flags = mode == OpenMode::OpenOrCreate ? O_RDWR | O_CREAT : (mode == OpenMode::OpenExisting ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC);
+        m_fd = ::open(path.c_str(), flags, 0644);
+        if (m_fd < 0)
+            throw std::runtime_error("Failed to open file " + path.string());
+#endif
+    }
+
+    PositionalFile(const PositionalFile&) = delete;
+    PositionalFile& operator= (const PositionalFile&) = delete;
+
+    ~PositionalFile()
+    {
+#ifdef _WIN32
+        CloseHandle(m_handle);
+#else
+        ::close(m_fd);
+#endif
+    }
+
+    // Read up to size bytes by one system call. Returns count of read bytes which is less than
+    // size only at the end of regular file.
+    size_t ReadSome(uint64_t offset, char* data, size_t size) const
+    {
+        for (;;)
+        {
+#ifdef _WIN32
+            OVERLAPPED overlapped{};
+            overlapped.Offset = static_cast<DWORD>(offset);
+            overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+            DWORD count = 0;
+            if (!ReadFile(m_handle, data, static_cast<DWORD>(size), &count, &overlapped) && GetLastError() != ERROR_HANDLE_EOF)
+                throw std::runtime_error("Failed to read file");
+            return count;
+#else
+            const auto count = ::pread(m_fd, data, size, static_cast<off_t>(offset));
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error("Failed to read file");
+            }
+            return static_cast<size_t>(count);
+#endif
+        }
+    }
+
+    // Read up to size bytes. Returns count of read bytes which is less than size only at the end of file.
+    size_t Read(uint64_t offset, char* data, size_t size) const
+    {
+        size_t done = 0;
+        while (done < size)
+        {
+#ifdef _WIN32
+            OVERLAPPED overlapped{};
+            overlapped.Offset = static_cast<DWORD>(offset + done);
+            overlapped.OffsetHigh = static_cast<DWORD>((offset + done) >> 32);
+
+            DWORD count = 0;
+            if (!ReadFile(m_handle, data + done, static_cast<DWORD>(size - done), &count, &overlapped) && GetLastError() != ERROR_HANDLE_EOF)
+                throw std::runtime_error("Failed to read file");
+#else
+            const auto count = ::pread(m_fd, data + done, size - done, static_cast<off_t>(offset + done));
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error("Failed to read file");
+            }
+#endif
+            if (count == 0)
+                break;
+            done += count;
+        }
+
+        return done;
+    }
+
+    void Write(uint64_t offset, const char* data, size_t size)
+    {
+        size_t done = 0;
+        while (done < size)
+        {
+#ifdef _WIN32
+            OVERLAPPED overlapped{};
+            overlapped.Offset = static_cast<DWORD>(offset + done);
+            overlapped.OffsetHigh = static_cast<DWORD>((offset + done) >> 32);
+
+            DWORD count = 0;
+            if (!WriteFile(m_handle, data + done, static_cast<DWORD>(size - done), &count, &overlapped))
+                throw std::runtime_error("Failed to write file");
+#else
+            const auto count = ::pwrite(m_fd, data + done, size - done, static_cast<off_t>(offset + done));
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error("Failed to write file");
+            }
+#endif
+            done += count;
+        }
+    }
+
+    void Truncate(uint64_t size)
+    {
+#ifdef _WIN32
+        FILE_END_OF_FILE_INFO info;
+        info.EndOfFile.QuadPart = static_cast<LONGLONG>(size);
+        if (!SetFileInformationByHandle(m_handle, FileEndOfFileInfo, &info, sizeof(info)))
+            throw std::runtime_error("Failed to truncate file");
+#else
+        if (::ftruncate(m_fd, static_cast<off_t>(size)) != 0)
+            throw std::runtime_error("Failed to truncate file");
+#endif
+    }
+
+    uint64_t Size() const
+    {
+#ifdef _WIN32
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_handle, &size))
+            throw std::runtime_error("Failed to get file size");
+        return static_cast<uint64_t>(size.QuadPart);
+#else
+        struct stat st;
+        if (::fstat(m_fd, &st) != 0)
+            throw std::runtime_error("Failed to get file size");
+        return static_cast<uint64_t>(st.st_size);
+#endif
+    }
+
+    void Sync()
+    {
+#ifdef _WIN32
+        if (!FlushFileBuffers(m_handle))
+            throw std::runtime_error("Failed to sync file");
+#else
+        if (::fsync(m_fd) != 0)
+            throw std::runtime_error("Failed to sync file");
+#endif
+    }
+
+private:
+#ifdef _WIN32
+    HANDLE m_handle;
+#else
+    int m_fd;
+#endif
+};
+
+//-------------------------------------------------------------------------------
+// Make creation, removal and renaming of files in directory durable. Throws on error.
+inline void SyncDirectory(const fs::path& dir)
+{
+#ifdef _WIN32
+    // Metadata of NTFS is journaled and directories can't be opened for flush.
+    (void)dir;
+#else
+    const int fd = ::open(dir.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Failed to open directory " + dir.string());
+
+    const int result = ::fsync(fd);
+    ::close(fd);
+    if (result != 0)
+        throw std::runtime_error("Failed to sync directory " + dir.string());
+#endif
+}
+
+//-------------------------------------------------------------------------------
+//                             FileNodeStorage
+//-------------------------------------------------------------------------------
+// Every node is stored in its own file "batch_%d.dat". Allocated indices are
+// kept in memory as the highest index and the set of free indices below it,
+// so allocation doesn't touch the file system.
+//
+// Recently used node files are kept open in a pool of FilePoolSize files. Node
+// is read by one positional read into a buffer bigger than the largest node, so
+// a miss of the pool costs open and read, and a hit costs only read. Nodes are
+// written in place without reopening of the file. Sync() flushes every file
+// written since the previous sync, and then the directory.
+//
+// Closed storage saves them to "indices.dat" and the next open reads and
+// removes this file. If the file is absent, the volume was not closed
+// properly and indices are restored from the list of node files once.
+//
+// Indices file format:
+//  "KVINDEX\0"                  - Marker.
+//  8 bytes                      - Highest allocated index.
+//  8 bytes                      - Count of free indices.
+//  8 bytes * count              - Free indices.
+//-------------------------------------------------------------------------------
+class FileNodeStorage : public NodeStorage
+{
+public:
+    FileNodeStorage(const fs::path& dir)
+        : m_dir(dir)
+    {
+        if (!LoadIndices())
+            RestoreIndices();
+    }
+
+    ~FileNodeStorage()
+    {
+        try
+        {
+            SaveIndices();
+        }
+        catch (...)
+        {
+        }
+    }
+
+    std::string Read(FileIndex idx) override
+    {
+        m_loads++;
+        const auto file = OpenFile(idx, OpenMode::OpenExisting);
+
+        // Buffer is bigger than any node written or read before, so size of file is not queried
+        // and node is read by one call. Bigger node is read in several calls.
+        std::string data(m_readSize.load(), '\0');
+        size_t size = 0;
+        for (;;)
+        {
+            m_reads++;
+            size += file->file.ReadSome(size, data.data() + size, data.size() - size);
+            if (size < data.size())
+                break;
+
+            data.resize(data.size() * 2);
+        }
+
+        data.resize(size);
+        file->size = size;
+        GrowReadSize(size);
+        return data;
+    }
+
+    void Write(FileIndex idx, const std::string& data) override
+    {
+        {
+            // Node may be written without allocation: root, nodes of log or copied nodes.
+            boost::unique_lock<boost::mutex> lock(m_mutex);
+            Use(idx);
+            m_unsynced.insert(idx);
+        }
+
+        // File which is not in the pool is truncated on opening.
+        const auto file = OpenFile(idx, OpenMode::Truncate);
+
+        m_writes++;
+        file->file.Write(0, data.data(), data.size());
+        if (data.size() < file->size)
+        {
+            m_writes++;
+            file->file.Truncate(data.size());
+        }
+        file->size = data.size();
+        GrowReadSize(data.size());
+    }
+
+    FileIndex Allocate() override
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+
+        // Low indices are reused first, so node files stay dense.
+        if (!m_freeIndices.empty())
+        {
+            const auto idx = *m_freeIndices.begin();
+            m_freeIndices.erase(m_freeIndices.begin());
+            return idx;
+        }
+
+        return ++m_highIndex;
+    }
+
+    void Free(FileIndex idx) override
+    {
+        CloseFile(idx);
+        fs::remove(GetPath(idx));
+
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+        m_unsynced.erase(idx);
+        m_removed = true;
+        if (idx > 1 && idx <= m_highIndex)
+            m_freeIndices.insert(idx);
+    }
+
+    bool IsEmpty() const override
+    {
+        return !fs::exists(GetPath(1));
+    }
+
+    std::vector<FileIndex> GetIndices() const override
+    {
+        std::vector<FileIndex> indices;
+        for (const auto& entry : fs::directory_iterator(m_dir))
+        {
+            const auto name = entry.path().filename().string();
+            if (name.size() > 10 && name.compare(0, 6, "batch_") == 0 && name.compare(name.size() - 4, 4, ".dat") == 0)
+                indices.push_back(std::stoull(name.substr(6, name.size() - 10)));
+        }
+
+        std::sort(indices.begin(), indices.end());
+        return indices;
+    }
+
+    void Reserve(const std::vector<FileIndex>& indices) override
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+        for (auto idx : indices)
+        {
+            Use(idx);
+        }
+    }
+
+    void Sync() override
+    {
+        std::set<FileIndex> unsynced;
+        bool removed;
+        {
+            boost::unique_lock<boost::mutex> lock(m_mutex);
+            unsynced.swap(m_unsynced);
+            removed = m_removed;
+            m_removed = false;
+        }
+
+        try
+        {
+            // Files which left the pool after writing are opened again.
+            for (auto idx : unsynced)
+            {
+                m_syncs++;
+                OpenFile(idx, OpenMode::OpenExisting)->file.Sync();
+            }
+
+            // Created and removed node files are durable only after sync of the directory.
+            if (removed || !unsynced.empty())
+            {
+                m_syncs++;
+                SyncDirectory(m_dir);
+            }
+        }
+        catch (...)
+        {
+            boost::unique_lock<boost::mutex> lock(m_mutex);
+            m_unsynced.insert(unsynced.begin(), unsynced.end());
+            m_removed = m_removed || removed;
+            throw;
+        }
+    }
+
+private:
+    struct PooledFile
+    {
+        PooledFile(const fs::path& path, OpenMode mode)
+            : file(path, mode)
+            , size(mode == OpenMode::Truncate ? 0 : UnknownSize)
+        {}
+
+        PositionalFile file;
+
+        // Size is known after the first read or write, so shorter node truncates the file.
+        std::atomic<uint64_t> size;
+    };
+
+    static constexpr uint64_t UnknownSize = std::numeric_limits<uint64_t>::max();
+
+    // Make read buffer bigger than the node.
+    void GrowReadSize(size_t nodeSize)
+    {
+        auto readSize = m_readSize.load();
+        while (readSize <= nodeSize && !m_readSize.compare_exchange_weak(readSize, nodeSize + 1))
+        {
+        }
+    }
+
+    fs::path GetPath(FileIndex idx) const
+    {
+        return m_dir / ("batch_" + std::to_string(idx) + ".dat");
+    }
+
+    // File of node from the pool or opened one which replaces the least recently used file
+    // of the pool. Evicted file is closed when the last thread stops using it.
+    // mode - Input parameter. How to open the file if it is not in the pool.
+    std::shared_ptr<PooledFile> OpenFile(FileIndex idx, OpenMode mode)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(m_poolMutex);
+            auto it = m_pool.find(idx);
+            if (it != m_pool.end())
+            {
+                m_poolOrder.splice(m_poolOrder.begin(), m_poolOrder, it->second.second);
+                return it->second.first;
+            }
+        }
+
+        // File is opened without lock, other thread may open the same file meanwhile. The file
+        // which is in the pool wins.
+        m_opens++;
+        auto file = std::make_shared<PooledFile>(GetPath(idx), mode);
+
+        boost::unique_lock<boost::mutex> lock(m_poolMutex);
+        auto it = m_pool.find(idx);
+        if (it != m_pool.end())
+            return it->second.first;
+
+        if (m_pool.size() >= FilePoolSize)
+        {
+            m_pool.erase(m_poolOrder.back());
+            m_poolOrder.pop_back();
+        }
+
+        m_poolOrder.push_front(idx);
+        m_pool.emplace(idx, std::make_pair(file, m_poolOrder.begin()));
+        return file;
+    }
+
+    // Remove file of node from the pool.
+    void CloseFile(FileIndex idx)
+    {
+        boost::unique_lock<boost::mutex> lock(m_poolMutex);
+        auto it = m_pool.find(idx);
+        if (it == m_pool.end())
+            return;
+
+        m_poolOrder.erase(it->second.second);
+        m_pool.erase(it);
+    }
+
+    // Exclude index from allocation. Caller must hold m_mutex.
+    void Use(FileIndex idx)
+    {
+        if (idx <= m_highIndex)
+        {
+            m_freeIndices.erase(idx);
+            return;
+        }
+
+        for (auto free = m_highIndex + 1; free < idx; free++)
+        {
+            m_freeIndices.insert(free);
+        }
+        m_highIndex = idx;
+    }
+
+    // Read indices saved on close and remove the file until the next close. Returns false if there is no file.
+    bool LoadIndices()
+    {
+        const auto path = m_dir / FileIndicesFileName;
+        if (!fs::exists(path))
+            return false;
+
+        std::ifstream in;
+        in.exceptions(~std::ifstream::goodbit);
+        in.open(path, std::ios::in | std::ios::binary);
+
+        char marker[8];
+        in.read(marker, sizeof(marker));
+        if (std::string(marker, sizeof(marker)) != std::string(IndicesMarker, sizeof(marker)))
+            throw std::runtime_error("Invalid indices file " + path.string());
+
+        m_highIndex = ReadNumber(in);
+        const auto count = ReadNumber(in);
+
+        std::vector<FileIndex> free(static_cast<size_t>(count));
+        for (auto& idx : free)
+        {
+            idx = ReadNumber(in);
+        }
+        m_freeIndices.insert(free.begin(), free.end());
+
+        in.close();
+        fs::remove(path);
+        return true;
+    }
+
+    // Rebuild indices from node files after the volume was not closed.
+    void RestoreIndices()
+    {
+        if (!fs::exists(m_dir))
+            return;
+
+        const auto indices = GetIndices();
+        if (!indices.empty())
+            m_highIndex = std::max<FileIndex>(indices.back(), 1);
+
+        auto used = indices.begin();
+        for (FileIndex idx = 2; idx <= m_highIndex; idx++)
+        {
+            if (used != indices.end() && *used < idx)
+                ++used;
+
+            if (used == indices.end() || *used != idx)
+                m_freeIndices.insert(idx);
+        }
+    }
+
+    void SaveIndices()
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+
+        std::ofstream out;
+        out.exceptions(~std::ofstream::goodbit);
+        out.open(m_dir / FileIndicesFileName, std::ios::out | std::ios::binary | std::ios::trunc);
+
+        out.write(IndicesMarker, 8);
+        WriteNumber(out, m_highIndex);
+        WriteNumber(out, m_freeIndices.size());
+        for (auto idx : m_freeIndices)
+        {
+            WriteNumber(out, idx);
+        }
+        out.close();
+    }
+
+    static uint64_t ReadNumber(std::istream& in)
+    {
+        uint64_t value;
+        in.read(reinterpret_cast<char*>(&value), sizeof(value));
+        return boost::endian::little_to_native(value);
+    }
+
+    static void WriteNumber(std::ostream& out, uint64_t value)
+    {
+        value = boost::endian::native_to_little(value);
+        out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+private:
+    static constexpr const char* IndicesMarker = "KVINDEX";
+
+    const fs::path m_dir;
+    boost::mutex m_mutex;
+
+    // All indices up to m_highIndex are used by nodes except the free ones. Index 1 is root.
+    FileIndex m_highIndex{ 1 };
+    std::set<FileIndex> m_freeIndices;
+
+    // Nodes written and removed since the last Sync().
+    std::set<FileIndex> m_unsynced;
+    bool m_removed{ false };
+
+    // Size of buffer for reading of nodes.
+    std::atomic<size_t> m_readSize{ DefaultPageSize };
+
+    // Open files of nodes and their indices from the most recently used one.
+    boost::mutex m_poolMutex;
+    std::unordered_map<FileIndex, std::pair<std::shared_ptr<PooledFile>, std::list<FileIndex>::iterator>> m_pool;
+    std::list<FileIndex> m_poolOrder;
+};
+
+//-------------------------------------------------------------------------------
+//                             PagedNodeStorage
+//-------------------------------------------------------------------------------
+// All nodes are stored in a single file of fixed-size pages. Page number is
+// FileIndex of the node, so a node is read by one positional read. Nodes which
+// don't fit in one page continue in overflow pages linked from the first one.
+// Freed pages form a linked list which is kept in the file too.
+//
+// File header (page 0):
+//  "KVPAGES\0"                  - Marker.
+//  0xXX 0xXX 0xXX 0xXX          - Format version.
+//  0xXX 0xXX 0xXX 0xXX          - Page size.
+//  8 bytes                      - Page count including header.
+//  8 bytes                      - First free page or 0.
+//
+// Page:
+//  0xXX 0xXX 0xXX 0xXX          - Page type: 1 - node, 2 - overflow, 3 - free.
+//  0xXX 0xXX 0xXX 0xXX          - Size of node data in this page.
+//  8 bytes                      - Next overflow page of node or next free page, 0 if none.
+//  Page size - 16 bytes         - Node data.
+//-------------------------------------------------------------------------------
+class PagedNodeStorage : public NodeStorage
+{
+public:
+    // path     - Input parameter. Data file. It is created if doesn't exist.
+    // pageSize - Input parameter. Page size of new file.
+    PagedNodeStorage(const fs::path& path, uint32_t pageSize = DefaultPageSize)
+        : m_file(path)
+    {
+        if (m_file.Size() == 0)
+        {
+            if (pageSize <= PageHeaderSize + FileHeaderSize)
+                throw std::runtime_error("Page size is too small");
+
+            m_pageSize = pageSize;
+            WriteFileHeader();
+            return;
+        }
+
+        char header[FileHeaderSize];
+        if (m_file.Read(0, header, FileHeaderSize) != FileHeaderSize || std::string(header, 8) != std::string(FileMarker, 8))
+            throw std::runtime_error("Invalid file format");
+
+        const auto version = ReadLittle<uint32_t>(header + 8);
+        if (version != FormatVersion)
+            throw std::runtime_error("Unsupported paged volume version " + std::to_string(version));
+
+        m_pageSize = ReadLittle<uint32_t>(header + 12);
+        m_pageCount = ReadLittle<uint64_t>(header + 16);
+
+        for (auto page = ReadLittle<uint64_t>(header + 24); page != 0; page = ReadPageHeader(page).next)
+        {
+            m_freePages.push_back(page);
+        }
+        std::reverse(m_freePages.begin(), m_freePages.end());
+        m_freeSet.insert(m_freePages.begin(), m_freePages.end());
+    }
+
+    std::string Read(FileIndex idx) override
+    {
+        std::string data;
+        std::vector<FileIndex> overflowPages;
+        std::vector<char> buf(m_pageSize);
+
+        for (FileIndex page = idx; page != 0;)
+        {
+            m_reads++;
+            const auto count = m_file.Read(page * m_pageSize, buf.data(), m_pageSize);
+            const auto header = ParsePageHeader(buf.data(), count);
+
+            if (header.type != (page == idx ? PageType::Node : PageType::Overflow) || header.size > m_pageSize - PageHeaderSize)
+                throw std::runtime_error("Node " + std::to_string(idx) + " doesn't exist");
+
+            data.append(buf.data() + PageHeaderSize, header.size);
+
+            if (header.next)
+                overflowPages.push_back(header.next);
+            page = header.next;
+        }
+
+        if (!overflowPages.empty())
+        {
+            boost::unique_lock<boost::mutex> lock(m_mutex);
+            m_overflowPages[idx] = std::move(overflowPages);
+        }
+
+        return data;
+    }
+
+    void Write(FileIndex idx, const std::string& data) override
+    {
+        const uint32_t payloadSize = m_pageSize - PageHeaderSize;
+        const size_t pageCount = std::max<size_t>(1, (data.size() + payloadSize - 1) / payloadSize);
+
+        std::vector<FileIndex> pages{ idx };
+        {
+            boost::unique_lock<boost::mutex> lock(m_mutex);
+
+            if (idx == 0 || idx >= m_pageCount)
+                throw std::runtime_error("Node " + std::to_string(idx) + " was not allocated");
+
+            auto& overflowPages = m_overflowPages[idx];
+            while (overflowPages.size() < pageCount - 1)
+            {
+                overflowPages.push_back(AllocatePage());
+            }
+            while (overflowPages.size() > pageCount - 1)
+            {
+                FreePage(overflowPages.back());
+                overflowPages.pop_back();
+            }
+
+            pages.insert(pages.end(), overflowPages.begin(), overflowPages.end());
+            if (overflowPages.empty())
+                m_overflowPages.erase(idx);
+        }
+
+        std::vector<char> buf(m_pageSize);
+        for (size_t i = 0; i < pages.size(); i++)
+        {
+            const auto offset = i * payloadSize;
+            const auto size = static_cast<uint32_t>(std::min<size_t>(payloadSize, data.size() - offset));
+
+            WritePageHeader(buf.data(), { i == 0 ? PageType::Node : PageType::Overflow, size, i + 1 < pages.size() ? pages[i + 1] : 0 });
+            std::copy(data.data() + offset, data.data() + offset + size, buf.data() + PageHeaderSize);
+            m_writes++;
+            m_file.Write(pages[i] * m_pageSize, buf.data(), PageHeaderSize + size);
+        }
+    }
+
+    FileIndex Allocate() override
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+        return AllocatePage();
+    }
+
+    void Free(FileIndex idx) override
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+
+        // Page may be freed again when interrupted checkpoint is repeated.
+        if (m_freeSet.count(idx))
+            return;
+
+        std::vector<FileIndex> overflowPages;
+        auto it = m_overflowPages.find(idx);
+        if (it != m_overflowPages.end())
+        {
+            overflowPages = std::move(it->second);
+            m_overflowPages.erase(it);
+        }
+        else
+        {
+            for (auto page = ReadPageHeader(idx).next; page != 0; page = ReadPageHeader(page).next)
+            {
+                overflowPages.push_back(page);
+            }
+        }
+
+        for (auto page : overflowPages)
+        {
+            FreePage(page);
+        }
+        FreePage(idx);
+    }
+
+    bool IsEmpty() const override
+    {
+        return ReadPageHeader(1).type != PageType::Node;
+    }
+
+    std::vector<FileIndex> GetIndices() const override
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+
+        std::vector<FileIndex> indices;
+        for (FileIndex page = 1; page < m_pageCount; page++)
+        {
+            if (ReadPageHeader(page).type == PageType::Node)
+                indices.push_back(page);
+        }
+
+        return indices;
+    }
+
+    void Reserve(const std::vector<FileIndex>& indices) override
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+
+        if (indices.empty())
+            return;
+
+        const auto maxIndex = *std::max_element(indices.begin(), indices.end());
+        for (auto page = m_pageCount; page <= maxIndex; page++)
+        {
+            m_freePages.push_back(page);
+        }
+        m_pageCount = std::max(m_pageCount, maxIndex + 1);
+
+        const std::unordered_set<FileIndex> reserved(indices.begin(), indices.end());
+        m_freePages.erase(std::remove_if(m_freePages.begin(), m_freePages.end(), [&reserved](FileIndex page) { return reserved.count(page) != 0; }), m_freePages.end());
+        m_freeSet = std::unordered_set<FileIndex>(m_freePages.begin(), m_freePages.end());
+
+        // Link remaining free pages again.
+        char buf[PageHeaderSize];
+        for (size_t i = 0; i < m_freePages.size(); i++)
+        {
+            WritePageHeader(buf, { PageType::Free, 0, i == 0 ? 0 : m_freePages[i - 1] });
+            m_file.Write(m_freePages[i] * m_pageSize, buf, PageHeaderSize);
+        }
+        WriteFileHeader();
+    }
+
+    void Sync() override
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+        WriteFileHeader();
+        m_syncs++;
+        m_file.Sync();
+    }
+
+private:
+    enum class PageType : uint32_t
+    {
+        Unused = 0,
+        Node = 1,
+        Overflow = 2,
+        Free = 3
+    };
+
+    struct PageHeader
+    {
+        PageType type;
+        uint32_t size;
+        FileIndex next;
+    };
+
+    static constexpr const char* FileMarker = "KVPAGES\0";
+    static constexpr uint32_t FormatVersion = 1;
+    static constexpr uint32_t FileHeaderSize = 32;
+    static constexpr uint32_t PageHeaderSize = 16;
+
+    template<class T>
+    static T ReadLittle(const char* data)
+    {
+        T val;
+        std::copy(data, data + sizeof(T), reinterpret_cast<char*>(&val));
+        return boost::endian::little_to_native(val);
+    }
+
+    template<class T>
+    static void WriteLittle(char* data, T val)
+    {
+        val = boost::endian::native_to_little(val);
+        std::copy(reinterpret_cast<char*>(&val), reinterpret_cast<char*>(&val) + sizeof(T), data);
+    }
+
+    static PageHeader ParsePageHeader(const char* data, size_t size)
+    {
+        // Page after the end of file or never written page.
+        if (size < PageHeaderSize)
+            return { PageType::Unused, 0, 0 };
+
+        return { static_cast<PageType>(ReadLittle<uint32_t>(data)), ReadLittle<uint32_t>(data + 4), ReadLittle<uint64_t>(data + 8) };
+    }
+
+    static void WritePageHeader(char* data, const PageHeader& header)
+    {
+        WriteLittle(data, static_cast<uint32_t>(header.type));
+        WriteLittle(data + 4, header.size);
+        WriteLittle(data + 8, header.next);
+    }
+
+    PageHeader ReadPageHeader(FileIndex page) const
+    {
+        char buf[PageHeaderSize];
+        return ParsePageHeader(buf, m_file.Read(page * m_pageSize, buf, PageHeaderSize));
+    }
+
+    // Caller must hold m_mutex.
+    void WriteFileHeader()
+    {
+        char header[FileHeaderSize] = {};
+        std::copy(FileMarker, FileMarker + 8, header);
+        WriteLittle(header + 8, FormatVersion);
+        WriteLittle(header + 12, m_pageSize);
+        WriteLittle(header + 16, m_pageCount);
+        WriteLittle(header + 24, m_freePages.empty() ? FileIndex{ 0 } : m_freePages.back());
+        m_file.Write(0, header, FileHeaderSize);
+    }
+
+    // Caller must hold m_mutex.
+    FileIndex AllocatePage()
+    {
+        FileIndex page;
+        if (m_freePages.empty())
+        {
+            page = m_pageCount++;
+        }
+        else
+        {
+            page = m_freePages.back();
+            m_freePages.pop_back();
+            m_freeSet.erase(page);
+        }
+
+        WriteFileHeader();
+        return page;
+    }
+
+    // Caller must hold m_mutex.
+    void FreePage(FileIndex page)
+    {
+        char buf[PageHeaderSize];
+        WritePageHeader(buf, { PageType::Free, 0, m_freePages.empty() ? 0 : m_freePages.back() });
+        m_file.Write(page * m_pageSize, buf, PageHeaderSize);
+
+        m_freePages.push_back(page);
+        m_freeSet.insert(page);
+        WriteFileHeader();
+    }
+
+    PositionalFile m_file;
+    uint32_t m_pageSize{ DefaultPageSize };
+
+    // Page 0 is file header and page 1 is always root.
+    FileIndex m_pageCount{ 2 };
+
+    // Stack of free pages. The last one is the head of the list in file.
+    std::vector<FileIndex> m_freePages;
+    std::unordered_set<FileIndex> m_freeSet;
+
+    // Overflow pages of nodes which were read or written, only nodes with overflow pages are kept.
+    std::unordered_map<FileIndex, std::vector<FileIndex>> m_overflowPages;
+    mutable boost::mutex m_mutex;
+};
+
+//-------------------------------------------------------------------------------
+// Format of the volume stored in directory or std::nullopt if there is no volume.
+inline std::optional<StorageFormat> DetectStorageFormat(const fs::path& dir)
+{
+    // File "volume.dat" appears only when conversion to paged format is done, so it wins.
+    if (fs::exists(dir / PagedStorageFileName))
+        return StorageFormat::Paged;
+    if (fs::exists(dir / "batch_1.dat"))
+        return StorageFormat::Files;
+
+    return std::nullopt;
+}
+
+//-------------------------------------------------------------------------------
+// Open storage of volume in directory or create new one. Throws if volume exists in another format.
+inline std::shared_ptr<NodeStorage> OpenNodeStorage(const fs::path& dir, StorageFormat format)
+{
+    const auto existingFormat = DetectStorageFormat(dir);
+    if (existingFormat && existingFormat != format)
+        throw std::runtime_error("Volume is stored in another format, convert it with ConvertStorageFormat()");
+
+    fs::create_directories(dir);
+
+    if (format == StorageFormat::Paged)
+        return std::make_shared<PagedNodeStorage>(dir / PagedStorageFileName);
+    else
+        return std::make_shared<FileNodeStorage>(dir);
+}
+
+//-------------------------------------------------------------------------------
+// Copy all nodes with the same indices.
+inline void CopyNodes(NodeStorage& from, NodeStorage& to)
+{
+    const auto indices = from.GetIndices();
+    to.Reserve(indices);
+
+    for (auto idx : indices)
+    {
+        to.Write(idx, from.Read(idx));
+    }
+    to.Sync();
+}
+
+//-------------------------------------------------------------------------------
+// Convert volume in directory to another storage format. Volume must be closed.
+// dir    - Input parameter. Directory of volume.
+// format - Input parameter. New format.
+inline void ConvertStorageFormat(const fs::path& dir, StorageFormat format)
+{
+    const auto existingFormat = DetectStorageFormat(dir);
+    if (!existingFormat)
+        throw std::runtime_error("There is no volume in " + dir.string());
+
+    if (existingFormat == format)
+        return;
+
+    if (format == StorageFormat::Paged)
+    {
+        // Write to temporary file first, so interrupted conversion leaves the volume as it was.
+        const auto tmpPath = dir / (std::string(PagedStorageFileName) + ".tmp");
+        fs::remove(tmpPath);
+
+        {
+            FileNodeStorage files(dir);
+            {
+                PagedNodeStorage pages(tmpPath);
+                CopyNodes(files, pages);
+            }
+            fs::rename(tmpPath, dir / PagedStorageFileName);
+
+            for (auto idx : files.GetIndices())
+            {
+                files.Free(idx);
+            }
+        }
+        fs::remove(dir / FileIndicesFileName);
+    }
+    else
+    {
+        {
+            PagedNodeStorage pages(dir / PagedStorageFileName);
+            FileNodeStorage files(dir);
+            CopyNodes(pages, files);
+        }
+        fs::remove(dir / PagedStorageFileName);
+    }
+}
+
+} // kv_storage
+
+#endif // NODE_STORAGE_H
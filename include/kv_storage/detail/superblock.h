@@ -0,0 +1,149 @@
+#ifndef SUPERBLOCK_H
+#define SUPERBLOCK_H
+
+#include <string>
+#include <optional>
+#include <type_traits>
+#include <boost/crc.hpp>
+
+#include "node_storage.h"
+
+namespace kv_storage {
+
+//-------------------------------------------------------------------------------
+constexpr const char* SuperblockFileName = "superblock.dat";
+
+//-------------------------------------------------------------------------------
+// Code of value type which is stored in superblock.
+template<class V>
+constexpr uint32_t ValueTypeCode()
+{
+    if constexpr (std::is_same_v<V, std::string>)
+        return 1;
+    else if constexpr (std::is_same_v<V, std::vector<char>>)
+        return 2;
+    else if constexpr (std::is_same_v<V, float>)
+        return 3;
+    else if constexpr (std::is_same_v<V, double>)
+        return 4;
+    else if constexpr (std::is_same_v<V, uint32_t>)
+        return 5;
+    else if constexpr (std::is_same_v<V, uint64_t>)
+        return 6;
+    else
+        static_assert(AlwaysFalse<V>, "Type must be string, blob, float, double or uint");
+}
+
+//-------------------------------------------------------------------------------
+//                                Superblock
+//-------------------------------------------------------------------------------
+// Parameters and statistics of the tree on disk. Superblock is replaced
+// atomically: it is written to a temporary file which is renamed over the old one.
+//
+// File format:
+//  "KVSUPER\0"                  - Marker.
+//  0xXX 0xXX 0xXX 0xXX          - Format version.
+//  0xXX 0xXX 0xXX 0xXX          - Branch factor.
+//  0xXX 0xXX 0xXX 0xXX          - Value type, see ValueTypeCode().
+//  0xXX 0xXX 0xXX 0xXX          - Tree height, 1 if root is leaf.
+//  8 bytes                      - Key count.
+//  0xXX 0xXX 0xXX 0xXX          - 1 if key count and height match the tree on disk, 0 otherwise.
+//  0xXX 0xXX 0xXX 0xXX          - CRC32 of all previous fields.
+//-------------------------------------------------------------------------------
+struct Superblock
+{
+    uint32_t branchFactor{ 0 };
+    uint32_t valueType{ 0 };
+    uint32_t height{ 1 };
+    uint64_t keyCount{ 0 };
+
+    // Volume which is opened without log may be changed on disk at any time, so
+    // its statistics are valid only after it is closed.
+    bool exact{ false };
+
+    static constexpr uint32_t Version = 1;
+    static constexpr size_t Size = 40;
+
+    // Read superblock of volume in directory. Returns std::nullopt if there is no superblock. Throws if it is corrupted.
+    static std::optional<Superblock> Read(const fs::path& dir);
+
+    // Replace superblock of volume in directory. Throws on error.
+    void Write(const fs::path& dir) const;
+
+private:
+    template<class T>
+    static T ReadLittle(const char* data)
+    {
+        T val;
+        std::copy(data, data + sizeof(T), reinterpret_cast<char*>(&val));
+        return boost::endian::little_to_native(val);
+    }
+
+    template<class T>
+    static void WriteLittle(char* data, T val)
+    {
+        val = boost::endian::native_to_little(val);
+        std::copy(reinterpret_cast<char*>(&val), reinterpret_cast<char*>(&val) + sizeof(T), data);
+    }
+
+    static constexpr const char* Marker = "KVSUPER";
+};
+
+//-------------------------------------------------------------------------------
+inline std::optional<Superblock> Superblock::Read(const fs::path& dir)
+{
+    const auto path = dir / SuperblockFileName;
+    if (!fs::exists(path))
+        return std::nullopt;
+
+    char data[Size];
+    PositionalFile file(path);
+    if (file.Read(0, data, Size) != Size || std::string(data, 8) != std::string(Marker, 8))
+        throw std::runtime_error("Invalid superblock " + path.string());
+
+    boost::crc_32_type crc;
+    crc.process_bytes(data, Size - 4);
+    if (crc.checksum() != ReadLittle<uint32_t>(data + 36))
+        throw std::runtime_error("Invalid superblock " + path.string());
+
+    if (ReadLittle<uint32_t>(data + 8) != Version)
+        throw std::runtime_error("Unsupported superblock version " + path.string());
+
+    Superblock superblock;
+    superblock.branchFactor = ReadLittle<uint32_t>(data + 12);
+    superblock.valueType = ReadLittle<uint32_t>(data + 16);
+    superblock.height = ReadLittle<uint32_t>(data + 20);
+    superblock.keyCount = ReadLittle<uint64_t>(data + 24);
+    superblock.exact = ReadLittle<uint32_t>(data + 32) != 0;
+    return superblock;
+}
+
+//-------------------------------------------------------------------------------
+inline void Superblock::Write(const fs::path& dir) const
+{
+    char data[Size];
+    std::copy(Marker, Marker + 8, data);
+    WriteLittle(data + 8, Version);
+    WriteLittle(data + 12, branchFactor);
+    WriteLittle(data + 16, valueType);
+    WriteLittle(data + 20, height);
+    WriteLittle(data + 24, keyCount);
+    WriteLittle(data + 32, static_cast<uint32_t>(exact ? 1 : 0));
+
+    boost::crc_32_type crc;
+    crc.process_bytes(data, Size - 4);
+    WriteLittle(data + 36, static_cast<uint32_t>(crc.checksum()));
+
+    const auto tmpPath = dir / (std::string(SuperblockFileName) + ".tmp");
+    {
+        PositionalFile file(tmpPath);
+        file.Truncate(0);
+        file.Write(0, data, Size);
+        file.Sync();
+    }
+    fs::rename(tmpPath, dir / SuperblockFileName);
+}
+
+} // kv_storage
+
+#endif // SUPERBLOCK_H
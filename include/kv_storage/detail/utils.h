@@ -3,16 +3,33 @@
 
 #include <map>
 #include <list>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <unordered_map>
 #include <array>
 #include <optional>
 #include <atomic>
 #include <functional>
+#include <utility>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
 #include <filesystem>
+#include <cstring>
+#include <limits>
+#include <type_traits>
 #include <boost/endian/conversion.hpp>
 #include <boost/thread/shared_mutex.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
 namespace fs = std::filesystem;
 
 #undef max
@@ -21,6 +38,19 @@ namespace kv_storage {
 
 using FileIndex = uint64_t;
 
+//-------------------------------------------------------------------------------
+// Helper for static_assert in discarded 'if constexpr' branches.
+template<class T>
+constexpr bool AlwaysFalse = false;
+
+//-------------------------------------------------------------------------------
+// Current unix time in seconds. Deletion times of keys with TTL are stored in this form.
+inline uint64_t CurrentUnixTime()
+{
+    const auto duration = std::chrono::system_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::seconds>(duration).count();
+}
+
 //-------------------------------------------------------------------------------
 constexpr uint32_t Half(uint32_t num)
 {
@@ -31,86 +61,590 @@ constexpr uint32_t Half(uint32_t num)
 }
 
 //-------------------------------------------------------------------------------
-template<size_t N>
-void InsertToArray(std::array<uint64_t, N>& arr, size_t pos, uint64_t val)
+// Type of sum of values. Floats are summed as doubles, integers wrap around.
+template<class V>
+using AggregateSum = std::conditional_t<std::is_floating_point_v<V>, double, uint64_t>;
+
+//-------------------------------------------------------------------------------
+// Add values[0, count) to sum, minimum and maximum. Values are accumulated in independent
+// lanes (SIMD registers for float and double if compiler targets AVX2), so the next addition
+// doesn't wait for the previous one. NaN values don't change minimum and maximum.
+template<class V>
+void AggregateValues(const V* values, size_t count, AggregateSum<V>& sum, V& min, V& max)
 {
-    if (pos > arr.size())
-        throw std::runtime_error("Invalid position for insert to std array");
+    constexpr size_t Lanes = 4;
+
+    AggregateSum<V> sums[Lanes] = {};
+    V mins[Lanes] = { min, min, min, min };
+    V maxs[Lanes] = { max, max, max, max };
+    size_t i = 0;
 
-    if (pos != arr.max_size())
+#if defined(__AVX2__)
+    if constexpr (std::is_same_v<V, double>)
     {
-        for (size_t i = arr.size() - 1; i > pos; i--)
+        __m256d sumLanes = _mm256_setzero_pd();
+        __m256d minLanes = _mm256_set1_pd(min);
+        __m256d maxLanes = _mm256_set1_pd(max);
+
+        for (; i + Lanes <= count; i += Lanes)
         {
-            std::swap(arr[i], arr[i - 1]);
+            const __m256d chunk = _mm256_loadu_pd(values + i);
+            sumLanes = _mm256_add_pd(sumLanes, chunk);
+            minLanes = _mm256_min_pd(chunk, minLanes);
+            maxLanes = _mm256_max_pd(chunk, maxLanes);
         }
+
+        _mm256_storeu_pd(sums, sumLanes);
+        _mm256_storeu_pd(mins, minLanes);
+        _mm256_storeu_pd(maxs, maxLanes);
     }
+    else if constexpr (std::is_same_v<V, float>)
+    {
+        __m256d sumLanes = _mm256_setzero_pd();
+        __m128 minLanes = _mm_set1_ps(min);
+        __m128 maxLanes = _mm_set1_ps(max);
+
+        for (; i + Lanes <= count; i += Lanes)
+        {
+            const __m128 chunk = _mm_loadu_ps(values + i);
+            sumLanes = _mm256_add_pd(sumLanes, _mm256_cvtps_pd(chunk));
+            minLanes = _mm_min_ps(chunk, minLanes);
+            maxLanes = _mm_max_ps(chunk, maxLanes);
+        }
+
+        _mm256_storeu_pd(sums, sumLanes);
+        _mm_storeu_ps(mins, minLanes);
+        _mm_storeu_ps(maxs, maxLanes);
+    }
+#endif
+
+    for (; i + Lanes <= count; i += Lanes)
+    {
+        for (size_t j = 0; j < Lanes; j++)
+        {
+            const V value = values[i + j];
+            sums[j] += value;
+            mins[j] = value < mins[j] ? value : mins[j];
+            maxs[j] = maxs[j] < value ? value : maxs[j];
+        }
+    }
+
+    for (; i < count; i++)
+    {
+        const V value = values[i];
+        sums[0] += value;
+        mins[0] = value < mins[0] ? value : mins[0];
+        maxs[0] = maxs[0] < value ? value : maxs[0];
+    }
+
+    for (size_t j = 0; j < Lanes; j++)
+    {
+        sum += sums[j];
+        min = mins[j] < min ? mins[j] : min;
+        max = max < maxs[j] ? maxs[j] : max;
+    }
+}
+
+//-------------------------------------------------------------------------------
+// Insert value to arr[0, count) shifting the tail by one memmove. Elements after count are not touched.
+template<size_t N>
+void InsertToArray(std::array<uint64_t, N>& arr, size_t count, size_t pos, uint64_t val)
+{
+    if (pos > count || count >= N)
+        throw std::runtime_error("Invalid position for insert to std array");
+
+    std::memmove(arr.data() + pos + 1, arr.data() + pos, (count - pos) * sizeof(uint64_t));
     arr[pos] = val;
 }
 
 //-------------------------------------------------------------------------------
-template<uint32_t N>
-void InsertToSortedArray(std::array<uint64_t, N>& arr, uint32_t count, uint64_t value)
+// Arrays up to this size are searched by comparing all keys (with SIMD if compiler targets
+// AVX2 or SSE4.2). Bigger arrays are searched by branchless binary search.
+constexpr size_t LinearSearchMaxKeys = 16;
+
+//-------------------------------------------------------------------------------
+// Count of keys in sorted arr[0, count) which are less than value (or not greater if Inclusive).
+// Comparison of all keys has no branches which depend on data, so it doesn't suffer from
+// mispredictions when node is in CPU cache.
+template<bool Inclusive, size_t N>
+uint32_t CountLess(const std::array<uint64_t, N>& arr, uint32_t count, uint64_t value)
 {
-    // TODO: binary search may be?
-    for (uint32_t i = 0; i < count; i++)
+    uint32_t i = 0;
+    uint32_t result = 0;
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+    // SIMD compares signed numbers only, so flip the sign bit of both sides.
+    constexpr auto SignBit = static_cast<int64_t>(1ULL << 63);
+#endif
+
+#if defined(__AVX2__)
+    const __m256i sign = _mm256_set1_epi64x(SignBit);
+    const __m256i needle = _mm256_xor_si256(_mm256_set1_epi64x(static_cast<int64_t>(value)), sign);
+
+    for (; i + 4 <= count; i += 4)
     {
-        if (value < arr[i])
-        {
-            InsertToArray(arr, i, value);
-            return;
-        }
+        const __m256i keys = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(arr.data() + i)), sign);
+        if constexpr (Inclusive)
+            result += 4 - _mm_popcnt_u32(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(keys, needle))));
+        else
+            result += _mm_popcnt_u32(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(needle, keys))));
+    }
+#elif defined(__SSE4_2__)
+    const __m128i sign = _mm_set1_epi64x(SignBit);
+    const __m128i needle = _mm_xor_si128(_mm_set1_epi64x(static_cast<int64_t>(value)), sign);
+
+    for (; i + 2 <= count; i += 2)
+    {
+        const __m128i keys = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(arr.data() + i)), sign);
+        if constexpr (Inclusive)
+            result += 2 - _mm_popcnt_u32(_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(keys, needle))));
+        else
+            result += _mm_popcnt_u32(_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(needle, keys))));
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        result += Inclusive ? arr[i] <= value : arr[i] < value;
+    }
+
+    return result;
+}
+
+//-------------------------------------------------------------------------------
+// The same as CountLess but by binary search. Loop count depends on count only and the
+// choice of the half is a conditional move.
+template<bool Inclusive, size_t N>
+uint32_t BinarySearch(const std::array<uint64_t, N>& arr, uint32_t count, uint64_t value)
+{
+    if (count == 0)
+        return 0;
+
+    const uint64_t* base = arr.data();
+    while (count > 1)
+    {
+        const uint32_t half = count / 2;
+        const bool less = Inclusive ? base[half] <= value : base[half] < value;
+        base = less ? base + half : base;
+        count -= half;
     }
 
-    InsertToArray(arr, count, value);
+    const bool less = Inclusive ? *base <= value : *base < value;
+    return static_cast<uint32_t>(base - arr.data()) + less;
 }
 
 //-------------------------------------------------------------------------------
+// Position of the first key in sorted arr[0, count) which is not less than value.
 template<size_t N>
-void RemoveFromArray(std::array<uint64_t, N>& arr, size_t pos)
+uint32_t LowerBound(const std::array<uint64_t, N>& arr, uint32_t count, uint64_t value)
 {
-    if (pos > arr.size())
+    if constexpr (N <= LinearSearchMaxKeys)
+        return CountLess<false>(arr, count, value);
+    else
+        return BinarySearch<false>(arr, count, value);
+}
+
+//-------------------------------------------------------------------------------
+// Position of the first key in sorted arr[0, count) which is greater than value.
+template<size_t N>
+uint32_t UpperBound(const std::array<uint64_t, N>& arr, uint32_t count, uint64_t value)
+{
+    if constexpr (N <= LinearSearchMaxKeys)
+        return CountLess<true>(arr, count, value);
+    else
+        return BinarySearch<true>(arr, count, value);
+}
+
+//-------------------------------------------------------------------------------
+template<uint32_t N>
+void InsertToSortedArray(std::array<uint64_t, N>& arr, uint32_t count, uint64_t value)
+{
+    InsertToArray(arr, count, UpperBound(arr, count, value), value);
+}
+
+//-------------------------------------------------------------------------------
+// Remove value from arr[0, count) shifting the tail by one memmove. Freed last element becomes zero.
+template<size_t N>
+void RemoveFromArray(std::array<uint64_t, N>& arr, size_t count, size_t pos)
+{
+    if (pos >= count || count > N)
         throw std::runtime_error("Invalid position for removing from std array");
 
-    arr[pos] = 0;
-    if (pos != arr.max_size() - 1)
+    std::memmove(arr.data() + pos, arr.data() + pos + 1, (count - pos - 1) * sizeof(uint64_t));
+    arr[count - 1] = 0;
+}
+
+//-------------------------------------------------------------------------------
+//                               LeafValues
+//-------------------------------------------------------------------------------
+// Values of a leaf in order of keys. Numbers are kept in a plain vector, so
+// insert and erase are a memmove of the tail. Values which are expensive to move
+// (strings, blobs) are kept in unordered slots and only 16-bit slot numbers are
+// shifted, so insert and erase move one value regardless of position. Slots of
+// erased values are reused by next inserts.
+//-------------------------------------------------------------------------------
+template<class V, size_t Capacity>
+class LeafValues
+{
+public:
+    static constexpr bool Slotted = !std::is_arithmetic_v<V>;
+    static_assert(Capacity <= std::numeric_limits<uint16_t>::max(), "Too big capacity for 16-bit slot numbers");
+
+    size_t size() const
+    {
+        if constexpr (Slotted)
+            return m_order.size();
+        else
+            return m_values.size();
+    }
+
+    const V& operator[](size_t pos) const
+    {
+        if constexpr (Slotted)
+            return m_values[m_order[pos]];
+        else
+            return m_values[pos];
+    }
+
+    V& operator[](size_t pos)
+    {
+        if constexpr (Slotted)
+            return m_values[m_order[pos]];
+        else
+            return m_values[pos];
+    }
+
+    // Replace all values.
+    void assign(std::vector<V>&& values)
     {
-        for (size_t i = pos; i < arr.max_size() - 1; i++)
+        m_values = std::move(values);
+
+        if constexpr (Slotted)
         {
-            std::swap(arr[i], arr[i + 1]);
+            m_order.resize(m_values.size());
+            for (size_t i = 0; i < m_order.size(); i++)
+            {
+                m_order[i] = static_cast<uint16_t>(i);
+            }
+            m_freeSlots.clear();
         }
     }
-}
 
+    void insert(size_t pos, V value)
+    {
+        if (pos > size() || size() >= Capacity)
+            throw std::runtime_error("Invalid position for insert to leaf values");
+
+        if constexpr (Slotted)
+        {
+            uint16_t slot;
+            if (m_freeSlots.empty())
+            {
+                slot = static_cast<uint16_t>(m_values.size());
+                m_values.push_back(std::move(value));
+            }
+            else
+            {
+                slot = m_freeSlots.back();
+                m_freeSlots.pop_back();
+                m_values[slot] = std::move(value);
+            }
+
+            m_order.insert(m_order.begin() + pos, slot);
+        }
+        else
+        {
+            m_values.insert(m_values.begin() + pos, value);
+        }
+    }
+
+    // Insert copies of all values of another leaf.
+    void insert(size_t pos, const LeafValues& other)
+    {
+        for (size_t i = 0; i < other.size(); i++)
+        {
+            insert(pos + i, other[i]);
+        }
+    }
+
+    void erase(size_t pos)
+    {
+        if (pos >= size())
+            throw std::runtime_error("Invalid position for removing from leaf values");
+
+        if constexpr (Slotted)
+        {
+            // Release memory of the value, slot itself is kept for reuse.
+            m_values[m_order[pos]] = V();
+            m_freeSlots.push_back(m_order[pos]);
+            m_order.erase(m_order.begin() + pos);
+        }
+        else
+        {
+            m_values.erase(m_values.begin() + pos);
+        }
+    }
+
+    // Values in order of keys. Only numbers are kept contiguously.
+    const V* data() const
+    {
+        static_assert(!Slotted, "Values in slots are not contiguous");
+        return m_values.data();
+    }
+
+    // Remove values [pos, size()) and return them in order.
+    std::vector<V> take_tail(size_t pos)
+    {
+        if constexpr (Slotted)
+        {
+            std::vector<V> tail;
+            for (size_t i = pos; i < m_order.size(); i++)
+            {
+                tail.push_back(std::move(m_values[m_order[i]]));
+            }
+
+            // Half of slots become free after split, place the rest in order again.
+            std::vector<V> head;
+            for (size_t i = 0; i < pos; i++)
+            {
+                head.push_back(std::move(m_values[m_order[i]]));
+            }
+            assign(std::move(head));
+
+            return tail;
+        }
+        else
+        {
+            std::vector<V> tail(std::make_move_iterator(m_values.begin() + pos), std::make_move_iterator(m_values.end()));
+            m_values.erase(m_values.begin() + pos, m_values.end());
+            return tail;
+        }
+    }
+
+private:
+    // Values in order of keys for numbers and in arbitrary order of slots otherwise.
+    std::vector<V> m_values;
+
+    // Slot of every value in order of keys.
+    std::vector<uint16_t> m_order;
+    std::vector<uint16_t> m_freeSlots;
+};
+
+//-------------------------------------------------------------------------------
+//                                NodeLatch
 //-------------------------------------------------------------------------------
-//                              IndexManager
+// Reader-writer latch of a tree node with a version counter for optimistic reads.
+// Version is odd while the latch is held in exclusive mode and is increased after
+// each exclusive section, so a reader can check that node wasn't modified during
+// reading without writing to the latch itself.
 //-------------------------------------------------------------------------------
-class IndexManager
+class NodeLatch
 {
 public:
-    IndexManager(const fs::path& dir)
-        : m_dir(dir)
-    {}
+    void lock()
+    {
+        m_mutex.lock();
+        m_version.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    bool try_lock()
+    {
+        if (!m_mutex.try_lock())
+            return false;
+
+        m_version.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        return true;
+    }
+
+    void unlock()
+    {
+        m_version.fetch_add(1, std::memory_order_release);
+        m_mutex.unlock();
+    }
+
+    void lock_shared()
+    {
+        m_mutex.lock_shared();
+    }
+
+    bool try_lock_shared()
+    {
+        return m_mutex.try_lock_shared();
+    }
+
+    void unlock_shared()
+    {
+        m_mutex.unlock_shared();
+    }
 
-    FileIndex FindFreeIndex(const fs::path& dir)
+    // Return current version or nothing if latch is held in exclusive mode.
+    std::optional<uint64_t> ReadVersion() const
+    {
+        const auto version = m_version.load(std::memory_order_acquire);
+        if (version & 1)
+            return std::nullopt;
+
+        return version;
+    }
+
+    // Check that node wasn't modified since ReadVersion() returned 'version'.
+    bool Validate(uint64_t version) const
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return m_version.load(std::memory_order_relaxed) == version;
+    }
+
+private:
+    boost::shared_mutex m_mutex;
+    std::atomic_uint64_t m_version{ 0 };
+};
+
+//-------------------------------------------------------------------------------
+//                               VolumeMutex
+//-------------------------------------------------------------------------------
+// Lock of a volume with two shared modes which exclude each other: writers share
+// lock_shared() and scanners share lock_scan(). Exclusive mode excludes both.
+// Waiting exclusive owner blocks new writers and scanners. Waiting writers block
+// new scanners and waiting scanners block new writers, when both groups wait the
+// lock is passed to them in turn, so continuous scans don't starve writers and
+// vice versa. A thread which already holds a scan opens another one at once,
+// otherwise it would wait for writers which wait for its first scan.
+//-------------------------------------------------------------------------------
+class VolumeMutex
+{
+public:
+    void lock()
     {
         boost::unique_lock<boost::mutex> lock(m_mutex);
-        while (true)
+        m_exclusiveWaiting++;
+        m_condition.wait(lock, [this]() { return !m_exclusive && m_writers == 0 && m_scanners == 0; });
+        m_exclusiveWaiting--;
+        m_exclusive = true;
+    }
+
+    void unlock()
+    {
         {
-            if (!fs::exists(dir / ("batch_" + std::to_string(++m_currentIndex) + ".dat")) && m_currentIndex != 0 && m_currentIndex != 1)
-                return m_currentIndex;
+            boost::unique_lock<boost::mutex> lock(m_mutex);
+            m_exclusive = false;
         }
+        m_condition.notify_all();
     }
 
-    void Remove(const fs::path& dir, FileIndex index)
+    void lock_shared()
     {
         boost::unique_lock<boost::mutex> lock(m_mutex);
-        fs::remove(dir / ("batch_" + std::to_string(index) + ".dat"));
+        m_writersWaiting++;
+        m_condition.wait(lock, [this]()
+        {
+            if (m_exclusive || m_exclusiveWaiting != 0 || m_scanners != 0)
+                return false;
+
+            // Writers which hold the lock don't let new ones in while scanners wait.
+            return m_writers != 0 ? m_scannersWaiting == 0 : !m_scanTurn || m_scannersWaiting == 0;
+        });
+        m_writersWaiting--;
+        m_writers++;
+    }
+
+    void unlock_shared()
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+        if (--m_writers == 0)
+        {
+            m_scanTurn = true;
+            m_condition.notify_all();
+        }
+    }
+
+    void lock_scan()
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+        auto& threadScans = m_threadScans[std::this_thread::get_id()];
+        if (threadScans == 0)
+        {
+            m_scannersWaiting++;
+            m_condition.wait(lock, [this]()
+            {
+                if (m_exclusive || m_exclusiveWaiting != 0 || m_writers != 0)
+                    return false;
+
+                return m_scanners != 0 ? m_writersWaiting == 0 : m_scanTurn || m_writersWaiting == 0;
+            });
+            m_scannersWaiting--;
+        }
+
+        threadScans++;
+        m_scanners++;
+    }
+
+    // owner - Input parameter. Thread which called lock_scan().
+    void unlock_scan(std::thread::id owner = std::this_thread::get_id())
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+        const auto it = m_threadScans.find(owner);
+        if (--it->second == 0)
+            m_threadScans.erase(it);
+
+        if (--m_scanners == 0)
+        {
+            m_scanTurn = false;
+            m_condition.notify_all();
+        }
     }
 
 private:
-    const fs::path m_dir;
     boost::mutex m_mutex;
-    FileIndex m_currentIndex{ 1 };
+    std::condition_variable_any m_condition;
+    bool m_exclusive{ false };
+    size_t m_exclusiveWaiting{ 0 };
+    size_t m_writers{ 0 };
+    size_t m_writersWaiting{ 0 };
+    size_t m_scanners{ 0 };
+    size_t m_scannersWaiting{ 0 };
+
+    // Group which gets the free lock when both writers and scanners wait, it is the group
+    // which didn't hold the lock last time.
+    bool m_scanTurn{ false };
+
+    // Count of scans of every thread which holds the lock in scan mode.
+    std::unordered_map<std::thread::id, size_t> m_threadScans;
+};
+
+//-------------------------------------------------------------------------------
+// Owner of VolumeMutex in scan mode, like boost::shared_lock for writers.
+//-------------------------------------------------------------------------------
+class ScanLock
+{
+public:
+    explicit ScanLock(VolumeMutex& mutex)
+        : m_mutex(&mutex)
+        , m_owner(std::this_thread::get_id())
+    {
+        m_mutex->lock_scan();
+    }
+
+    ScanLock(ScanLock&& other)
+        : m_mutex(std::exchange(other.m_mutex, nullptr))
+        , m_owner(other.m_owner)
+    {}
+
+    ScanLock(const ScanLock&) = delete;
+    ScanLock& operator= (const ScanLock&) = delete;
+
+    ~ScanLock()
+    {
+        if (m_mutex)
+            m_mutex->unlock_scan(m_owner);
+    }
+
+private:
+    VolumeMutex* m_mutex;
+
+    // Enumerator may be destroyed by another thread than the one which created it.
+    std::thread::id m_owner;
 };
 
 //-------------------------------------------------------------------------------
@@ -151,24 +685,62 @@ void LittleToNativeEndianInplace(T& val)
     }
 }
 
+//-------------------------------------------------------------------------------
+//                              cache_base
+//-------------------------------------------------------------------------------
+// Interface of thread safe caches. Disposer is called for every item which is
+// evicted from a full cache or removed by clear(). Disposer returns false if the
+// item can't be evicted right now, in that case cache tries to find another one.
+template<class Key, class Value>
+class cache_base
+{
+public:
+    typedef Key key_type;
+    typedef Value value_type;
+    typedef std::function<bool(value_type&)> disposer_type;
+
+    virtual ~cache_base() = default;
+
+    virtual size_t size() const = 0;
+    virtual size_t capacity() const = 0;
+    virtual bool empty() const = 0;
+    virtual bool contains(const key_type& key) = 0;
+    virtual bool erase(const key_type& key) = 0;
+    virtual void insert(const key_type& key, const value_type& value) = 0;
+
+    // insert the item only if the key is absent. Returns the item stored in the cache
+    virtual value_type get_or_insert(const key_type& key, const value_type& value) = 0;
+
+    // same as get_or_insert, but the new item has cold priority: it is evicted before other
+    // items unless it is accessed again. Used for items which are read once by scans
+    virtual value_type get_or_insert_cold(const key_type& key, const value_type& value) = 0;
+    virtual std::optional<value_type> get(const key_type& key) = 0;
+    virtual void clear() = 0;
+
+    // call the function for every item. Items must not be added or removed from the function
+    virtual void for_each(const std::function<void(const key_type&, value_type&)>& func) = 0;
+};
+
 //-------------------------------------------------------------------------------
 //                              lfu_cache
 //-------------------------------------------------------------------------------
-// a cache which evicts the least frequently used item when it is full
+// a cache which evicts the least frequently used item when it is full. Cold items
+// are evicted first in order of insertion
 // modified boost cache from boost/compute/detail/lru_cache.hpp
 template<class Key, class Value>
-class lfu_cache
+class lfu_cache : public cache_base<Key, Value>
 {
 public:
     typedef Key key_type;
     typedef Value value_type;
+    typedef typename cache_base<Key, Value>::disposer_type disposer_type;
     typedef std::list<key_type> list_type;
     typedef std::map<
                 key_type,
                 std::pair<value_type, std::atomic_uint32_t>
             > map_type;
 
-    lfu_cache(size_t capacity, std::function<void(Value&)> disposer = [](Value& v) {})
+    lfu_cache(size_t capacity, disposer_type disposer = [](Value& v) { return true; })
         : m_capacity(capacity)
         , m_disposer(disposer)
     {
@@ -185,49 +757,51 @@ public:
         }
     }
 
-    size_t size() const
+    size_t size() const override
     {
         boost::shared_lock<boost::shared_mutex> lock(m_mutex);
         return m_map.size();
     }
 
-    size_t capacity() const
+    size_t capacity() const override
     {
         boost::shared_lock<boost::shared_mutex> lock(m_mutex);
         return m_capacity;
     }
 
-    bool empty() const
+    bool empty() const override
     {
         boost::shared_lock<boost::shared_mutex> lock(m_mutex);
         return m_map.empty();
     }
 
-    bool contains(const key_type &key)
+    bool contains(const key_type &key) override
     {
         boost::shared_lock<boost::shared_mutex> lock(m_mutex);
         return m_map.find(key) != m_map.end();
     }
 
-    bool erase(const key_type& key)
+    bool erase(const key_type& key) override
     {
         boost::unique_lock<boost::shared_mutex> lock(m_mutex);
         typename map_type::iterator i = m_map.find(key);
         if (i != m_map.end())
         {
             m_map.erase(i);
+            m_cold.remove(key);
             return true;
         }
         return false;
     }
 
-    void insert(const key_type &key, const value_type &value)
+    void insert(const key_type &key, const value_type &value) override
     {
         boost::unique_lock<boost::shared_mutex> lock(m_mutex);
         typename map_type::iterator i = m_map.find(key);
         if (i != m_map.end())
         {
             m_map.erase(i);
+            m_cold.remove(key);
             i = m_map.end();
         }
 
@@ -242,7 +816,48 @@ public:
         m_map[key] = std::make_pair(value, 0U);
     }
 
-    std::optional<value_type> get(const key_type &key)
+    value_type get_or_insert(const key_type &key, const value_type &value) override
+    {
+        boost::unique_lock<boost::shared_mutex> lock(m_mutex);
+        typename map_type::iterator i = m_map.find(key);
+        if (i != m_map.end())
+        {
+            return i->second.first;
+        }
+
+        if(m_map.size() >= m_capacity)
+        {
+            evict();
+        }
+
+        m_map[key] = std::make_pair(value, 0U);
+        return value;
+    }
+
+    value_type get_or_insert_cold(const key_type &key, const value_type &value) override
+    {
+        boost::unique_lock<boost::shared_mutex> lock(m_mutex);
+        typename map_type::iterator i = m_map.find(key);
+        if (i != m_map.end())
+        {
+            return i->second.first;
+        }
+
+        if(m_map.size() >= m_capacity)
+        {
+            evict();
+        }
+
+        // the oldest cold item becomes a usual one when the list is full
+        if (m_cold.size() >= m_capacity)
+            m_cold.pop_front();
+
+        m_map[key] = std::make_pair(value, 0U);
+        m_cold.push_back(key);
+        return value;
+    }
+
+    std::optional<value_type> get(const key_type &key) override
     {
         boost::shared_lock<boost::shared_mutex> lock(m_mutex);
         // lookup value in the cache
@@ -263,7 +878,7 @@ public:
                 return std::nullopt;
             }
 
-            typename map_type::iterator minIt;
+            typename map_type::iterator minIt = m_map.begin();
             for (auto it = m_map.begin(); it != m_map.end(); it++)
             {
                 if (minIt->second.second > it->second.second)
@@ -291,7 +906,17 @@ public:
         }
     }
 
-    void clear()
+    void for_each(const std::function<void(const key_type&, value_type&)>& func) override
+    {
+        boost::shared_lock<boost::shared_mutex> lock(m_mutex);
+
+        for (auto& item : m_map)
+        {
+            func(item.first, item.second.first);
+        }
+    }
+
+    void clear() override
     {
         boost::unique_lock<boost::shared_mutex> lock(m_mutex);
 
@@ -301,27 +926,389 @@ public:
         }
 
         m_map.clear();
+        m_cold.clear();
     }
 
 private:
     void evict()
     {
-        typename map_type::iterator minIt;
+        // cold items which are busy are moved to the end of the list
+        for (size_t attempts = m_cold.size(); attempts != 0; attempts--)
+        {
+            const key_type key = m_cold.front();
+            m_cold.pop_front();
+
+            typename map_type::iterator coldIt = m_map.find(key);
+            if (coldIt == m_map.end())
+                continue;
+
+            if (m_disposer(coldIt->second.first))
+            {
+                m_map.erase(coldIt);
+                return;
+            }
+
+            m_cold.push_back(key);
+        }
+
+        typename map_type::iterator minIt = m_map.begin();
         for (auto it = m_map.begin(); it != m_map.end(); it++)
         {
             if (minIt->second.second > it->second.second)
                 minIt = it;
         }
 
-        m_disposer(minIt->second.first);
-        m_map.erase(minIt);
+        if (m_disposer(minIt->second.first))
+        {
+            m_map.erase(minIt);
+            return;
+        }
+
+        // the least frequently used item is busy, evict any other item
+        for (auto it = m_map.begin(); it != m_map.end(); it++)
+        {
+            if (it != minIt && m_disposer(it->second.first))
+            {
+                m_map.erase(it);
+                return;
+            }
+        }
     }
 
 private:
     map_type m_map;
+    list_type m_cold;
     size_t m_capacity;
     mutable boost::shared_mutex m_mutex;
-    std::function<void(Value&)> m_disposer;
+    disposer_type m_disposer;
+};
+
+//-------------------------------------------------------------------------------
+//                           sharded_clock_cache
+//-------------------------------------------------------------------------------
+// a cache which is split to independent shards by hash of the key. Every shard
+// evicts items by CLOCK algorithm: each item has a reference bit which is set on
+// access, eviction hand clears the bits and evicts the first item without it.
+// All operations are O(1) amortized and lookups take only a shared lock of one
+// shard. Capacity is divided between shards equally. Cold items are kept in a
+// FIFO queue of their shard and are evicted before the hand moves, unless they
+// are accessed again: then they stay in the clock as usual items.
+template<class Key, class Value>
+class sharded_clock_cache : public cache_base<Key, Value>
+{
+public:
+    typedef Key key_type;
+    typedef Value value_type;
+    typedef typename cache_base<Key, Value>::disposer_type disposer_type;
+
+    sharded_clock_cache(size_t capacity, disposer_type disposer = [](Value& v) { return true; }, size_t shardCount = 64)
+        : m_capacity(capacity)
+        , m_shardCount(std::max<size_t>(1, std::min(shardCount, capacity)))
+        , m_shards(std::make_unique<shard[]>(m_shardCount))
+        , m_disposer(disposer)
+    {
+        for (size_t i = 0; i < m_shardCount; i++)
+        {
+            m_shards[i].capacity = std::max<size_t>(1, (capacity + m_shardCount - 1) / m_shardCount);
+        }
+    }
+
+    ~sharded_clock_cache()
+    {
+        try
+        {
+            clear();
+        }
+        catch (...)
+        {
+        }
+    }
+
+    size_t size() const override
+    {
+        size_t result = 0;
+        for (size_t i = 0; i < m_shardCount; i++)
+        {
+            boost::shared_lock<boost::shared_mutex> lock(m_shards[i].mutex);
+            result += m_shards[i].index.size();
+        }
+        return result;
+    }
+
+    size_t capacity() const override
+    {
+        return m_capacity;
+    }
+
+    bool empty() const override
+    {
+        return size() == 0;
+    }
+
+    bool contains(const key_type& key) override
+    {
+        auto& s = get_shard(key);
+        boost::shared_lock<boost::shared_mutex> lock(s.mutex);
+        return s.index.find(key) != s.index.end();
+    }
+
+    bool erase(const key_type& key) override
+    {
+        auto& s = get_shard(key);
+        boost::unique_lock<boost::shared_mutex> lock(s.mutex);
+        auto i = s.index.find(key);
+        if (i == s.index.end())
+            return false;
+
+        release_slot(s, i->second);
+        s.index.erase(i);
+        return true;
+    }
+
+    void insert(const key_type& key, const value_type& value) override
+    {
+        auto& s = get_shard(key);
+        boost::unique_lock<boost::shared_mutex> lock(s.mutex);
+        auto i = s.index.find(key);
+        if (i != s.index.end())
+        {
+            s.slots[i->second].value = value;
+            s.slots[i->second].referenced.store(true, std::memory_order_relaxed);
+            return;
+        }
+
+        emplace(s, key, value);
+    }
+
+    value_type get_or_insert(const key_type& key, const value_type& value) override
+    {
+        auto& s = get_shard(key);
+        boost::unique_lock<boost::shared_mutex> lock(s.mutex);
+        auto i = s.index.find(key);
+        if (i != s.index.end())
+        {
+            s.slots[i->second].referenced.store(true, std::memory_order_relaxed);
+            return s.slots[i->second].value;
+        }
+
+        emplace(s, key, value);
+        return value;
+    }
+
+    value_type get_or_insert_cold(const key_type& key, const value_type& value) override
+    {
+        auto& s = get_shard(key);
+        boost::unique_lock<boost::shared_mutex> lock(s.mutex);
+        auto i = s.index.find(key);
+        if (i != s.index.end())
+            return s.slots[i->second].value;
+
+        const auto pos = emplace(s, key, value);
+
+        // the oldest cold item becomes a usual one when the queue is full
+        if (s.cold.size() >= s.capacity)
+        {
+            s.slots[s.cold.front()].cold = false;
+            s.cold.pop_front();
+        }
+
+        s.slots[pos].cold = true;
+        s.cold.push_back(pos);
+        return value;
+    }
+
+    std::optional<value_type> get(const key_type& key) override
+    {
+        auto& s = get_shard(key);
+        boost::shared_lock<boost::shared_mutex> lock(s.mutex);
+        auto i = s.index.find(key);
+        if (i == s.index.end())
+            return std::nullopt;
+
+        auto& item = s.slots[i->second];
+
+        // avoid writing to the shared cache line if the bit is already set
+        if (!item.referenced.load(std::memory_order_relaxed))
+            item.referenced.store(true, std::memory_order_relaxed);
+
+        return item.value;
+    }
+
+    void for_each(const std::function<void(const key_type&, value_type&)>& func) override
+    {
+        for (size_t i = 0; i < m_shardCount; i++)
+        {
+            auto& s = m_shards[i];
+            boost::shared_lock<boost::shared_mutex> lock(s.mutex);
+
+            for (auto& item : s.index)
+            {
+                func(item.first, s.slots[item.second].value);
+            }
+        }
+    }
+
+    void clear() override
+    {
+        for (size_t i = 0; i < m_shardCount; i++)
+        {
+            auto& s = m_shards[i];
+            boost::unique_lock<boost::shared_mutex> lock(s.mutex);
+
+            for (auto& item : s.index)
+            {
+                m_disposer(s.slots[item.second].value);
+                release_slot(s, item.second);
+            }
+
+            s.index.clear();
+            s.cold.clear();
+        }
+    }
+
+private:
+    struct slot
+    {
+        key_type key{};
+        value_type value{};
+        std::atomic_bool referenced{ false };
+        bool used{ false };
+        bool cold{ false };
+    };
+
+    struct shard
+    {
+        mutable boost::shared_mutex mutex;
+        std::unordered_map<key_type, size_t> index;
+        // deque doesn't move items on growth, so slots with atomics can be appended
+        std::deque<slot> slots;
+        std::vector<size_t> freeSlots;
+        // slots of cold items in order of insertion
+        std::deque<size_t> cold;
+        size_t hand{ 0 };
+        size_t capacity{ 0 };
+    };
+
+    shard& get_shard(const key_type& key) const
+    {
+        // keys are often sequential, so mix bits before taking the remainder
+        uint64_t h = static_cast<uint64_t>(std::hash<key_type>()(key));
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return m_shards[h % m_shardCount];
+    }
+
+    void release_slot(shard& s, size_t pos)
+    {
+        auto& item = s.slots[pos];
+        item.value = value_type{};
+        item.used = false;
+        item.referenced.store(false, std::memory_order_relaxed);
+        s.freeSlots.push_back(pos);
+
+        // the slot stays in the cold queue until eviction or insertion skips it
+        item.cold = false;
+    }
+
+    // must be called under the unique lock of shard. Returns slot of the item
+    size_t emplace(shard& s, const key_type& key, const value_type& value)
+    {
+        if (s.index.size() >= s.capacity)
+            evict(s);
+
+        size_t pos;
+        if (!s.freeSlots.empty())
+        {
+            pos = s.freeSlots.back();
+            s.freeSlots.pop_back();
+        }
+        else
+        {
+            pos = s.slots.size();
+            s.slots.emplace_back();
+        }
+
+        auto& item = s.slots[pos];
+        item.key = key;
+        item.value = value;
+        item.used = true;
+        item.referenced.store(false, std::memory_order_relaxed);
+        s.index.emplace(key, pos);
+        return pos;
+    }
+
+    // must be called under the unique lock of shard. Returns true if an item was evicted
+    bool evict_cold(shard& s)
+    {
+        // cold items which are busy are moved to the end of the queue
+        for (size_t attempts = s.cold.size(); attempts != 0; attempts--)
+        {
+            const size_t pos = s.cold.front();
+            s.cold.pop_front();
+
+            auto& item = s.slots[pos];
+            if (!item.used || !item.cold)
+                continue;
+
+            if (item.referenced.load(std::memory_order_relaxed))
+            {
+                item.cold = false;
+                continue;
+            }
+
+            if (!m_disposer(item.value))
+            {
+                s.cold.push_back(pos);
+                continue;
+            }
+
+            item.cold = false;
+            s.index.erase(item.key);
+            release_slot(s, pos);
+            return true;
+        }
+
+        return false;
+    }
+
+    void evict(shard& s)
+    {
+        if (evict_cold(s))
+            return;
+
+        // two full turns: the first one may only clear reference bits. If all items
+        // are still busy after that then shard temporarily grows over its capacity
+        const size_t steps = s.slots.size() * 2;
+        for (size_t i = 0; i < steps; i++)
+        {
+            const size_t pos = s.hand;
+            s.hand = (s.hand + 1) % s.slots.size();
+
+            auto& item = s.slots[pos];
+            if (!item.used)
+                continue;
+
+            if (item.referenced.load(std::memory_order_relaxed))
+            {
+                item.referenced.store(false, std::memory_order_relaxed);
+                continue;
+            }
+
+            if (!m_disposer(item.value))
+                continue;
+
+            s.index.erase(item.key);
+            release_slot(s, pos);
+            return;
+        }
+    }
+
+private:
+    const size_t m_capacity;
+    const size_t m_shardCount;
+    std::unique_ptr<shard[]> m_shards;
+    disposer_type m_disposer;
 };
 
 } // kv_storage
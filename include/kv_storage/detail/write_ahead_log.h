@@ -0,0 +1,448 @@
+#ifndef WRITE_AHEAD_LOG_H
+#define WRITE_AHEAD_LOG_H
+
+#include <string>
+#include <vector>
+#include <optional>
+#include <type_traits>
+#include <boost/crc.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "bp_node.h"
+
+namespace kv_storage {
+
+//-------------------------------------------------------------------------------
+// Durability of Put and Delete.
+enum class WalMode
+{
+    Disabled,  // No log. Changes reach disk only when nodes are flushed.
+    Buffered,  // Operation is written to the log before it returns, log is synced only on checkpoint.
+               // Survives crash of the process but not of the OS.
+    Sync       // Operation returns when its record is synced to disk. Concurrent writers share one sync.
+};
+
+//-------------------------------------------------------------------------------
+constexpr const char* WalFileName = "wal.log";
+
+//-------------------------------------------------------------------------------
+// Volume makes checkpoint when log grows over this size.
+constexpr uint64_t CheckpointLogSize = 64 * 1024 * 1024;
+
+//-------------------------------------------------------------------------------
+//                              WriteAheadLog
+//-------------------------------------------------------------------------------
+// Append-only log of volume changes. Writers append records to the buffer
+// under their leaf latches, so records of the same key are ordered as changes
+// in the tree. After that they call Commit() without latches. The first
+// committing thread writes the buffer with records of all waiting threads and
+// syncs it once (group commit), the others wait for it.
+//
+// Checkpoint writes images of all changed nodes and removed indices to the log
+// followed by the checkpoint marker. After that nodes are written in place and
+// the log is cleared. If checkpoint is interrupted, images are written again
+// on recovery. Otherwise the tree on disk is the state of the last checkpoint
+// and Put/Delete records are applied to it again.
+//
+// The first error of writing or syncing the log fails it for good: the state of
+// the file is unknown and a repeated sync may report success for lost data. All
+// following commits throw, the volume must be reopened to recover from the log.
+//
+// Record format:
+//  0xXX 0xXX 0xXX 0xXX          - Size of record data.
+//  0xXX 0xXX 0xXX 0xXX          - CRC32 of record data.
+//  Record data:
+//   'P' key %Value%             - Put. Value format is the same as in leaves.
+//   'E' key time %Value%        - Put of key with deletion time (unix time in seconds).
+//   'D' key                     - Delete.
+//   'N' index %Node%            - Node image of checkpoint.
+//   'R' index                   - Removed index of checkpoint.
+//   'C'                         - End of checkpoint.
+//-------------------------------------------------------------------------------
+template<class V>
+class WriteAheadLog
+{
+public:
+    struct Record
+    {
+        Key key;
+        std::optional<V> value;  // Put if has value, Delete otherwise
+        uint64_t expiry{ 0 };    // Deletion time of put key, 0 if key has no TTL
+    };
+
+    struct Contents
+    {
+        // Operations after the last complete checkpoint.
+        std::vector<Record> records;
+
+        // Last complete checkpoint which may be not written in place.
+        std::vector<std::pair<FileIndex, std::string>> nodes;
+        std::vector<FileIndex> removed;
+    };
+
+    WriteAheadLog(const fs::path& path, WalMode mode);
+
+    // Read the log. Torn record at the end is ignored.
+    Contents Read() const;
+
+    // Append record to the buffer. Returns log position for Commit().
+    uint64_t AppendPut(Key key, const V& value, uint64_t expiry = 0);
+    uint64_t AppendDelete(Key key);
+
+    // Wait until the log is written up to the position. Throws if the log failed.
+    void Commit(uint64_t position);
+
+    // Write and sync checkpoint records.
+    void WriteCheckpoint(const std::vector<std::pair<FileIndex, std::string>>& nodes, const std::vector<FileIndex>& removed);
+
+    // Remove all records. Caller must guarantee that nobody appends records concurrently.
+    void Clear();
+
+    // Size of the log including buffered records.
+    uint64_t Size() const;
+
+    // True if writing or syncing the log failed.
+    bool IsFailed() const;
+
+private:
+    uint64_t Append(const std::string& data);
+
+    static void WriteValue(std::string& out, const V& value);
+    static V ReadValue(const char*& data, const char* end);
+
+    template<class T>
+    static void WriteNumber(std::string& out, T value);
+
+    template<class T>
+    static T ReadNumber(const char*& data, const char* end);
+
+private:
+    PositionalFile m_file;
+    const WalMode m_mode;
+
+    mutable boost::mutex m_mutex;
+    boost::condition_variable m_written;
+    std::string m_buffer;
+
+    // Position of the end of written records.
+    uint64_t m_writtenSize{ 0 };
+
+    // Position of the end of appended records.
+    uint64_t m_appendedSize{ 0 };
+    bool m_writing{ false };
+    bool m_failed{ false };
+};
+
+//-------------------------------------------------------------------------------
+template<class V>
+WriteAheadLog<V>::WriteAheadLog(const fs::path& path, WalMode mode)
+    : m_file(path)
+    , m_mode(mode)
+{
+    m_writtenSize = m_file.Size();
+    m_appendedSize = m_writtenSize;
+}
+
+//-------------------------------------------------------------------------------
+template<class V>
+typename WriteAheadLog<V>::Contents WriteAheadLog<V>::Read() const
+{
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+
+    std::string log(m_writtenSize, '\0');
+    log.resize(m_file.Read(0, log.data(), log.size()));
+
+    Contents contents;
+    Contents checkpoint;
+
+    for (size_t pos = 0; pos + 8 <= log.size();)
+    {
+        const char* header = log.data() + pos;
+        const auto size = ReadNumber<uint32_t>(header, log.data() + log.size());
+        const auto crc = ReadNumber<uint32_t>(header, log.data() + log.size());
+
+        if (size == 0 || pos + 8 + size > log.size())
+            break;
+
+        boost::crc_32_type calculated;
+        calculated.process_bytes(log.data() + pos + 8, size);
+        if (calculated.checksum() != crc)
+            break;
+
+        const char* data = log.data() + pos + 8;
+        const char* end = data + size;
+        const char type = *data++;
+
+        switch (type)
+        {
+        case 'P':
+        {
+            const auto key = ReadNumber<Key>(data, end);
+            contents.records.push_back({ key, ReadValue(data, end) });
+            break;
+        }
+        case 'E':
+        {
+            const auto key = ReadNumber<Key>(data, end);
+            const auto expiry = ReadNumber<uint64_t>(data, end);
+            contents.records.push_back({ key, ReadValue(data, end), expiry });
+            break;
+        }
+        case 'D':
+            contents.records.push_back({ ReadNumber<Key>(data, end), std::nullopt });
+            break;
+        case 'N':
+        {
+            const auto idx = ReadNumber<FileIndex>(data, end);
+            checkpoint.nodes.emplace_back(idx, std::string(data, end));
+            break;
+        }
+        case 'R':
+            checkpoint.removed.push_back(ReadNumber<FileIndex>(data, end));
+            break;
+        case 'C':
+            // Operations before the checkpoint are already in node images.
+            contents.records.clear();
+            contents.nodes = std::move(checkpoint.nodes);
+            contents.removed = std::move(checkpoint.removed);
+            checkpoint = Contents();
+            break;
+        default:
+            throw std::runtime_error("Invalid log record");
+        }
+
+        pos += 8 + size;
+    }
+
+    return contents;
+}
+
+//-------------------------------------------------------------------------------
+template<class V>
+uint64_t WriteAheadLog<V>::AppendPut(Key key, const V& value, uint64_t expiry)
+{
+    std::string data(1, expiry ? 'E' : 'P');
+    WriteNumber(data, key);
+    if (expiry)
+        WriteNumber(data, expiry);
+    WriteValue(data, value);
+    return Append(data);
+}
+
+//-------------------------------------------------------------------------------
+template<class V>
+uint64_t WriteAheadLog<V>::AppendDelete(Key key)
+{
+    std::string data(1, 'D');
+    WriteNumber(data, key);
+    return Append(data);
+}
+
+//-------------------------------------------------------------------------------
+template<class V>
+uint64_t WriteAheadLog<V>::Append(const std::string& data)
+{
+    boost::crc_32_type crc;
+    crc.process_bytes(data.data(), data.size());
+
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    WriteNumber(m_buffer, static_cast<uint32_t>(data.size()));
+    WriteNumber(m_buffer, static_cast<uint32_t>(crc.checksum()));
+    m_buffer.append(data);
+
+    m_appendedSize += 8 + data.size();
+    return m_appendedSize;
+}
+
+//-------------------------------------------------------------------------------
+template<class V>
+void WriteAheadLog<V>::Commit(uint64_t position)
+{
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+
+    while (m_writtenSize < position)
+    {
+        if (m_failed)
+            throw std::runtime_error("Write-ahead log failed, volume must be reopened");
+
+        if (m_writing)
+        {
+            m_written.wait(lock);
+            continue;
+        }
+
+        // Write records of all waiting threads.
+        m_writing = true;
+        std::string buffer;
+        buffer.swap(m_buffer);
+        const auto offset = m_writtenSize;
+
+        lock.unlock();
+
+        try
+        {
+            m_file.Write(offset, buffer.data(), buffer.size());
+            if (m_mode == WalMode::Sync)
+                m_file.Sync();
+        }
+        catch (...)
+        {
+            lock.lock();
+            m_failed = true;
+            m_writing = false;
+            m_written.notify_all();
+            throw;
+        }
+
+        lock.lock();
+        m_writtenSize = offset + buffer.size();
+        m_writing = false;
+        m_written.notify_all();
+    }
+}
+
+//-------------------------------------------------------------------------------
+template<class V>
+void WriteAheadLog<V>::WriteCheckpoint(const std::vector<std::pair<FileIndex, std::string>>& nodes, const std::vector<FileIndex>& removed)
+{
+    for (const auto& node : nodes)
+    {
+        std::string data(1, 'N');
+        WriteNumber(data, node.first);
+        data.append(node.second);
+        Append(data);
+    }
+
+    for (auto idx : removed)
+    {
+        std::string data(1, 'R');
+        WriteNumber(data, idx);
+        Append(data);
+    }
+
+    Commit(Append(std::string(1, 'C')));
+
+    if (m_mode != WalMode::Sync)
+    {
+        try
+        {
+            m_file.Sync();
+        }
+        catch (...)
+        {
+            boost::unique_lock<boost::mutex> lock(m_mutex);
+            m_failed = true;
+            throw;
+        }
+    }
+}
+
+//-------------------------------------------------------------------------------
+template<class V>
+void WriteAheadLog<V>::Clear()
+{
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+
+    try
+    {
+        m_file.Truncate(0);
+        m_file.Sync();
+    }
+    catch (...)
+    {
+        m_failed = true;
+        throw;
+    }
+
+    m_buffer.clear();
+    m_writtenSize = 0;
+    m_appendedSize = 0;
+}
+
+//-------------------------------------------------------------------------------
+template<class V>
+uint64_t WriteAheadLog<V>::Size() const
+{
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    return m_appendedSize;
+}
+
+//-------------------------------------------------------------------------------
+template<class V>
+bool WriteAheadLog<V>::IsFailed() const
+{
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    return m_failed;
+}
+
+//-------------------------------------------------------------------------------
+template<class V>
+template<class T>
+void WriteAheadLog<V>::WriteNumber(std::string& out, T value)
+{
+    value = NativeToLittleEndian(value);
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+//-------------------------------------------------------------------------------
+template<class V>
+template<class T>
+T WriteAheadLog<V>::ReadNumber(const char*& data, const char* end)
+{
+    if (end - data < static_cast<ptrdiff_t>(sizeof(T)))
+        throw std::runtime_error("Invalid log record");
+
+    T value;
+    std::copy(data, data + sizeof(T), reinterpret_cast<char*>(&value));
+    data += sizeof(T);
+
+    LittleToNativeEndianInplace(value);
+    return value;
+}
+
+//-------------------------------------------------------------------------------
+template<class V>
+void WriteAheadLog<V>::WriteValue(std::string& out, const V& value)
+{
+    if constexpr (std::is_same_v<V, std::string> || std::is_same_v<V, std::vector<char>>)
+    {
+        WriteNumber(out, static_cast<uint32_t>(value.size()));
+        out.append(value.data(), value.size());
+    }
+    else if constexpr (std::is_same_v<V, float> || std::is_same_v<V, double> || std::is_same_v<V, uint32_t> || std::is_same_v<V, uint64_t>)
+    {
+        WriteNumber(out, value);
+    }
+    else
+    {
+        static_assert(AlwaysFalse<V>, "Type must be string, blob, float, double or uint");
+    }
+}
+
+//-------------------------------------------------------------------------------
+template<class V>
+V WriteAheadLog<V>::ReadValue(const char*& data, const char* end)
+{
+    if constexpr (std::is_same_v<V, std::string> || std::is_same_v<V, std::vector<char>>)
+    {
+        const auto size = ReadNumber<uint32_t>(data, end);
+        if (end - data < static_cast<ptrdiff_t>(size))
+            throw std::runtime_error("Invalid log record");
+
+        V value(data, data + size);
+        data += size;
+        return value;
+    }
+    else if constexpr (std::is_same_v<V, float> || std::is_same_v<V, double> || std::is_same_v<V, uint32_t> || std::is_same_v<V, uint64_t>)
+    {
+        return ReadNumber<V>(data, end);
+    }
+    else
+    {
+        static_assert(AlwaysFalse<V>, "Type must be string, blob, float, double or uint");
+    }
+}
+
+} // kv_storage
+
+#endif // WRITE_AHEAD_LOG_H
@@ -5,9 +5,16 @@
 #include <memory>
 #include <filesystem>
 #include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <limits>
+#include <condition_variable>
+#include <deque>
 
 #include <kv_storage/detail/node.h>
 #include <kv_storage/detail/keys_deleter.h>
+#include <kv_storage/detail/write_ahead_log.h>
+#include <kv_storage/detail/superblock.h>
 
 namespace fs = std::filesystem;
 
@@ -16,6 +23,102 @@ namespace kv_storage {
 template <class V, size_t BranchFactor>
 class VolumeEnumerator;
 
+//-------------------------------------------------------------------------------
+// How many dirty nodes background writeback writes at once.
+constexpr size_t WritebackBatchSize = 256;
+
+//-------------------------------------------------------------------------------
+// How often background writeback checks dirty nodes if nobody wakes it up.
+constexpr std::chrono::milliseconds WritebackPeriod(100);
+
+//-------------------------------------------------------------------------------
+// Default max count of leaves which enumerator loads ahead, see Volume::SetReadAhead().
+constexpr size_t DefaultReadAheadLeaves = 16;
+
+//-------------------------------------------------------------------------------
+// Where deletion time of keys put with TTL is kept.
+enum class TtlMode
+{
+    Background,  // In memory and in 'keys_ttls.dat'. Keys are deleted by the thread of Volume::Start().
+    Inline       // In leaves next to values. Outdated keys are absent for reads at once and are removed
+                 // from leaves when they are changed. Volume::Start() is not needed.
+};
+
+//-------------------------------------------------------------------------------
+// Built-in operators of Volume::Merge().
+enum class MergeOperator
+{
+    Add,  // Sum of value and operand
+    Min,  // Minimum of value and operand
+    Max   // Maximum of value and operand
+};
+
+//-------------------------------------------------------------------------------
+// Result of Volume::Aggregate().
+template<class V>
+struct Aggregates
+{
+    uint64_t count{ 0 };
+    AggregateSum<V> sum{ 0 };
+    std::optional<V> min;  // Empty if there are no values except NaN
+    std::optional<V> max;  // Empty if there are no values except NaN
+};
+
+//-------------------------------------------------------------------------------
+//                                 WriteBatch
+//-------------------------------------------------------------------------------
+// Puts and deletes which are applied to volume together by Volume::Write().
+// Operations are sorted by key, so every affected leaf is found once and changed
+// under one latch. The last operation of a key wins. Batch is not atomic:
+// readers may see a part of it, and after an error a part of it stays applied.
+//-------------------------------------------------------------------------------
+template<class V>
+class WriteBatch
+{
+public:
+    // Unlike Volume::Put this replaces value of existing key. Key put by batch has no TTL.
+    void Put(Key key, const V& value);
+    void Delete(Key key);
+    void Clear();
+
+    // Count of operations including the ones which are overridden by later operations of the same key.
+    size_t GetSize() const;
+
+private:
+    template<class, size_t> friend class Volume;
+
+    // Value to put or std::nullopt to delete.
+    std::vector<std::pair<Key, std::optional<V>>> m_operations;
+};
+
+//-------------------------------------------------------------------------------
+template<class V>
+void WriteBatch<V>::Put(Key key, const V& value)
+{
+    m_operations.emplace_back(key, value);
+}
+
+//-------------------------------------------------------------------------------
+template<class V>
+void WriteBatch<V>::Delete(Key key)
+{
+    m_operations.emplace_back(key, std::nullopt);
+}
+
+//-------------------------------------------------------------------------------
+template<class V>
+void WriteBatch<V>::Clear()
+{
+    m_operations.clear();
+}
+
+//-------------------------------------------------------------------------------
+template<class V>
+size_t WriteBatch<V>::GetSize() const
+{
+    return m_operations.size();
+}
+
 //-------------------------------------------------------------------------------
 //                                   Volume
 //-------------------------------------------------------------------------------
@@ -26,12 +129,37 @@ class VolumeEnumerator;
 // Supported types of values is std::string, std::vector<char>, float,
 // double, uint32_t, uint64_t. Keys is uint64_t.
 // 
-// Volume is stored in a single directory with files named as "batch_%d.dat".
-// One batch may be a leaf node with real data or an internal node with pointers
-// to another files. "batch_1.dat" is always root. Byte order in batches is always
-// little endian.
+// Volume is stored in a single directory. Every node of the tree is a batch with
+// a number (FileIndex). One batch may be a leaf node with real data or an internal
+// node with pointers to another batches. Batch 1 is always root. Byte order in
+// batches is always little endian.
+// 
+// Batches are stored in one of two formats which is chosen when volume is created
+// (see StorageFormat):
+//  Files - Every batch is a separate file named as "batch_%d.dat".
+//  Paged - All batches are pages of the single file "volume.dat", see
+//          PagedNodeStorage for details. Big batches take several pages.
+// ConvertStorageFormat() converts closed volume from one format to another.
+// 
+// Changed nodes are written to disk by background writeback thread. It wakes up
+// when count of dirty nodes reaches the high watermark and writes them in batches
+// ordered by index until count drops to the low watermark (see SetDirtyWatermarks()).
+// Cache never evicts dirty nodes, so Put and Delete don't wait for unrelated writes.
+// 
+// Optionally Put and Delete are written to the log "wal.log" (see WalMode and
+// WriteAheadLog). Changed nodes are written to disk only by checkpoint, which is
+// made when log becomes big, by writeback, by Checkpoint() and StopAndFlush(). On
+// opening volume replays the log. Key TTLs are not logged.
 // 
-// Node file format:
+// Keys with TTL have deletion time either in 'keys_ttls.dat' or in leaves, see TtlMode.
+// 
+// File "superblock.dat" keeps branch factor and value type of the volume, so
+// volume can't be opened with other template parameters, and tree height and
+// key count (see Superblock). It is written by checkpoints of the log and when
+// volume is closed. If it is absent or its statistics are outdated because
+// volume was not closed properly, volume counts keys once by scan of leaves.
+// 
+// Node format:
 //  0x38                         - Node marker.
 //  0xXX 0xXX 0xXX 0xXX          - Key count in node.
 //  (BranchFactor - 1) * 8 bytes - Keys. First key count is real keys and remainder is zeros.
@@ -40,7 +168,7 @@ class VolumeEnumerator;
 //                                 Amount of pointers is always one more than a keys. 
 //                                 Remainder is zeros.
 //  
-// Leaf file format:
+// Leaf format:
 //  0x39                         - Leaf marker.
 //  0xXX 0xXX 0xXX 0xXX          - Key count in leaf.
 //  (BranchFactor - 1) * 8 bytes - Keys. First key count is real keys and remainder is zeros.
@@ -51,75 +179,302 @@ class VolumeEnumerator;
 // strings and vector<char> placed as sequence of pairs <uint32_t, %data%>. First
 // number is size of next data.
 // 
-// Special file with name 'keys_ttls.dat' which keeps keys with limited time to live:
-//  0xXX 0xXX 0xXX 0xXX                     - Key count
-//  Key count of pairs <uint64_t, uint64_t> - Key -> unix time for deletion
+// Special file with name 'keys_ttls.dat' which keeps keys with limited time to live.
+// It is the log of changes of unix time for deletion of keys, which is appended by
+// checkpoints and compacted in background (see OutdatedKeysDeleter).
 //-------------------------------------------------------------------------------
 template <class V, size_t BranchFactor = 150>
 class Volume
 {
+    template<class, size_t> friend class OutdatedKeysDeleter;
+
 public:
     // directory - Input parameter. Directory for Volume.
     // cacheSize - Input parameter. How many nodes LRU cache keeps before begin to flush nodes to disk.
-    Volume(const fs::path& directory, size_t cacheSize = 200000);
+    // cachePolicy - Input parameter. Eviction policy of nodes cache.
+    // format - Input parameter. Storage format of nodes. Throws if existing volume has another format.
+    // walMode - Input parameter. Durability of changes.
+    // ttlMode - Input parameter. Storage of deletion time of keys with TTL.
+    Volume(const fs::path& directory, size_t cacheSize = 200000, CachePolicy cachePolicy = CachePolicy::ShardedClock, StorageFormat format = StorageFormat::Files, WalMode walMode = WalMode::Disabled,
+        TtlMode ttlMode = TtlMode::Background);
 
     Volume(Volume&&);
-    Volume& operator= (Volume&&);
+    Volume& operator= (Volume&&) = delete;
 
     // key - Input parameter. Key to insert.
     // value - Input parameter. Value to insert.
     // keyTtl - Optional input parameter. How many seconds volume should keep key before delete.
     void Put(const Key& key, const V& value, std::optional<uint32_t> keyTtl = std::nullopt);
 
+    // Put key or replace value of existing key in place. Existing key gets TTL of this call.
+    // key - Input parameter. Key to insert or update.
+    // value - Input parameter. New value.
+    // keyTtl - Optional input parameter. How many seconds volume should keep key before delete.
+    void Upsert(const Key& key, const V& value, std::optional<uint32_t> keyTtl = std::nullopt);
+
+    // Combine value of key with the operand atomically. Missing key is created with the operand
+    // as value. TTL of existing key is not changed.
+    // key - Input parameter. Key to change.
+    // operand - Input parameter. Second argument of the operator.
+    // op - Input parameter. Built-in operator, values must be numeric.
+    // Return parameter is the new value of key.
+    V Merge(const Key& key, const V& operand, MergeOperator op);
+
+    // Same as above with user operator which is called as op(current value, operand) and returns
+    // the new value. It is called under the leaf latch, so it must not use the volume.
+    template<class Op>
+    V Merge(const Key& key, const V& operand, Op op);
+
+    // Replace value of existing key in place. TTL of key is not changed.
+    // key - Input parameter. Key to update.
+    // value - Input parameter. New value.
+    // Return parameter is false if there is no such key.
+    bool Update(const Key& key, const V& value);
+
     // key - Input parameter. Key to find.
     // Return parameter is std::optional with found value or without it.
     std::optional<V> Get(const Key& key) const;
 
-    // key - Input parameter. Key to delete.
+    // Find values of many keys with one traversal of the tree. Keys are sorted, so nodes which
+    // are common for them are searched once. Keys may repeat.
+    // keys - Input parameter. Keys to find.
+    // Return parameter is values in order of keys, empty for absent keys.
+    std::vector<std::optional<V>> MultiGet(const std::vector<Key>& keys) const;
+
+    // key - Input parameter. Key to delete. Throws if there is no such key.
     void Delete(const Key& key);
 
+    // key - Input parameter. Key to delete.
+    // Return parameter is false if there is no such key. Throws on other errors.
+    bool TryDelete(const Key& key);
+
+    // Apply puts and deletes of the batch. Every affected leaf is found once, leaves are split
+    // and rebalanced like by single operations. Deletes of absent keys are ignored. Throws on error.
+    // batch - Input parameter. Operations to apply.
+    void Write(const WriteBatch<V>& batch);
+
     // Special method for get subtree by index number.
     std::shared_ptr<BPNode<V, BranchFactor>> GetCustomNode(FileIndex idx) const;
 
-    // Create enumerator through all leaves. Automatically locks tree mutex in shared mode and 
+    // Create enumerator through all leaves. Automatically locks tree mutex in scan mode and
     // unlocks in destructor of VolumeEnumerator.
     // Complexity is O(N).
     std::unique_ptr<VolumeEnumerator<V, BranchFactor>> Enumerate() const;
 
+    // Create enumerator through keys in range [lo, hi). Locks volume like Enumerate().
+    // lo - Input parameter. First key of the range.
+    // hi - Optional input parameter. Key after the range. Range is not bounded if it is empty.
+    // limit - Optional input parameter. Enumerator stops after this count of pairs.
+    // Complexity is O(log N + k) where k is count of enumerated pairs.
+    std::unique_ptr<VolumeEnumerator<V, BranchFactor>> Scan(Key lo, std::optional<Key> hi = std::nullopt, size_t limit = std::numeric_limits<size_t>::max()) const;
+
+    // Count, sum, minimum and maximum of values of keys in range [lo, hi). Values of every leaf
+    // are processed as one array without copying. Values must be numeric. Blocks all writers
+    // like enumerators.
+    // lo - Input parameter. First key of the range.
+    // hi - Optional input parameter. Key after the range. Range is not bounded if it is empty.
+    // Complexity is O(log N + k) where k is count of keys in the range.
+    Aggregates<V> Aggregate(Key lo, std::optional<Key> hi = std::nullopt) const;
+
+    // Write all changed nodes to disk and clear the log. Blocks all writers. Throws on error.
+    void Checkpoint();
+
+    // Build the tree from key-value pairs sorted by key. Leaves and nodes are written
+    // bottom-up one after another and packed to fillFactor of their capacity, so loading
+    // needs one write per node and no splits. Volume must be empty. Blocks all writers.
+    // Batches of interrupted loading stay in the directory unused. Throws on error.
+    // first, last  - Input parameters. Range of pairs with fields 'first' (key) and 'second' (value).
+    // fillFactor   - Input parameter. Part of node capacity to fill, from 0.5 to 1.0.
+    template<class InputIt>
+    void BulkLoad(InputIt first, InputIt last, double fillFactor = 1.0);
+
+    // Count of keys in volume including outdated keys with inline TTL which are not removed yet. Complexity is O(1).
+    uint64_t GetKeyCount() const;
+
+    // Count of tree levels, 1 if root is leaf. Complexity is O(1).
+    uint32_t GetHeight() const;
+
+    // Counts of system calls made to read and write nodes since volume was opened.
+    IoStats GetIoStats() const;
+
+    // lowWatermark - Input parameter. Writeback stops when count of dirty nodes drops to this value.
+    // highWatermark - Input parameter. Writeback starts when count of dirty nodes reaches this value.
+    // With write-ahead log writeback makes checkpoint instead. Default values are a quarter and a half
+    // of cache size. Dirty nodes are not evicted, so cache may grow over its size up to highWatermark.
+    void SetDirtyWatermarks(size_t lowWatermark, size_t highWatermark);
+
+    // maxLeaves - Input parameter. Max count of leaves which enumerators load in background ahead of
+    // the current one. Enumerator starts with one leaf and grows the window when it has to wait for
+    // the next leaf. 0 disables read-ahead. Affects enumerators created after the call.
+    void SetReadAhead(size_t maxLeaves);
+
     // Start auto delete thread.
     void Start();
 
     // Stop thread and flush all changes on disk. Throws on error.
     void StopAndFlush();
 
+    // Stop threads and drop changes which are not on disk yet, like after crash of the process.
+    // Volume can only be destroyed after that. Used by tests of recovery.
+    void Abandon();
+
     ~Volume();
 
+private:
+    std::shared_ptr<BPNode<V, BranchFactor>> GetRoot() const;
+    void SetRoot(std::shared_ptr<BPNode<V, BranchFactor>> root);
+
+    // Lock the latch of the current root node. Root may be replaced while we are waiting
+    // for its latch, so root is checked again after locking and search is repeated if needed.
+    template<class Lock>
+    std::shared_ptr<BPNode<V, BranchFactor>> LockRoot(Lock& lock) const;
+
+    // Optimistic descent for writers: shared latches on the path and exclusive latch on the leaf only.
+    // upperBound - Optional output parameter. Key after the range of the leaf, empty for the last leaf.
+    std::shared_ptr<Leaf<V, BranchFactor>> LockLeafForWrite(const Key& key, boost::unique_lock<NodeLatch>& leafLock, std::optional<Key>* upperBound = nullptr) const;
+
+    // Wait until the log record is written, wake up writeback if there are too many dirty nodes
+    // and make checkpoint if log is too big. Unlocks volume.
+    void CommitWrite(uint64_t logPosition, boost::shared_lock<VolumeMutex>& volumeLock);
+
+    // Throws if the log failed. Changes made after that can't be recovered, so the volume
+    // rejects them until it is reopened.
+    void CheckWritable() const;
+
+    // Mark cached nodes clean, so they are dropped without flush. Caller must stop other threads.
+    void DiscardDirty();
+
+    // Caller must hold volume mutex in exclusive mode.
+    void MakeCheckpoint();
+
+    // expiry - Input parameter. Deletion time of key in leaf or 0.
+    // keyTtl - Input parameter. TTL for keys deleter.
+    // replace - Input parameter. New value of existing key from its current value, it is called under
+    //           the leaf latch. Put throws on existing key if it is empty.
+    // keepTtl - Input parameter. Replaced key keeps its TTL instead of 'expiry' and 'keyTtl'.
+    void PutWithExpiry(const Key& key, const V& value, uint64_t expiry, std::optional<uint32_t> keyTtl,
+        const std::function<V(const V&)>& replace = nullptr, bool keepTtl = false);
+
+    // Replace value of existing key in the leaf. Caller must hold exclusive latch of the leaf.
+    // Returns false if there is no such key. See PutWithExpiry() for parameters.
+    bool ReplaceInLeaf(Leaf<V, BranchFactor>& leaf, const Key& key, uint64_t expiry, const std::function<V(const V&)>& replace, bool keepTtl,
+        uint64_t now, uint64_t& logPosition);
+
+    // Set TTL of replaced key in keys deleter, TTL is cleared if it is empty.
+    void ReplaceTtl(const Key& key, std::optional<uint32_t> keyTtl);
+
+    // Delete outdated keys with one descent per leaf. Leaf is rebalanced only when the next key
+    // can't be deleted without it. Absent keys are skipped.
+    // Returns keys which are not deleted because of error, they should be deleted again later.
+    std::vector<Key> DeleteOutdated(std::vector<Key> keys);
+
+    void StartWriteback();
+    void StopWriteback();
+    void WritebackLoop();
+
+    // Write dirty nodes until their count drops to the low watermark.
+    void WriteBack();
+
+    // Count keys and levels of the tree by scan of leaves.
+    void CountKeys();
+
+    // exact - Input parameter. True if statistics match the tree on disk.
+    void WriteSuperblock(bool exact) const;
+
 private:
     std::unique_ptr<OutdatedKeysDeleter<V, BranchFactor>> m_deleter;
     std::shared_ptr<BPNode<V, BranchFactor>> m_root;
     const fs::path m_dir;
     mutable std::shared_ptr<BPCache<V, BranchFactor>> m_cache;
+    std::shared_ptr<NodeStorage> m_storage;
     IndexManager m_indexManager;
-    mutable boost::shared_mutex m_mutex;
+    std::unique_ptr<WriteAheadLog<V>> m_wal;
+
+    // Writers hold it in shared mode and enumerators in scan mode, so they exclude each other
+    // but not themselves. Checkpoint and bulk load hold it in exclusive mode.
+    mutable VolumeMutex m_mutex;
+
+    // Protects m_root pointer itself. Tree nodes are protected by their own latches.
+    mutable boost::shared_mutex m_rootMutex;
+
+    // Address of m_root which optimistic readers compare with the root they hold, so they check
+    // that the root is not replaced without the lock. It is never dereferenced.
+    std::atomic<const BPNode<V, BranchFactor>*> m_rootPtr{ nullptr };
+
+    std::thread m_writeback;
+    boost::mutex m_writebackMutex;
+    std::condition_variable_any m_writebackCondition;
+    std::atomic<bool> m_stopWriteback{ false };
+    std::atomic<size_t> m_lowWatermark{ 0 };
+    std::atomic<size_t> m_highWatermark{ 0 };
+    std::atomic<size_t> m_readAhead{ DefaultReadAheadLeaves };
+
+    std::atomic<uint64_t> m_keyCount{ 0 };
+    std::atomic<uint32_t> m_height{ 1 };
+
+    TtlMode m_ttlMode;
 };
 
 //-------------------------------------------------------------------------------
 //                            VolumeEnumerator
 //-------------------------------------------------------------------------------
-// Object to enumerate key value pairs. It holds shared lock of volume, so delete
-// and write operations will be blocked until VolumeEnumerator is exists.
+// Object to enumerate key value pairs. It holds scan lock of volume, so delete
+// and write operations will be blocked until VolumeEnumerator is exists. Other
+// enumerators and Aggregate() are not blocked, but new scans of other threads
+// wait for writers which wait for the lock (see VolumeMutex).
 // After creation enumerator points to unexisted pair, so to get first key-value
 // client should call MoveNext() before.
+//
+// When enumeration moves to the second leaf, enumerator starts a thread which loads
+// the next leaves along the chain into the cache while the client works with the
+// current one. Loaded leaves are pinned until they are reached, so cache doesn't
+// evict them. The window of loaded leaves doubles every time the client has to wait
+// for the next leaf and shrinks by one when the thread is ahead, up to the maximum
+// set by Volume::SetReadAhead().
+//
+// Leaves which are not in cache yet are inserted with cold priority, so enumeration
+// of a big volume evicts only the leaves it has passed and doesn't push out nodes
+// used by point operations.
 //-------------------------------------------------------------------------------
 template <class V, size_t BranchFactor>
 class VolumeEnumerator
 {
 public:
-    // directory  - Input parameter. Volume directory.
-    // cache      - Input parameter. Batches cache.
-    // firstBatch - Input parameter. First leaf with values.
-    // lock       - Input rvalue parameter. Shared lock that already holds volume mutex.
-    VolumeEnumerator(const fs::path& directory, std::weak_ptr<BPCache<V, BranchFactor>> cache, std::shared_ptr<BPNode<V, BranchFactor>> firstBatch, boost::shared_lock<boost::shared_mutex>&& lock);
+    // View of consecutive key value pairs of one leaf which is returned by NextBatch().
+    // Nothing is copied: leaf is pinned by the batch, and the view is valid until the next
+    // call of MoveNext(), NextBatch() or Seek() of the enumerator.
+    class Batch
+    {
+    public:
+        size_t GetSize() const { return m_size; }
+
+        // Contiguous array of GetSize() keys.
+        const Key* GetKeys() const { return m_leaf->m_keys.data() + m_first; }
+
+        const V& GetValue(size_t i) const { return m_leaf->m_values[m_first + i]; }
+
+        // Contiguous array of GetSize() values. String and blob values are stored in
+        // slots of leaf, so they are accessed only by GetValue().
+        const V* GetValues() const { return m_leaf->m_values.data() + m_first; }
+
+    private:
+        friend class VolumeEnumerator;
+
+        std::shared_ptr<Leaf<V, BranchFactor>> m_leaf;
+        uint32_t m_first{ 0 };
+        size_t m_size{ 0 };
+    };
+
+    // storage - Input parameter. Storage of volume batches.
+    // cache   - Input parameter. Batches cache.
+    // root    - Input parameter. Root of the tree.
+    // lock    - Input rvalue parameter. Scan lock that already holds volume mutex.
+    // lo      - Input parameter. First key of the range.
+    // hi      - Input parameter. Key after the range. Range is not bounded if it is empty.
+    // limit   - Input parameter. Max count of enumerated pairs.
+    // readAhead - Input parameter. Max count of leaves loaded ahead, 0 disables read-ahead.
+    VolumeEnumerator(std::shared_ptr<NodeStorage> storage, std::weak_ptr<BPCache<V, BranchFactor>> cache, std::shared_ptr<BPNode<V, BranchFactor>> root, ScanLock&& lock,
+        Key lo, std::optional<Key> hi, size_t limit, size_t readAhead = 0);
 
     // MoveNext moves pointer to the next key value pair. If it exists return true, false otherwise.
     bool MoveNext();
@@ -127,25 +482,210 @@ public:
     // Return current key value pair.
     std::pair<Key, V> GetCurrent() const;
 
-    ~VolumeEnumerator() = default;
+    // Move pointer over the pairs following the current one up to the end of the leaf, the upper bound
+    // of the range, the limit or a key with outdated inline TTL, and return them in 'batch'.
+    // After the call the last pair of the batch is current. If there are no more pairs return false.
+    // batch - Output parameter. View of the pairs.
+    bool NextBatch(Batch& batch);
+
+    // Move pointer before the first pair with key not less than 'key', so MoveNext() moves to it.
+    // Upper bound of the range and count of already enumerated pairs are kept.
+    void Seek(Key key);
+
+    ~VolumeEnumerator();
+
+private:
+    // Leaf with the index which follows the current one. It is taken from read-ahead if possible.
+    std::shared_ptr<Leaf<V, BranchFactor>> LoadNextLeaf(FileIndex idx);
+
+    // Drop loaded leaves, so read-ahead continues from the leaf which is needed next.
+    void ResetReadAhead();
+
+    void ReadAheadLoop();
 
 private:
     std::shared_ptr<Leaf<V, BranchFactor>> m_currentBatch;
     int32_t m_counter{ -1 };
-    const fs::path m_dir;
+    std::shared_ptr<NodeStorage> m_storage;
     std::weak_ptr<BPCache<V, BranchFactor>> m_cache;
+    std::shared_ptr<BPNode<V, BranchFactor>> m_root;
+    std::optional<Key> m_hi;
+    size_t m_remaining;
     bool m_isValid{ true };
-    boost::shared_lock<boost::shared_mutex> m_lock;
+
+    // Keys with inline TTL which are outdated at this time are skipped.
+    const uint64_t m_now{ CurrentUnixTime() };
+
+    const size_t m_maxReadAhead;
+    std::thread m_readAhead;
+    boost::mutex m_readAheadMutex;
+    std::condition_variable_any m_readAheadCondition;
+    bool m_stopReadAhead{ false };
+    size_t m_readAheadWindow{ 1 };
+
+    // Loaded leaves in order of the chain and the leaf which the thread loads after them, 0 if
+    // there is none. Generation changes on reset, so the thread drops a leaf it was loading.
+    std::deque<std::shared_ptr<Leaf<V, BranchFactor>>> m_readAheadLeaves;
+    FileIndex m_readAheadNext{ 0 };
+    uint64_t m_readAheadGeneration{ 0 };
+
+    // Destroyed after the thread is stopped.
+    ScanLock m_lock;
 };
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
-VolumeEnumerator<V, BranchFactor>::VolumeEnumerator(const fs::path& directory, std::weak_ptr<BPCache<V, BranchFactor>> cache, std::shared_ptr<BPNode<V, BranchFactor>> firstBatch, boost::shared_lock<boost::shared_mutex>&& lock)
-    : m_dir(directory)
+VolumeEnumerator<V, BranchFactor>::VolumeEnumerator(std::shared_ptr<NodeStorage> storage, std::weak_ptr<BPCache<V, BranchFactor>> cache, std::shared_ptr<BPNode<V, BranchFactor>> root, ScanLock&& lock,
+    Key lo, std::optional<Key> hi, size_t limit, size_t readAhead)
+    : m_storage(std::move(storage))
     , m_cache(cache)
-    , m_currentBatch(std::static_pointer_cast<Leaf<V, BranchFactor>>(firstBatch))
+    , m_root(std::move(root))
+    , m_hi(hi)
+    , m_remaining(limit)
+    , m_maxReadAhead(readAhead)
     , m_lock(std::move(lock))
 {
+    Seek(lo);
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+VolumeEnumerator<V, BranchFactor>::~VolumeEnumerator()
+{
+    if (!m_readAhead.joinable())
+        return;
+
+    {
+        boost::unique_lock<boost::mutex> lock(m_readAheadMutex);
+        m_stopReadAhead = true;
+    }
+    m_readAheadCondition.notify_all();
+    m_readAhead.join();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void VolumeEnumerator<V, BranchFactor>::Seek(Key key)
+{
+    m_currentBatch = std::static_pointer_cast<Leaf<V, BranchFactor>>(m_root->FindLeaf(key));
+    m_counter = static_cast<int32_t>(LowerBound(m_currentBatch->m_keys, m_currentBatch->GetKeyCount(), key)) - 1;
+    m_isValid = true;
+    ResetReadAhead();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void VolumeEnumerator<V, BranchFactor>::ResetReadAhead()
+{
+    if (!m_readAhead.joinable())
+        return;
+
+    boost::unique_lock<boost::mutex> lock(m_readAheadMutex);
+    m_readAheadLeaves.clear();
+    m_readAheadNext = 0;
+    m_readAheadGeneration++;
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+std::shared_ptr<Leaf<V, BranchFactor>> VolumeEnumerator<V, BranchFactor>::LoadNextLeaf(FileIndex idx)
+{
+    const auto load = [this, idx]()
+    {
+        return LoadScannedLeaf<V, BranchFactor>(m_storage, m_cache, idx);
+    };
+
+    if (m_maxReadAhead == 0)
+        return load();
+
+    // Enumeration within one leaf doesn't need the thread.
+    if (!m_readAhead.joinable())
+        m_readAhead = std::thread([this]() { ReadAheadLoop(); });
+
+    boost::unique_lock<boost::mutex> lock(m_readAheadMutex);
+
+    bool waited = false;
+    for (;;)
+    {
+        if (!m_readAheadLeaves.empty() && m_readAheadLeaves.front()->GetIndex() == idx)
+        {
+            if (waited)
+                m_readAheadWindow = std::min(m_readAheadWindow * 2, m_maxReadAhead);
+            else if (m_readAheadLeaves.size() >= m_readAheadWindow && m_readAheadWindow > 1)
+                m_readAheadWindow--;
+
+            auto leaf = std::move(m_readAheadLeaves.front());
+            m_readAheadLeaves.pop_front();
+            lock.unlock();
+            m_readAheadCondition.notify_all();
+            return leaf;
+        }
+
+        if (m_readAheadLeaves.empty() && m_readAheadNext == idx)
+        {
+            // Thread is loading the leaf right now.
+            waited = true;
+            m_readAheadCondition.wait(lock);
+            continue;
+        }
+
+        if (m_readAheadLeaves.empty() && m_readAheadNext == 0 && waited)
+        {
+            // Thread failed to load the leaf. Load it here, so the error is thrown to the client.
+            lock.unlock();
+            return load();
+        }
+
+        // Read-ahead was reset or it went another way. Start it from the needed leaf.
+        m_readAheadLeaves.clear();
+        m_readAheadNext = idx;
+        m_readAheadGeneration++;
+        m_readAheadCondition.notify_all();
+    }
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void VolumeEnumerator<V, BranchFactor>::ReadAheadLoop()
+{
+    boost::unique_lock<boost::mutex> lock(m_readAheadMutex);
+
+    for (;;)
+    {
+        m_readAheadCondition.wait(lock, [this]() { return m_stopReadAhead || (m_readAheadNext != 0 && m_readAheadLeaves.size() < m_readAheadWindow); });
+        if (m_stopReadAhead)
+            return;
+
+        const auto idx = m_readAheadNext;
+        const auto generation = m_readAheadGeneration;
+        lock.unlock();
+
+        // Writers are blocked by the volume lock of enumerator, so the chain of leaves doesn't change.
+        std::shared_ptr<Leaf<V, BranchFactor>> leaf;
+        try
+        {
+            leaf = LoadScannedLeaf<V, BranchFactor>(m_storage, m_cache, idx);
+        }
+        catch (const std::exception&)
+        {
+            // Enumerator loads the leaf itself and gets the error.
+        }
+
+        lock.lock();
+        if (generation != m_readAheadGeneration)
+            continue;
+
+        if (leaf)
+        {
+            m_readAheadLeaves.push_back(std::move(leaf));
+            m_readAheadNext = m_readAheadLeaves.back()->m_nextBatch;
+        }
+        else
+        {
+            m_readAheadNext = 0;
+        }
+        m_readAheadCondition.notify_all();
+    }
 }
 
 //-------------------------------------------------------------------------------
@@ -155,25 +695,32 @@ bool VolumeEnumerator<V, BranchFactor>::MoveNext()
     if (!m_isValid)
         return false;
 
-    m_counter++;
-    if (m_counter == m_currentBatch->GetKeyCount())
+    do
     {
-        if (!m_currentBatch->m_nextBatch)
+        m_counter++;
+
+        // Seek may stop after the last key of a leaf, so the next leaf is checked in a loop.
+        while (m_counter >= static_cast<int32_t>(m_currentBatch->GetKeyCount()))
         {
-            m_isValid = false;
-            return false;
+            if (!m_currentBatch->m_nextBatch)
+            {
+                m_isValid = false;
+                return false;
+            }
+
+            m_currentBatch = LoadNextLeaf(m_currentBatch->m_nextBatch);
+            m_counter = 0;
         }
+    } while (m_currentBatch->IsOutdated(m_counter, m_now));
 
-        auto nextBatch = m_currentBatch->m_nextBatch;
-
-        m_currentBatch = std::static_pointer_cast<Leaf<V, BranchFactor>>(CreateBPNode<V>(m_dir, m_cache, nextBatch));
-        m_counter = 0;
-        return true;
-    }
-    else
+    if (m_remaining == 0 || (m_hi && m_currentBatch->m_keys[m_counter] >= *m_hi))
     {
-        return true;
+        m_isValid = false;
+        return false;
     }
+
+    m_remaining--;
+    return true;
 }
 
 //-------------------------------------------------------------------------------
@@ -183,25 +730,56 @@ std::pair<Key, V> VolumeEnumerator<V, BranchFactor>::GetCurrent() const
     return { m_currentBatch->m_keys[m_counter], m_currentBatch->m_values[m_counter] };
 }
 
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+bool VolumeEnumerator<V, BranchFactor>::NextBatch(Batch& batch)
+{
+    // MoveNext positions the enumerator at the first pair, so leaf switching, skipping of
+    // outdated keys and checks of bounds are kept in one place.
+    if (!MoveNext())
+        return false;
+
+    const auto& leaf = *m_currentBatch;
+    const auto first = m_counter;
+    auto end = static_cast<int32_t>(leaf.GetKeyCount());
+    if (m_hi)
+        end = static_cast<int32_t>(LowerBound(leaf.m_keys, leaf.GetKeyCount(), *m_hi));
+    if (m_remaining < static_cast<size_t>(end - first - 1))
+        end = first + 1 + static_cast<int32_t>(m_remaining);
+
+    auto last = first + 1;
+    while (last < end && !leaf.IsOutdated(last, m_now))
+        last++;
+
+    m_remaining -= last - first - 1;
+    m_counter = last - 1;
+
+    batch.m_leaf = m_currentBatch;
+    batch.m_first = static_cast<uint32_t>(first);
+    batch.m_size = static_cast<size_t>(last - first);
+    return true;
+}
+
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
 Volume<V, BranchFactor>::Volume(Volume<V, BranchFactor>&& other)
-    : m_deleter(std::move(other.m_deleter))
+    : m_deleter((other.StopWriteback(), std::move(other.m_deleter)))
     , m_root(std::move(other.m_root))
     , m_dir(std::move(other.m_dir))
     , m_cache(std::move(other.m_cache))
-    , m_indexManager(m_dir)
-{}
-
-//-------------------------------------------------------------------------------
-template<class V, size_t BranchFactor>
-Volume<V, BranchFactor>& Volume<V, BranchFactor>::operator= (Volume<V, BranchFactor>&& other)
+    , m_storage(std::move(other.m_storage))
+    , m_indexManager(std::move(other.m_indexManager))
+    , m_wal(std::move(other.m_wal))
+    , m_rootPtr(m_root.get())
+    , m_lowWatermark(other.m_lowWatermark.load())
+    , m_highWatermark(other.m_highWatermark.load())
+    , m_readAhead(other.m_readAhead.load())
+    , m_keyCount(other.m_keyCount.load())
+    , m_height(other.m_height.load())
+    , m_ttlMode(other.m_ttlMode)
 {
-    m_deleter = std::move(m_deleter);
-    m_root = std::move(other.m_root);
-    m_dir = std::move(other.m_dir);
-    m_cache = std::move(other.m_cache);
-    m_indexManager = IndexManager(m_dir);
+    if (m_cache)
+        StartWriteback();
 }
 
 //-------------------------------------------------------------------------------
@@ -213,12 +791,57 @@ void Volume<V, BranchFactor>::StopAndFlush()
         m_deleter->Stop();
         m_deleter->Flush();
     }
-    
-    if (m_root)
-        m_root->Flush();
+
+    StopWriteback();
+
+    if (m_cache)
+    {
+        if (m_wal && m_wal->IsFailed())
+        {
+            // Changes which may be absent in the log are dropped, the volume is recovered from the log on reopen.
+            DiscardDirty();
+        }
+        else
+        {
+            Checkpoint();
+            if (!m_wal)
+                WriteSuperblock(true);
+        }
+        m_cache->clear();
+    }
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::Abandon()
+{
+    if (m_deleter)
+    {
+        m_deleter->Abandon();
+        m_deleter.reset();
+    }
+
+    StopWriteback();
 
     if (m_cache)
+    {
+        DiscardDirty();
         m_cache->clear();
+    }
+
+    // Moved-from state, destructor has nothing to flush.
+    m_root.reset();
+    m_rootPtr = nullptr;
+    m_cache.reset();
+    m_wal.reset();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::DiscardDirty()
+{
+    m_cache->for_each([](const FileIndex&, std::shared_ptr<BPNode<V, BranchFactor>>& node) { node->MarkAsDeleted(); });
+    m_root->MarkAsDeleted();
 }
 
 //-------------------------------------------------------------------------------
@@ -247,58 +870,197 @@ template<class V, size_t BranchFactor>
 std::shared_ptr<BPNode<V, BranchFactor>> Volume<V, BranchFactor>::GetCustomNode(FileIndex idx) const
 {
     if (idx == 1)
-        return m_root;
+        return GetRoot();
     
-    return CreateBPNode(m_dir, std::weak_ptr<BPCache<V, BranchFactor>>(m_cache), idx);
+    return CreateBPNode(m_storage, std::weak_ptr<BPCache<V, BranchFactor>>(m_cache), idx);
 }
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
 void Volume<V, BranchFactor>::Put(const Key& key, const V& value, std::optional<uint32_t> keyTtl /*= std::nullopt*/)
 {
-    std::vector<boost::upgrade_lock<boost::shared_mutex>> locks;
+    if (keyTtl && m_ttlMode == TtlMode::Inline)
+        PutWithExpiry(key, value, CurrentUnixTime() + *keyTtl, std::nullopt);
+    else
+        PutWithExpiry(key, value, 0, keyTtl);
+}
 
-    locks.emplace_back(m_mutex);
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::Upsert(const Key& key, const V& value, std::optional<uint32_t> keyTtl /*= std::nullopt*/)
+{
+    const auto replace = [&value](const V&) { return value; };
 
-    auto current = m_root;
+    if (keyTtl && m_ttlMode == TtlMode::Inline)
+        PutWithExpiry(key, value, CurrentUnixTime() + *keyTtl, std::nullopt, replace);
+    else
+        PutWithExpiry(key, value, 0, keyTtl, replace);
+}
 
-    constexpr auto MaxKeys = BranchFactor - 1;
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+V Volume<V, BranchFactor>::Merge(const Key& key, const V& operand, MergeOperator op)
+{
+    static_assert(std::is_arithmetic_v<V>, "Built-in merge operators need numeric values");
 
-    std::vector<std::shared_ptr<Node<V, BranchFactor>>> nodes;
+    return Merge(key, operand, [op](const V& current, const V& operand)
+    {
+        switch (op)
+        {
+        case MergeOperator::Add:
+            return static_cast<V>(current + operand);
+        case MergeOperator::Min:
+            return std::min(current, operand);
+        case MergeOperator::Max:
+            return std::max(current, operand);
+        }
 
-    locks.emplace_back(current->m_mutex);
+        throw std::runtime_error("Unknown merge operator");
+    });
+}
 
-    // Searching leaf for insert, lock nodes and save processed nodes
-    while (!current->IsLeaf())
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+template<class Op>
+V Volume<V, BranchFactor>::Merge(const Key& key, const V& operand, Op op)
+{
+    V result = operand;
+    PutWithExpiry(key, operand, 0, std::nullopt, [&](const V& current)
     {
-        auto currentNode = std::static_pointer_cast<Node<V, BranchFactor>>(current);
-        nodes.push_back(currentNode);
+        result = op(current, operand);
+        return result;
+    }, true);
 
-        auto child = currentNode->GetChildByKey(key);
+    return result;
+}
 
-        boost::upgrade_lock<boost::shared_mutex> lock(child->m_mutex);
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+bool Volume<V, BranchFactor>::Update(const Key& key, const V& value)
+{
+    boost::shared_lock<VolumeMutex> volumeLock(m_mutex);
+    CheckWritable();
 
-        current = child;
+    uint64_t logPosition = 0;
+    {
+        boost::unique_lock<NodeLatch> leafLock;
+        auto leaf = LockLeafForWrite(key, leafLock);
 
-        if (current->GetKeyCount() < MaxKeys)
-        {
-            // Current node is safe - we can release the ancestor nodes
-            locks.clear();
-        }
+        const auto now = CurrentUnixTime();
+        m_keyCount -= leaf->RemoveOutdated(now);
 
-        locks.push_back(std::move(lock));
-    }
+        const auto expiry = leaf->Update(key, value, std::nullopt, now);
+        if (!expiry)
+            return false;
 
-    // Upgrading locks to unique mode
-    std::vector<boost::upgrade_to_unique_lock<boost::shared_mutex>> exclusiveLocks;
-    for (auto& l : locks)
-    {
-        exclusiveLocks.emplace_back(l);
+        if (m_wal)
+            logPosition = m_wal->AppendPut(key, value, *expiry);
     }
 
-    // Put to the leaf
-    auto leaf = std::static_pointer_cast<Leaf<V, BranchFactor>>(current);
-    std::optional<CreatedBPNode<V, BranchFactor>> newNode = leaf->Put(key, value, m_indexManager);
+    CommitWrite(logPosition, volumeLock);
+    return true;
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::PutWithExpiry(const Key& key, const V& value, uint64_t expiry, std::optional<uint32_t> keyTtl,
+    const std::function<V(const V&)>& replace, bool keepTtl)
+{
+    constexpr auto MaxKeys = BranchFactor - 1;
+
+    boost::shared_lock<VolumeMutex> volumeLock(m_mutex);
+    CheckWritable();
+
+    // Outdated keys of the leaf are removed on the way, the put key too if it is outdated.
+    const auto now = CurrentUnixTime();
+
+    // Record is appended under the leaf latch, so records of the same key have the same order as changes.
+    uint64_t logPosition = 0;
+
+    {
+        // Most of inserts don't split the leaf. Try to put with exclusive latch on the leaf only.
+        boost::unique_lock<NodeLatch> leafLock;
+        auto leaf = LockLeafForWrite(key, leafLock);
+        m_keyCount -= leaf->RemoveOutdated(now, key);
+
+        if (replace && ReplaceInLeaf(*leaf, key, expiry, replace, keepTtl, now, logPosition))
+        {
+            leafLock.unlock();
+
+            if (!keepTtl)
+                ReplaceTtl(key, keyTtl);
+
+            CommitWrite(logPosition, volumeLock);
+            return;
+        }
+
+        if (leaf->GetKeyCount() < MaxKeys)
+        {
+            leaf->Put(key, value, m_indexManager, expiry);
+            m_keyCount++;
+            if (m_wal)
+                logPosition = m_wal->AppendPut(key, value, expiry);
+            leafLock.unlock();
+
+            if (keyTtl && m_deleter)
+                m_deleter->Put(key, keyTtl.value());
+
+            CommitWrite(logPosition, volumeLock);
+            return;
+        }
+    }
+
+    // Leaf is full. Repeat search with exclusive lock coupling from the root. Locks are taken
+    // only top-down and never upgraded, so this can't deadlock with optimistic writers.
+    std::vector<boost::unique_lock<NodeLatch>> locks;
+
+    locks.emplace_back();
+    const auto root = LockRoot(locks.back());
+    auto current = root;
+
+    std::vector<std::shared_ptr<Node<V, BranchFactor>>> nodes;
+
+    // Searching leaf for insert, lock nodes and save processed nodes
+    while (!current->IsLeaf())
+    {
+        auto currentNode = std::static_pointer_cast<Node<V, BranchFactor>>(current);
+        nodes.push_back(currentNode);
+
+        auto child = currentNode->GetChildByKey(key);
+
+        boost::unique_lock<NodeLatch> lock(child->m_mutex);
+
+        current = child;
+
+        if (current->GetKeyCount() < MaxKeys)
+        {
+            // Current node is safe - we can release the ancestor nodes
+            locks.clear();
+        }
+
+        locks.push_back(std::move(lock));
+    }
+
+    // Put to the leaf
+    auto leaf = std::static_pointer_cast<Leaf<V, BranchFactor>>(current);
+    m_keyCount -= leaf->RemoveOutdated(now, key);
+
+    // Key may be put by another writer after the first search.
+    if (replace && ReplaceInLeaf(*leaf, key, expiry, replace, keepTtl, now, logPosition))
+    {
+        locks.clear();
+
+        if (!keepTtl)
+            ReplaceTtl(key, keyTtl);
+
+        CommitWrite(logPosition, volumeLock);
+        return;
+    }
+
+    std::optional<CreatedBPNode<V, BranchFactor>> newNode = leaf->Put(key, value, m_indexManager, expiry);
+    m_keyCount++;
+    if (m_wal)
+        logPosition = m_wal->AppendPut(key, value, expiry);
 
     // If child node has been splitted than we should link a new node to parent. Repeat while nodes is splitting
     auto nodesIt = nodes.rbegin();
@@ -310,15 +1072,12 @@ void Volume<V, BranchFactor>::Put(const Key& key, const V& value, std::optional<
 
     if (!newNode)
     {
-        while (!exclusiveLocks.empty())
-        {
-            exclusiveLocks.pop_back();
-        }
         locks.clear();
 
         if (keyTtl && m_deleter)
             m_deleter->Put(key, keyTtl.value());
 
+        CommitWrite(logPosition, volumeLock);
         return;
     }
 
@@ -329,67 +1088,128 @@ void Volume<V, BranchFactor>::Put(const Key& key, const V& value, std::optional<
     ptrs.fill(0);
 
     keys[0] = newNode.value().key;
-    ptrs[0] = m_root->GetIndex();
+    ptrs[0] = root->GetIndex();
     ptrs[1] = newNode.value().node->GetIndex();
 
-    m_cache->insert(m_root->GetIndex(), m_root);
+    m_cache->insert(root->GetIndex(), root);
 
-    m_root = std::make_unique<Node<V, BranchFactor>>(m_dir, m_cache, 1, 1, std::move(keys), std::move(ptrs));
-    m_cache->insert(1, m_root);
+    auto newRoot = std::make_shared<Node<V, BranchFactor>>(m_storage, m_cache, 1, 1, std::move(keys), std::move(ptrs));
+    m_cache->insert(1, newRoot);
+    SetRoot(std::move(newRoot));
+    m_height++;
 
-    while (!exclusiveLocks.empty())
-    {
-        exclusiveLocks.pop_back();
-    }
     locks.clear();
 
     if (keyTtl && m_deleter)
         m_deleter->Put(key, keyTtl.value());
+
+    CommitWrite(logPosition, volumeLock);
 }
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
 std::optional<V> Volume<V, BranchFactor>::Get(const Key& key) const
 {
-    auto current = m_root;
-    auto firstLock = std::make_unique<boost::shared_lock<boost::shared_mutex>>(current->m_mutex);
-    std::unique_ptr<boost::shared_lock<boost::shared_mutex>> secondLock;
-
-    while (true)
+    for (uint32_t i = 0; i < OptimisticReadAttempts; i++)
     {
-        if (!current->IsLeaf())
+        // Reference keeps the root alive if it is replaced meanwhile.
+        const auto root = GetRoot();
+        const auto version = root->m_mutex.ReadVersion();
+
+        // Root is replaced under its exclusive latch, so if root is still the same after reading
+        // the version than this version belongs to the actual root.
+        if (!version || root.get() != m_rootPtr.load(std::memory_order_acquire))
         {
-            auto currentNode = std::static_pointer_cast<Node<V, BranchFactor>>(current);
+            std::this_thread::yield();
+            continue;
+        }
 
-            auto child = currentNode->GetChildByKey(key);
+        std::optional<V> value;
+        if (TryOptimisticGet<V, BranchFactor>(root.get(), *version, *m_cache, key, value))
+            return value;
+    }
 
-            secondLock = std::make_unique<boost::shared_lock<boost::shared_mutex>>(child->m_mutex);
-            firstLock = std::move(secondLock);
+    // Too many conflicts with writers. Fall back to shared lock coupling.
+    boost::shared_lock<NodeLatch> lock;
+    const auto root = LockRoot(lock);
+    return LockedGet<V, BranchFactor>(root.get(), std::move(lock), key);
+}
 
-            current = child;
-        }
-        else
-        {
-            break;
-        }
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+std::vector<std::optional<V>> Volume<V, BranchFactor>::MultiGet(const std::vector<Key>& keys) const
+{
+    std::vector<std::pair<Key, size_t>> sortedKeys;
+    sortedKeys.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        sortedKeys.emplace_back(keys[i], i);
     }
 
-    return current->Get(key);
+    std::sort(sortedKeys.begin(), sortedKeys.end());
+
+    std::vector<std::optional<V>> values(keys.size());
+    if (sortedKeys.empty())
+        return values;
+
+    boost::shared_lock<NodeLatch> lock;
+    const auto root = LockRoot(lock);
+    LockedMultiGet<V, BranchFactor>(root.get(), sortedKeys.data(), sortedKeys.data() + sortedKeys.size(), values);
+    return values;
 }
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
 void Volume<V, BranchFactor>::Delete(const Key& key)
 {
-    std::vector<boost::upgrade_lock<boost::shared_mutex>> locks;
+    if (!TryDelete(key))
+        throw std::runtime_error("Failed to remove unexisted value of key '" + std::to_string(key) + "'");
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+bool Volume<V, BranchFactor>::TryDelete(const Key& key)
+{
+    boost::shared_lock<VolumeMutex> volumeLock(m_mutex);
+    CheckWritable();
 
-    locks.emplace_back(m_mutex);
+    uint64_t logPosition = 0;
 
-    auto current = m_root;
+    {
+        // Most of deletes don't rebalance the leaf. Try to delete with exclusive latch on the leaf only.
+        boost::unique_lock<NodeLatch> leafLock;
+        auto leaf = LockLeafForWrite(key, leafLock);
+        m_keyCount -= leaf->RemoveOutdated(CurrentUnixTime());
+
+        if (!leaf->Contains(key))
+            return false;
+
+        if (leaf->GetIndex() == 1 || leaf->GetKeyCount() > Half(BranchFactor))
+        {
+            leaf->Delete(key, std::nullopt, std::nullopt, m_indexManager);
+            m_keyCount--;
+            if (m_wal)
+                logPosition = m_wal->AppendDelete(key);
+            leafLock.unlock();
+
+            if (m_deleter)
+                m_deleter->Delete(key);
+
+            CommitWrite(logPosition, volumeLock);
+            return true;
+        }
+    }
+
+    // Leaf may be merged or borrow from siblings. Repeat search with lock coupling from the root.
+    std::vector<boost::unique_lock<NodeLatch>> locks;
+
+    locks.emplace_back();
+    const auto root = LockRoot(locks.back());
+    auto current = root;
 
     std::vector<std::tuple<std::shared_ptr<Node<V, BranchFactor>>, std::optional<Sibling>, std::optional<Sibling>, uint32_t>> nodes;
 
-    locks.emplace_back(current->m_mutex);
+    bool rootLocked = true;
 
     // Searching the leaf for deleting with locking mutexes and saving some metainformation like siblings and child position.
     while (!current->IsLeaf())
@@ -404,7 +1224,7 @@ void Volume<V, BranchFactor>::Delete(const Key& key)
 
         nodes.emplace_back(currentNode, left, right, childPos);
 
-        boost::upgrade_lock<boost::shared_mutex> lock(child->m_mutex);
+        boost::unique_lock<NodeLatch> lock(child->m_mutex);
 
         current = child;
 
@@ -412,18 +1232,12 @@ void Volume<V, BranchFactor>::Delete(const Key& key)
         {
             // Current node is safe - we can release the ancestor nodes
             locks.clear();
+            rootLocked = false;
         }
 
         locks.push_back(std::move(lock));
     }
 
-    // Upgrading locks to unique mode
-    std::vector<boost::upgrade_to_unique_lock<boost::shared_mutex>> exclusiveLocks;
-    for (auto& l : locks)
-    {
-        exclusiveLocks.emplace_back(l);
-    }
-
     auto leaf = std::static_pointer_cast<Leaf<V, BranchFactor>>(current);
 
     auto nodesIt = nodes.rbegin();
@@ -436,10 +1250,17 @@ void Volume<V, BranchFactor>::Delete(const Key& key)
         rightSibling = std::get<2>(nodes.back());
     }
 
+    // Key may be deleted by another thread after the first search.
+    if (!leaf->Contains(key))
+        return false;
+
     // Delete from the leaf and save delete result
     auto deleteResult = leaf->Delete(key, leftSibling, rightSibling, m_indexManager);
+    m_keyCount--;
+    if (m_wal)
+        logPosition = m_wal->AppendDelete(key);
 
-    auto counter = exclusiveLocks.size() - 1;
+    auto counter = locks.size() - 1;
 
     while (nodesIt != nodes.rend() && counter)
     {
@@ -470,65 +1291,920 @@ void Volume<V, BranchFactor>::Delete(const Key& key)
         counter--;
     }
 
-    if (!counter)
+    if (!rootLocked)
     {
-        while (!exclusiveLocks.empty())
-        {
-            exclusiveLocks.pop_back();
-        }
         locks.clear();
 
         if (m_deleter)
             m_deleter->Delete(key);
 
-        return;
+        CommitWrite(logPosition, volumeLock);
+        return true;
     }
 
     // Special case when height of tree is decreasing. We should replace root node.
     if (deleteResult.type == DeleteType::MergedRight || deleteResult.type == DeleteType::MergedLeft)
     {
-        m_root = std::move(deleteResult.node);
-        m_cache->insert(1, m_root);
+        root->MarkAsDeleted();
+        m_cache->insert(1, deleteResult.node);
+        SetRoot(std::move(deleteResult.node));
+        m_height--;
     }
 
-    while (!exclusiveLocks.empty())
-    {
-        exclusiveLocks.pop_back();
-    }
     locks.clear();
 
     if (m_deleter)
         m_deleter->Delete(key);
 
-    return;
+    CommitWrite(logPosition, volumeLock);
+    return true;
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::Write(const WriteBatch<V>& batch)
+{
+    using Operation = std::pair<Key, std::optional<V>>;
+
+    std::vector<const Operation*> operations;
+    operations.reserve(batch.m_operations.size());
+    for (const auto& operation : batch.m_operations)
+    {
+        operations.push_back(&operation);
+    }
+
+    std::stable_sort(operations.begin(), operations.end(), [](const Operation* lhs, const Operation* rhs) { return lhs->first < rhs->first; });
+
+    // Keep the last operation of every key. Unique operations are moved to the end.
+    const auto unique = std::unique(operations.rbegin(), operations.rend(), [](const Operation* lhs, const Operation* rhs) { return lhs->first == rhs->first; });
+
+    auto it = unique.base();
+    while (it != operations.end())
+    {
+        const auto first = it;
+
+        // Keys which had TTL or are deleted.
+        std::vector<Key> changedKeys;
+        {
+            boost::shared_lock<VolumeMutex> volumeLock(m_mutex);
+            CheckWritable();
+
+            uint64_t logPosition = 0;
+            {
+                boost::unique_lock<NodeLatch> leafLock;
+                std::optional<Key> upperBound;
+                auto leaf = LockLeafForWrite((*it)->first, leafLock, &upperBound);
+                m_keyCount -= leaf->RemoveOutdated(CurrentUnixTime());
+
+                // The first key is routed to the leaf, the next ones belong to it while they are below the bound.
+                for (; it != operations.end() && (it == first || !upperBound || (*it)->first < *upperBound); ++it)
+                {
+                    const auto& [key, value] = **it;
+
+                    bool found = false;
+                    if (!leaf->TryApply(key, value, found))
+                        break;
+
+                    if (value)
+                    {
+                        m_keyCount += found ? 0 : 1;
+                        if (m_wal)
+                            logPosition = m_wal->AppendPut(key, *value);
+                    }
+                    else if (found)
+                    {
+                        m_keyCount--;
+                        if (m_wal)
+                            logPosition = m_wal->AppendDelete(key);
+                    }
+
+                    if (found)
+                        changedKeys.push_back(key);
+                }
+            }
+
+            CommitWrite(logPosition, volumeLock);
+        }
+
+        if (m_deleter)
+        {
+            for (const auto key : changedKeys)
+            {
+                m_deleter->Delete(key);
+            }
+        }
+
+        // Leaf must be split or rebalanced for the first operation. Other threads may insert or
+        // delete the key meanwhile, so it is replaced if exists and deletion of absent key is ignored.
+        if (it == first)
+        {
+            const auto& [key, value] = **it;
+            if (value)
+            {
+                const V& newValue = *value;
+                PutWithExpiry(key, newValue, 0, std::nullopt, [&newValue](const V&) { return newValue; });
+            }
+            else
+            {
+                TryDelete(key);
+            }
+
+            ++it;
+        }
+    }
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+bool Volume<V, BranchFactor>::ReplaceInLeaf(Leaf<V, BranchFactor>& leaf, const Key& key, uint64_t expiry, const std::function<V(const V&)>& replace, bool keepTtl,
+    uint64_t now, uint64_t& logPosition)
+{
+    const V* current = leaf.Find(key, now);
+    if (!current)
+        return false;
+
+    const V value = replace(*current);
+    const auto newExpiry = leaf.Update(key, value, keepTtl ? std::nullopt : std::optional<uint64_t>(expiry), now);
+    if (m_wal)
+        logPosition = m_wal->AppendPut(key, value, *newExpiry);
+
+    return true;
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::ReplaceTtl(const Key& key, std::optional<uint32_t> keyTtl)
+{
+    if (!m_deleter)
+        return;
+
+    m_deleter->Delete(key);
+    if (keyTtl)
+        m_deleter->Put(key, keyTtl.value());
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+std::vector<Key> Volume<V, BranchFactor>::DeleteOutdated(std::vector<Key> keys)
+{
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    auto it = keys.cbegin();
+    auto first = it;
+    try
+    {
+        while (it != keys.cend())
+        {
+            first = it;
+            {
+                boost::shared_lock<VolumeMutex> volumeLock(m_mutex);
+                CheckWritable();
+
+                uint64_t logPosition = 0;
+                {
+                    boost::unique_lock<NodeLatch> leafLock;
+                    auto leaf = LockLeafForWrite(*it, leafLock);
+                    m_keyCount -= leaf->RemoveOutdated(CurrentUnixTime());
+
+                    const auto deleted = leaf->DeleteSorted(it, keys.cend());
+                    m_keyCount -= deleted.size();
+                    if (m_wal)
+                    {
+                        for (const auto key : deleted)
+                        {
+                            logPosition = m_wal->AppendDelete(key);
+                        }
+                    }
+                }
+
+                CommitWrite(logPosition, volumeLock);
+            }
+
+            // Leaf has too few keys for the first key. Delete it with rebalancing.
+            if (it == first)
+            {
+                // Absent key is skipped, other errors are caught below.
+                TryDelete(*it);
+                ++it;
+            }
+        }
+    }
+    catch (const std::exception&)
+    {
+        // Keys of the failed leaf may be deleted already, deletion of absent keys is skipped.
+        return std::vector<Key>(first, keys.cend());
+    }
+
+    return {};
 }
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
-Volume<V, BranchFactor>::Volume(const fs::path& directory, size_t cacheSize)
+Volume<V, BranchFactor>::Volume(const fs::path& directory, size_t cacheSize, CachePolicy cachePolicy, StorageFormat format, WalMode walMode, TtlMode ttlMode)
     : m_dir(directory)
-    , m_cache(std::make_shared<BPCache<V, BranchFactor>>(cacheSize
-        , [](std::shared_ptr<BPNode<V, BranchFactor>>& node) { node->Flush(); }))
-    , m_indexManager(m_dir)
+    , m_cache(CreateBPCache<V, BranchFactor>(cachePolicy, cacheSize
+        , [](std::shared_ptr<BPNode<V, BranchFactor>>& node)
+        {
+            // Node which is used by another thread can't be evicted, its changes would be lost.
+            if (node.use_count() > 1)
+                return false;
+
+            // Changed nodes stay in memory until writeback or checkpoint.
+            return !node->IsDirty();
+        }))
+    , m_storage(OpenNodeStorage(m_dir, format))
+    , m_indexManager(m_storage, walMode != WalMode::Disabled)
+    , m_lowWatermark(std::max<size_t>(cacheSize / 4, 1))
+    , m_highWatermark(std::max<size_t>(cacheSize / 2, 1))
+    , m_ttlMode(ttlMode)
 {
-    if (!fs::exists(m_dir / "batch_1.dat"))
+    const auto superblock = Superblock::Read(m_dir);
+    if (superblock && superblock->branchFactor != BranchFactor)
+        throw std::runtime_error("Volume has branch factor " + std::to_string(superblock->branchFactor) + ", expected " + std::to_string(BranchFactor));
+    if (superblock && superblock->valueType != ValueTypeCode<V>())
+        throw std::runtime_error("Volume has another value type");
+
+    std::unique_ptr<WriteAheadLog<V>> wal;
+    typename WriteAheadLog<V>::Contents log;
+
+    if (walMode != WalMode::Disabled)
+    {
+        wal = std::make_unique<WriteAheadLog<V>>(m_dir / WalFileName, walMode);
+        log = wal->Read();
+
+        // The last checkpoint may be interrupted while nodes were written in place.
+        for (const auto& node : log.nodes)
+        {
+            m_storage->Write(node.first, node.second);
+        }
+        for (auto idx : log.removed)
+        {
+            m_storage->Free(idx);
+        }
+    }
+
+    if (m_storage->IsEmpty())
     {
-        fs::create_directories(m_dir);
-        m_root = CreateEmptyBPNode(m_dir, std::weak_ptr<BPCache<V, BranchFactor>>(m_cache), 1);
+        m_root = CreateEmptyBPNode(m_storage, std::weak_ptr<BPCache<V, BranchFactor>>(m_cache), 1);
     }
     else
     {
-        m_root = CreateBPNode<V, BranchFactor>(m_dir, m_cache, 1);
+        m_root = CreateBPNode<V, BranchFactor>(m_storage, m_cache, 1);
     }
     m_cache->insert(1, m_root);
+    m_rootPtr = m_root.get();
+
+    // Checkpoint which was repeated above is newer than the superblock.
+    if (superblock && superblock->exact && log.nodes.empty() && log.removed.empty())
+    {
+        m_keyCount = superblock->keyCount;
+        m_height = superblock->height;
+    }
+    else if (m_root->IsLeaf())
+    {
+        m_keyCount = m_root->GetKeyCount();
+    }
+    else
+    {
+        CountKeys();
+    }
+
+    if (wal)
+    {
+        // Repeat operations after the last checkpoint. Log is not attached yet, so they are not logged again.
+        // Keys may be outdated since the crash and already removed from leaves, so deletes of absent keys
+        // are ignored. Put which is outdated already deletes the previous value of key.
+        const auto now = CurrentUnixTime();
+        for (const auto& record : log.records)
+        {
+            if (record.value && (record.expiry == 0 || record.expiry > now))
+            {
+                const auto& value = *record.value;
+                PutWithExpiry(record.key, value, record.expiry, std::nullopt, [&value](const V&) { return value; });
+            }
+            else
+            {
+                TryDelete(record.key);
+            }
+        }
+
+        m_wal = std::move(wal);
+        Checkpoint();
+    }
+    else
+    {
+        // Nodes are written in place from now on, statistics are valid again only after closing.
+        WriteSuperblock(false);
+    }
+
+    StartWriteback();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::Checkpoint()
+{
+    boost::unique_lock<VolumeMutex> lock(m_mutex);
+    MakeCheckpoint();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::MakeCheckpoint()
+{
+    // Nodes may contain changes which are absent in the failed log, they must not reach disk.
+    CheckWritable();
+
+    // All dirty nodes are written below, writeback queue is not needed anymore.
+    m_storage->TakeDirty(std::numeric_limits<size_t>::max());
+
+    std::vector<std::shared_ptr<BPNode<V, BranchFactor>>> nodes;
+    m_cache->for_each([&nodes](const FileIndex&, std::shared_ptr<BPNode<V, BranchFactor>>& node)
+    {
+        if (node->IsDirty())
+            nodes.push_back(node);
+    });
+
+    if (m_root->IsDirty())
+        nodes.push_back(m_root);
+
+    // Write nodes in order of indices, it is sequential I/O for paged storage.
+    std::sort(nodes.begin(), nodes.end(), [](const auto& lhs, const auto& rhs) { return lhs->GetIndex() < rhs->GetIndex(); });
+    nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+
+    const auto removed = m_indexManager.TakeRemoved();
+
+    if (m_wal)
+    {
+        std::vector<std::pair<FileIndex, std::string>> images;
+        for (const auto& node : nodes)
+        {
+            images.emplace_back(node->GetIndex(), node->Serialize());
+        }
+
+        m_wal->WriteCheckpoint(images, removed);
+    }
+
+    for (const auto& node : nodes)
+    {
+        node->Flush();
+    }
+    for (auto idx : removed)
+    {
+        m_storage->Free(idx);
+    }
+
+    // Log can be cleared only when written nodes and removed files are durable.
+    m_storage->Sync();
+
+    if (m_deleter)
+        m_deleter->Flush();
+
+    if (m_wal)
+    {
+        WriteSuperblock(true);
+        m_wal->Clear();
+    }
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::CommitWrite(uint64_t logPosition, boost::shared_lock<VolumeMutex>& volumeLock)
+{
+    if (m_storage->GetDirtyCount() >= m_highWatermark)
+        m_writebackCondition.notify_one();
+
+    if (!m_wal)
+        return;
+
+    m_wal->Commit(logPosition);
+    volumeLock.unlock();
+
+    if (m_wal->Size() < CheckpointLogSize)
+        return;
+
+    boost::unique_lock<VolumeMutex> lock(m_mutex);
+    if (m_wal->Size() >= CheckpointLogSize)
+        MakeCheckpoint();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::CheckWritable() const
+{
+    if (m_wal && m_wal->IsFailed())
+        throw std::runtime_error("Volume is read-only after failure of its log, it must be reopened");
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+template<class InputIt>
+void Volume<V, BranchFactor>::BulkLoad(InputIt first, InputIt last, double fillFactor)
+{
+    constexpr auto MaxKeys = BranchFactor - 1;
+    constexpr auto MinKeys = Half(BranchFactor);
+
+    if (!(fillFactor >= 0.5 && fillFactor <= 1.0))
+        throw std::runtime_error("Fill factor must be from 0.5 to 1.0");
+
+    boost::unique_lock<VolumeMutex> lock(m_mutex);
+
+    if (!m_root->IsLeaf() || m_root->GetKeyCount() != 0)
+        throw std::runtime_error("Bulk load to not empty volume");
+
+    if (first == last)
+        return;
+
+    // Log may contain only operations which cancel each other, they must not be replayed over the new tree.
+    if (m_wal)
+    {
+        MakeCheckpoint();
+        WriteSuperblock(false);
+    }
+
+    struct PendingLeaf
+    {
+        std::vector<Key> keys;
+        std::vector<V> values;
+        FileIndex idx{ 0 };
+    };
+
+    // First key and index of every node of the level which is being built.
+    std::vector<std::pair<Key, FileIndex>> children;
+
+    const auto writeLeaf = [this, &children](PendingLeaf& pending, FileIndex next)
+    {
+        Leaf<V, BranchFactor> leaf(m_storage, m_cache, pending.idx);
+        leaf.m_keyCount = static_cast<uint32_t>(pending.keys.size());
+        std::copy(pending.keys.begin(), pending.keys.end(), leaf.m_keys.begin());
+        leaf.m_values.assign(std::move(pending.values));
+        leaf.m_nextBatch = next;
+
+        m_storage->Write(pending.idx, leaf.Serialize());
+        children.emplace_back(pending.keys.front(), pending.idx);
+    };
+
+    // Leaves are written with delay of one leaf: the last leaf may get too few keys and
+    // borrow them from the previous one. Index of the first leaf is unknown until the
+    // second one appears, the only leaf is root.
+    const auto leafKeys = std::clamp<size_t>(std::lround(MaxKeys * fillFactor), MinKeys, MaxKeys);
+    std::optional<PendingLeaf> prev;
+    PendingLeaf current;
+
+    uint64_t keyCount = 0;
+    for (; first != last; ++first, ++keyCount)
+    {
+        const auto& pair = *first;
+
+        if (!current.keys.empty() && pair.first <= current.keys.back())
+            throw std::runtime_error("Keys of bulk load are not sorted");
+
+        if (current.keys.size() == leafKeys)
+        {
+            if (!current.idx)
+                current.idx = m_indexManager.FindFreeIndex();
+
+            PendingLeaf next;
+            next.idx = m_indexManager.FindFreeIndex();
+
+            if (prev)
+                writeLeaf(*prev, current.idx);
+
+            prev = std::move(current);
+            current = std::move(next);
+        }
+
+        current.keys.push_back(pair.first);
+        current.values.push_back(pair.second);
+    }
+
+    if (!prev)
+    {
+        current.idx = 1;
+        writeLeaf(current, 0);
+    }
+    else if (current.keys.size() >= MinKeys)
+    {
+        writeLeaf(*prev, current.idx);
+        writeLeaf(current, 0);
+    }
+    else if (prev->keys.size() + current.keys.size() > MaxKeys)
+    {
+        // Share keys of two last leaves equally.
+        const auto move = (prev->keys.size() - current.keys.size()) / 2;
+        current.keys.insert(current.keys.begin(), prev->keys.end() - move, prev->keys.end());
+        current.values.insert(current.values.begin(), std::make_move_iterator(prev->values.end() - move), std::make_move_iterator(prev->values.end()));
+        prev->keys.resize(prev->keys.size() - move);
+        prev->values.erase(prev->values.end() - move, prev->values.end());
+
+        writeLeaf(*prev, current.idx);
+        writeLeaf(current, 0);
+    }
+    else
+    {
+        // Merge two last leaves. If they are the only leaves then the merged one is root.
+        prev->keys.insert(prev->keys.end(), current.keys.begin(), current.keys.end());
+        prev->values.insert(prev->values.end(), std::make_move_iterator(current.values.begin()), std::make_move_iterator(current.values.end()));
+        m_storage->Free(current.idx);
+
+        if (children.empty())
+        {
+            m_storage->Free(prev->idx);
+            prev->idx = 1;
+        }
+
+        writeLeaf(*prev, 0);
+    }
+
+    // Build levels of nodes until the level of one node which is root.
+    const auto nodeChildren = std::clamp<size_t>(std::lround(BranchFactor * fillFactor), MinKeys + 1, BranchFactor);
+    uint32_t height = 1;
+
+    for (; children.size() > 1; height++)
+    {
+        // Full nodes and the last one which takes children from the previous node if it has too few.
+        std::vector<size_t> sizes(children.size() / nodeChildren, nodeChildren);
+        if (const auto rest = children.size() % nodeChildren)
+        {
+            if (rest > MinKeys || sizes.empty())
+            {
+                sizes.push_back(rest);
+            }
+            else
+            {
+                const auto total = sizes.back() + rest;
+                sizes.pop_back();
+
+                if (total <= BranchFactor)
+                {
+                    sizes.push_back(total);
+                }
+                else
+                {
+                    sizes.push_back(total / 2);
+                    sizes.push_back(total - total / 2);
+                }
+            }
+        }
+
+        std::vector<std::pair<Key, FileIndex>> parents;
+        size_t pos = 0;
+
+        for (const auto size : sizes)
+        {
+            const auto idx = sizes.size() == 1 ? 1 : m_indexManager.FindFreeIndex();
+
+            Node<V, BranchFactor> node(m_storage, m_cache, idx);
+            node.m_keyCount = static_cast<uint32_t>(size - 1);
+            node.m_ptrs[0] = children[pos].second;
+            for (size_t i = 1; i < size; i++)
+            {
+                node.m_keys[i - 1] = children[pos + i].first;
+                node.m_ptrs[i] = children[pos + i].second;
+            }
+
+            m_storage->Write(idx, node.Serialize());
+            parents.emplace_back(children[pos].first, idx);
+            pos += size;
+        }
+
+        children = std::move(parents);
+    }
+
+    m_storage->Sync();
+
+    // Replace the empty root. It must not be written over the new one. Reference keeps
+    // the old root alive until its latch is unlocked.
+    const auto oldRoot = m_root;
+    boost::unique_lock<NodeLatch> rootLock(oldRoot->m_mutex);
+    oldRoot->MarkAsDeleted();
+    m_cache->erase(1);
+    SetRoot(CreateBPNode<V, BranchFactor>(m_storage, m_cache, 1));
+
+    m_keyCount = keyCount;
+    m_height = height;
+    if (m_wal)
+        WriteSuperblock(true);
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+uint64_t Volume<V, BranchFactor>::GetKeyCount() const
+{
+    return m_keyCount.load();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+uint32_t Volume<V, BranchFactor>::GetHeight() const
+{
+    return m_height.load();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+IoStats Volume<V, BranchFactor>::GetIoStats() const
+{
+    return m_storage->GetIoStats();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::CountKeys()
+{
+    uint32_t height = 1;
+    for (auto node = m_root; !node->IsLeaf(); height++)
+    {
+        node = CreateBPNode<V, BranchFactor>(m_storage, m_cache, std::static_pointer_cast<Node<V, BranchFactor>>(node)->m_ptrs[0]);
+    }
+
+    uint64_t keyCount = 0;
+    for (auto leaf = std::static_pointer_cast<Leaf<V, BranchFactor>>(m_root->GetFirstLeaf());;)
+    {
+        keyCount += leaf->GetKeyCount();
+        if (leaf->m_nextBatch == 0)
+            break;
+
+        leaf = LoadScannedLeaf<V, BranchFactor>(m_storage, m_cache, leaf->m_nextBatch);
+    }
+
+    m_keyCount = keyCount;
+    m_height = height;
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::WriteSuperblock(bool exact) const
+{
+    Superblock superblock;
+    superblock.branchFactor = static_cast<uint32_t>(BranchFactor);
+    superblock.valueType = ValueTypeCode<V>();
+    superblock.height = m_height;
+    superblock.keyCount = m_keyCount;
+    superblock.exact = exact;
+    superblock.Write(m_dir);
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::SetDirtyWatermarks(size_t lowWatermark, size_t highWatermark)
+{
+    if (lowWatermark > highWatermark)
+        throw std::runtime_error("Low watermark is greater than high watermark");
+
+    m_lowWatermark = lowWatermark;
+    m_highWatermark = std::max<size_t>(highWatermark, 1);
+    m_writebackCondition.notify_one();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::SetReadAhead(size_t maxLeaves)
+{
+    m_readAhead = maxLeaves;
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::StartWriteback()
+{
+    m_stopWriteback = false;
+    m_writeback = std::thread([this]() { WritebackLoop(); });
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::StopWriteback()
+{
+    if (!m_writeback.joinable())
+        return;
+
+    {
+        boost::unique_lock<boost::mutex> lock(m_writebackMutex);
+        m_stopWriteback = true;
+    }
+    m_writebackCondition.notify_one();
+    m_writeback.join();
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::WritebackLoop()
+{
+    boost::unique_lock<boost::mutex> lock(m_writebackMutex);
+
+    while (!m_stopWriteback)
+    {
+        // Writers wake the thread up, timeout covers notifications which came while it was writing.
+        m_writebackCondition.wait_for(lock, WritebackPeriod);
+        if (m_stopWriteback || m_storage->GetDirtyCount() < m_highWatermark)
+            continue;
+
+        lock.unlock();
+
+        try
+        {
+            WriteBack();
+        }
+        catch (const std::exception&)
+        {
+            // Nodes stay dirty and are written by the next attempt or by StopAndFlush().
+        }
+
+        lock.lock();
+    }
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::WriteBack()
+{
+    if (m_wal)
+    {
+        // Nodes can't be written before checkpoint of their log records.
+        boost::unique_lock<VolumeMutex> lock(m_mutex);
+        MakeCheckpoint();
+        return;
+    }
+
+    bool requeued = false;
+
+    while (!m_stopWriteback && m_storage->GetDirtyCount() > m_lowWatermark)
+    {
+        const auto indices = m_storage->TakeDirty(WritebackBatchSize);
+        if (indices.empty())
+        {
+            if (requeued)
+                return;
+
+            // Node may be dirty but not in cache yet when its index is taken. Queue such nodes again.
+            m_cache->for_each([this](const FileIndex& idx, std::shared_ptr<BPNode<V, BranchFactor>>& node)
+            {
+                if (node->IsDirty())
+                    m_storage->QueueDirty(idx);
+            });
+            requeued = true;
+            continue;
+        }
+
+        for (auto idx : indices)
+        {
+            if (auto node = m_cache->get(idx))
+                (*node)->Flush();
+        }
+    }
 }
 
 //-------------------------------------------------------------------------------
 template<class V, size_t BranchFactor>
 std::unique_ptr<VolumeEnumerator<V, BranchFactor>> Volume<V, BranchFactor>::Enumerate() const
 {
-    boost::shared_lock<boost::shared_mutex> lock(m_mutex);
-    return std::make_unique<VolumeEnumerator<V, BranchFactor>>(m_dir, m_cache, m_root->GetFirstLeaf(), std::move(lock));
+    return Scan(0);
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+std::unique_ptr<VolumeEnumerator<V, BranchFactor>> Volume<V, BranchFactor>::Scan(Key lo, std::optional<Key> hi, size_t limit) const
+{
+    ScanLock lock(m_mutex);
+    return std::make_unique<VolumeEnumerator<V, BranchFactor>>(m_storage, m_cache, GetRoot(), std::move(lock), lo, hi, limit, m_readAhead);
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+Aggregates<V> Volume<V, BranchFactor>::Aggregate(Key lo, std::optional<Key> hi) const
+{
+    static_assert(std::is_arithmetic_v<V>, "Aggregates need numeric values");
+
+    ScanLock lock(m_mutex);
+
+    const auto now = CurrentUnixTime();
+
+    // Infinite values of float and double are minimum and maximum too, so start from infinities.
+    Aggregates<V> result;
+    V min = std::numeric_limits<V>::has_infinity ? std::numeric_limits<V>::infinity() : std::numeric_limits<V>::max();
+    V max = std::numeric_limits<V>::has_infinity ? -std::numeric_limits<V>::infinity() : std::numeric_limits<V>::lowest();
+
+    auto leaf = std::static_pointer_cast<Leaf<V, BranchFactor>>(GetRoot()->FindLeaf(lo));
+    uint32_t first = LowerBound(leaf->m_keys, leaf->GetKeyCount(), lo);
+
+    while (true)
+    {
+        // Only leaves at the edges of the range are processed partially, keys of the others are not searched.
+        const uint32_t keyCount = leaf->GetKeyCount();
+        uint32_t last = keyCount;
+        if (hi && keyCount != 0 && leaf->m_keys[keyCount - 1] >= *hi)
+            last = std::max(first, LowerBound(leaf->m_keys, keyCount, *hi));
+        result.count += leaf->Aggregate(first, last, now, result.sum, min, max);
+
+        if (last < keyCount || !leaf->m_nextBatch)
+            break;
+
+        leaf = LoadScannedLeaf<V, BranchFactor>(m_storage, m_cache, leaf->m_nextBatch);
+        first = 0;
+    }
+
+    // NaN values don't change minimum and maximum, so they are crossed only if there were no other values.
+    if (result.count != 0 && min <= max)
+    {
+        result.min = min;
+        result.max = max;
+    }
+
+    return result;
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+std::shared_ptr<BPNode<V, BranchFactor>> Volume<V, BranchFactor>::GetRoot() const
+{
+    boost::shared_lock<boost::shared_mutex> lock(m_rootMutex);
+    return m_root;
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+void Volume<V, BranchFactor>::SetRoot(std::shared_ptr<BPNode<V, BranchFactor>> root)
+{
+    boost::unique_lock<boost::shared_mutex> lock(m_rootMutex);
+    m_root = std::move(root);
+    m_rootPtr.store(m_root.get(), std::memory_order_release);
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+template<class Lock>
+std::shared_ptr<BPNode<V, BranchFactor>> Volume<V, BranchFactor>::LockRoot(Lock& lock) const
+{
+    while (true)
+    {
+        auto root = GetRoot();
+        Lock rootLock(root->m_mutex);
+
+        if (root == GetRoot())
+        {
+            lock = std::move(rootLock);
+            return root;
+        }
+    }
+}
+
+//-------------------------------------------------------------------------------
+template<class V, size_t BranchFactor>
+std::shared_ptr<Leaf<V, BranchFactor>> Volume<V, BranchFactor>::LockLeafForWrite(const Key& key, boost::unique_lock<NodeLatch>& leafLock, std::optional<Key>* upperBound) const
+{
+    boost::shared_lock<NodeLatch> nodeLock;
+    std::shared_ptr<BPNode<V, BranchFactor>> current;
+
+    // Type of the node never changes, so we can choose latch mode before locking.
+    while (true)
+    {
+        current = GetRoot();
+        if (current->IsLeaf())
+            leafLock = boost::unique_lock<NodeLatch>(current->m_mutex);
+        else
+            nodeLock = boost::shared_lock<NodeLatch>(current->m_mutex);
+
+        if (current == GetRoot())
+            break;
+
+        if (leafLock.owns_lock())
+            leafLock.unlock();
+        if (nodeLock.owns_lock())
+            nodeLock.unlock();
+    }
+
+    if (upperBound)
+        upperBound->reset();
+
+    while (!current->IsLeaf())
+    {
+        auto node = std::static_pointer_cast<Node<V, BranchFactor>>(current);
+
+        // Range of the child is inside range of the node, so the bound of the last node with it is the closest one.
+        if (upperBound)
+        {
+            if (auto bound = node->GetUpperBound(key))
+                *upperBound = bound;
+        }
+
+        auto child = node->GetChildByKey(key);
+
+        if (child->IsLeaf())
+        {
+            leafLock = boost::unique_lock<NodeLatch>(child->m_mutex);
+        }
+        else
+        {
+            boost::shared_lock<NodeLatch> childLock(child->m_mutex);
+            nodeLock = std::move(childLock);
+        }
+
+        current = std::move(child);
+    }
+
+    return std::static_pointer_cast<Leaf<V, BranchFactor>>(current);
 }
 
 } // kv_storage
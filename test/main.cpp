@@ -14,6 +14,24 @@
 #include <fstream>
 #include <set>
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <numeric>
+#include <functional>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+#ifndef _WIN32
+#include <csignal>
+#include <sys/resource.h>
+#endif
 
 #include <kv_storage/volume.h>
 #include <kv_storage/storage.h>
@@ -133,6 +151,35 @@ BOOST_AUTO_TEST_CASE(DeleteTest)
     }
 }
 
+BOOST_AUTO_TEST_CASE(TryDeleteTest)
+{
+    std::cout << "TryDeleteTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    auto s = kv_storage::Volume<uint64_t, 10>(volumeDir);
+    for (uint64_t key = 0; key < 1000; key += 2)
+    {
+        s.Put(key, key);
+    }
+
+    // Absent keys are between existing ones, in leaves with enough keys and in leaves which need rebalancing.
+    for (uint64_t key = 0; key < 1000; key += 4)
+    {
+        BOOST_TEST(s.TryDelete(key));
+        BOOST_TEST(!s.TryDelete(key));
+        BOOST_TEST(!s.TryDelete(key + 1));
+    }
+    BOOST_CHECK_THROW(s.Delete(0), std::runtime_error);
+
+    BOOST_TEST(s.GetKeyCount() == 250);
+    for (uint64_t key = 0; key < 1000; key++)
+    {
+        BOOST_TEST(s.Get(key).has_value() == (key % 4 == 2));
+    }
+}
+
 BOOST_AUTO_TEST_CASE(EnumeratorTest)
 {
     std::cout << "EnumeratorTest" << std::endl;
@@ -193,263 +240,2206 @@ BOOST_AUTO_TEST_CASE(EnumeratorTest)
     BOOST_TEST(enumerator->MoveNext() == false);
 }
 
-BOOST_AUTO_TEST_CASE(MillionsTest)
+BOOST_AUTO_TEST_CASE(ScanTest)
 {
-    std::cout << "MillionsTest" << std::endl;
+    std::cout << "ScanTest" << std::endl;
 
     fs::path volumeDir("vol");
     fs::remove_all(volumeDir);
 
-    const auto count = 5000000;
-    std::string value = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";
+    auto s = kv_storage::Volume<uint64_t, 10>(volumeDir);
 
+    // Only even keys, so bounds of ranges are both existing and missing keys.
+    const uint64_t count = 10000;
+    for (uint64_t i = 0; i < count; i++)
     {
-        auto s = kv_storage::Volume<std::string>(volumeDir);
+        s.Put(i * 2, i);
+    }
+
+    auto check = [&s](uint64_t lo, std::optional<uint64_t> hi, size_t limit)
+    {
+        auto enumerator = s.Scan(lo, hi, limit);
 
+        uint64_t expected = lo + lo % 2;
+        size_t found = 0;
+        while (enumerator->MoveNext())
         {
-            std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+            BOOST_REQUIRE(enumerator->GetCurrent().first == expected);
+            BOOST_REQUIRE(enumerator->GetCurrent().second == expected / 2);
+            expected += 2;
+            found++;
+        }
 
-            for (int i = 0; i < count; i++)
-            {
-                s.Put(i, value);
-            }
+        const uint64_t end = std::min<uint64_t>(hi.value_or(count * 2), count * 2);
+        const size_t inRange = end > lo ? static_cast<size_t>((end - lo + 1 - lo % 2) / 2) : 0;
+        BOOST_TEST(found == std::min(inRange, limit));
+        BOOST_TEST(enumerator->MoveNext() == false);
+    };
 
-            std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-            std::cout << "Time elapsed for inserting values: " << std::chrono::duration_cast<std::chrono::seconds>(end - begin).count() << "[s]" << std::endl;
-        }
+    std::mt19937 rng(42);
+    for (int i = 0; i < 1000; i++)
+    {
+        const uint64_t lo = rng() % (count * 2 + 10);
+        const uint64_t hi = lo + rng() % 300;
+        check(lo, hi, std::numeric_limits<size_t>::max());
+        check(lo, hi, rng() % 50);
+        check(lo, std::nullopt, rng() % 50);
     }
 
-    {
-        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    check(0, std::nullopt, std::numeric_limits<size_t>::max());
+    check(count * 2, std::nullopt, std::numeric_limits<size_t>::max());
+    check(100, 100, std::numeric_limits<size_t>::max());
 
-        auto s = kv_storage::Volume<std::string>(volumeDir);
+    // Seek keeps the upper bound.
+    auto enumerator = s.Scan(0, 1000);
+    BOOST_TEST(enumerator->MoveNext());
+    BOOST_TEST(enumerator->GetCurrent().first == 0);
 
-        for (int i = 0; i < count; i++)
-        {
-            BOOST_TEST(*s.Get(i) == value);
-        }
+    enumerator->Seek(501);
+    BOOST_TEST(enumerator->MoveNext());
+    BOOST_TEST(enumerator->GetCurrent().first == 502);
 
-        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-        std::cout << "Time elapsed for getting values: " << std::chrono::duration_cast<std::chrono::seconds>(end - begin).count() << "[s]" << std::endl;
-    }
+    enumerator->Seek(998);
+    BOOST_TEST(enumerator->MoveNext());
+    BOOST_TEST(enumerator->GetCurrent().first == 998);
+    BOOST_TEST(enumerator->MoveNext() == false);
+
+    enumerator->Seek(10);
+    BOOST_TEST(enumerator->MoveNext());
+    BOOST_TEST(enumerator->GetCurrent().first == 10);
 }
 
-BOOST_AUTO_TEST_CASE(FloatsTest)
+BOOST_AUTO_TEST_CASE(BulkLoadTest)
 {
-    std::cout << "FloatsTest" << std::endl;
+    std::cout << "BulkLoadTest" << std::endl;
 
     fs::path volumeDir("vol");
-    fs::remove_all(volumeDir);
-
-    const auto count = 1000000;
 
-    auto floatingTest = [&](auto dummy)
+    for (auto format : { kv_storage::StorageFormat::Files, kv_storage::StorageFormat::Paged })
     {
+        for (auto walMode : { kv_storage::WalMode::Disabled, kv_storage::WalMode::Buffered })
         {
-            auto s = kv_storage::Volume<decltype(dummy)>(volumeDir);
-
+            // Sizes around the leaf and node capacity check rebalancing of the last leaf and node.
+            for (uint64_t count : { 0, 1, 4, 9, 10, 13, 19, 45, 91, 100, 1000, 100000 })
             {
-                std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
-
-                for (int i = 0; i < count; i++)
+                for (double fillFactor : { 0.5, 0.7, 1.0 })
                 {
-                    decltype(dummy) key = static_cast<decltype(dummy)>(i) / count;
-                    s.Put(i, key);
+                    if (count == 100000 && (fillFactor != 0.7 || walMode != kv_storage::WalMode::Disabled))
+                        continue;
+
+                    fs::remove_all(volumeDir);
+
+                    std::vector<std::pair<uint64_t, std::string>> pairs;
+                    for (uint64_t i = 0; i < count; i++)
+                    {
+                        pairs.emplace_back(i * 2, std::to_string(i));
+                    }
+
+                    {
+                        auto s = kv_storage::Volume<std::string, 10>(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, format, walMode);
+                        s.BulkLoad(pairs.begin(), pairs.end(), fillFactor);
+                        BOOST_REQUIRE(s.GetKeyCount() == count);
+
+                        BOOST_REQUIRE(s.Get(1) == std::nullopt);
+                        for (const auto& pair : pairs)
+                        {
+                            BOOST_REQUIRE(s.Get(pair.first) == pair.second);
+                        }
+
+                        // Loaded tree is changed as usual.
+                        for (uint64_t i = 0; i < count; i += 3)
+                        {
+                            s.Delete(i * 2);
+                        }
+                        for (uint64_t i = 0; i < count; i += 2)
+                        {
+                            s.Put(i * 2 + 1, "odd");
+                        }
+                    }
+
+                    auto s = kv_storage::Volume<std::string, 10>(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, format, walMode);
+
+                    std::vector<std::pair<uint64_t, std::string>> expected;
+                    for (uint64_t i = 0; i < count; i++)
+                    {
+                        if (i % 3 != 0)
+                            expected.emplace_back(i * 2, std::to_string(i));
+                        if (i % 2 == 0)
+                            expected.emplace_back(i * 2 + 1, "odd");
+                    }
+
+                    auto enumerator = s.Enumerate();
+                    size_t pos = 0;
+                    while (enumerator->MoveNext())
+                    {
+                        BOOST_REQUIRE(pos < expected.size());
+                        BOOST_REQUIRE(enumerator->GetCurrent() == expected[pos]);
+                        pos++;
+                    }
+                    BOOST_REQUIRE(pos == expected.size());
                 }
-
-                std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-                std::cout << "Time elapsed for inserting floats: " << std::chrono::duration_cast<std::chrono::seconds>(end - begin).count() << "[s]" << std::endl;
             }
         }
+    }
 
-        {
-            std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
-
-            auto s = kv_storage::Volume<decltype(dummy)>(volumeDir);
-
-            for (int i = 0; i < count; i++)
-            {
-                decltype(dummy) key = *s.Get(i);
-                BOOST_TEST(key == static_cast<decltype(dummy)>(i) / count);
-            }
+    fs::remove_all(volumeDir);
+    auto s = kv_storage::Volume<uint64_t, 10>(volumeDir);
 
-            std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-            std::cout << "Time elapsed for getting floats: " << std::chrono::duration_cast<std::chrono::seconds>(end - begin).count() << "[s]" << std::endl;
-        }
-    };
+    std::vector<std::pair<uint64_t, uint64_t>> unsorted{ { 1, 1 }, { 3, 3 }, { 2, 2 } };
+    BOOST_CHECK_THROW(s.BulkLoad(unsorted.begin(), unsorted.end()), std::runtime_error);
 
-    floatingTest(1.0f);
+    std::vector<std::pair<uint64_t, uint64_t>> duplicated{ { 1, 1 }, { 1, 2 } };
+    BOOST_CHECK_THROW(s.BulkLoad(duplicated.begin(), duplicated.end()), std::runtime_error);
 
-    fs::remove_all(volumeDir);
+    std::vector<std::pair<uint64_t, uint64_t>> sorted{ { 1, 1 }, { 2, 2 } };
+    BOOST_CHECK_THROW(s.BulkLoad(sorted.begin(), sorted.end(), 0.4), std::runtime_error);
+    BOOST_CHECK_THROW(s.BulkLoad(sorted.begin(), sorted.end(), 1.1), std::runtime_error);
 
-    floatingTest((double)1.0);
+    s.Put(5, 5);
+    BOOST_CHECK_THROW(s.BulkLoad(sorted.begin(), sorted.end()), std::runtime_error);
 }
 
-BOOST_AUTO_TEST_CASE(ManyVolumesTest)
+BOOST_AUTO_TEST_CASE(WriteBatchTest)
 {
-    std::cout << "ManyVolumesTest" << std::endl;
+    std::cout << "WriteBatchTest" << std::endl;
 
-    std::vector<kv_storage::Volume<std::string>> volumes;
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
 
-    for (int i = 0; i < 11; i++)
+    using VolumeType = kv_storage::Volume<std::string, 10>;
+
+    std::map<kv_storage::Key, std::string> expected;
+
+    const auto check = [&expected](VolumeType& s)
     {
-        fs::path volumeDir("vol" + std::to_string(i));
-        fs::remove_all(volumeDir);
+        BOOST_TEST(s.GetKeyCount() == expected.size());
 
-        volumes.emplace_back(volumeDir);
+        auto enumerator = s.Enumerate();
+        for (const auto& [key, value] : expected)
+        {
+            BOOST_REQUIRE(enumerator->MoveNext());
+            BOOST_REQUIRE(enumerator->GetCurrent().first == key);
+            BOOST_REQUIRE(enumerator->GetCurrent().second == value);
+        }
+        BOOST_TEST(enumerator->MoveNext() == false);
+    };
 
-        for (int j = i*10000; j < (i+1)*10000; j++)
+    {
+        auto s = VolumeType(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Files, kv_storage::WalMode::Buffered);
+        s.Start();
+
+        // Sorted ingest splits leaves on the way.
+        kv_storage::WriteBatch<std::string> batch;
+        for (kv_storage::Key key = 0; key < 20000; key += 2)
         {
-            volumes[i].Put(j, "value" + std::to_string(j));
+            batch.Put(key, std::to_string(key));
+            expected[key] = std::to_string(key);
         }
-    }
+        s.Write(batch);
+        check(s);
 
-    kv_storage::StorageNode<std::string> storageRoot;
-    storageRoot.Mount(volumes[0]);
-    storageRoot.Mount(volumes[1]);
-    auto child1 = storageRoot.CreateChildNode();
-    child1->Mount(volumes[2]);
-    child1->Mount(volumes[3]);
-    child1->Mount(volumes[4]);
-    auto child2 = child1->CreateChildNode();
-    auto child3 = child2->CreateChildNode();
-    child3->Mount(volumes[5]);
-    child3->Mount(volumes[6]);
-    child3->Mount(volumes[7]);
-    auto child4 = child2->CreateChildNode();
-    child4->Mount(volumes[8]);
-    child4->Mount(volumes[9]);
-    child4->Mount(volumes[10]);
+        // Shuffled puts, replaces and deletes. The last operation of a key wins.
+        std::vector<kv_storage::Key> keys(20000);
+        std::iota(keys.begin(), keys.end(), 0);
+        std::shuffle(keys.begin(), keys.end(), std::mt19937(42));
 
-    for (int i = 0; i < 110000; i++)
-    {
-        auto found = storageRoot.Get(i);
-        BOOST_TEST(found.size() == 1);
-        BOOST_TEST(found[0] == "value" + std::to_string(i));
+        batch.Clear();
+        for (const auto key : keys)
+        {
+            if (key % 3 == 0)
+            {
+                batch.Put(key, "new" + std::to_string(key));
+                expected[key] = "new" + std::to_string(key);
+            }
+            else if (key % 3 == 1)
+            {
+                batch.Put(key, "lost");
+                batch.Delete(key);
+                expected.erase(key);
+            }
+        }
+        BOOST_TEST(batch.GetSize() == 6667 + 2 * 6667);
+        s.Write(batch);
+        check(s);
+
+        // Put by batch clears TTL of key.
+        s.Put(20001, "ttl", 1);
+        batch.Clear();
+        batch.Put(20001, "no ttl");
+        s.Write(batch);
+        expected[20001] = "no ttl";
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+        check(s);
+
+        // Deletes of the most of keys merge leaves and decrease height.
+        batch.Clear();
+        for (const auto& pair : expected)
+        {
+            if (pair.first > 100)
+                batch.Delete(pair.first);
+        }
+        s.Write(batch);
+        for (auto it = expected.begin(); it != expected.end();)
+        {
+            it = it->first > 100 ? expected.erase(it) : std::next(it);
+        }
+        check(s);
     }
+
+    // Batch is replayed from the log.
+    auto s = VolumeType(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Files, kv_storage::WalMode::Buffered);
+    check(s);
 }
 
-BOOST_AUTO_TEST_CASE(MultithreadingTest)
+BOOST_AUTO_TEST_CASE(ConcurrentWriteBatchTest)
 {
-    std::cout << "MultithreadingTest" << std::endl;
+    std::cout << "ConcurrentWriteBatchTest" << std::endl;
 
     fs::path volumeDir("vol");
     fs::remove_all(volumeDir);
 
-    const auto count = 5000000;
-    std::string value = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";
+    auto s = kv_storage::Volume<uint64_t, 10>(volumeDir);
 
+    const uint64_t keysCount = 5000;
+    const uint32_t threadsCount = 4;
+    std::atomic<uint32_t> failures{ 0 };
+
+    // Threads put and delete the same keys, so leaves which are split or rebalanced for a batch
+    // are changed by other threads meanwhile.
+    const auto runThreads = [&](bool put)
     {
-        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (uint32_t t = 0; t < threadsCount; t++)
         {
-            auto s = kv_storage::Volume<std::string>(volumeDir);
-
-            std::thread t1{ [&]()
+            threads.emplace_back([&, put]()
             {
-                for (int i = 0; i < count / 4; i++)
+                for (uint64_t first = 0; first < keysCount; first += 5)
                 {
-                    s.Put(i, value);
+                    kv_storage::WriteBatch<uint64_t> batch;
+                    for (uint64_t key = first; key < first + 5; key++)
+                    {
+                        if (put)
+                            batch.Put(key, key);
+                        else
+                            batch.Delete(key);
+                    }
+
+                    try
+                    {
+                        s.Write(batch);
+                    }
+                    catch (const std::exception& e)
+                    {
+                        if (failures++ == 0)
+                            std::cout << "Keys from " << first << ": " << e.what() << std::endl;
+                    }
                 }
-            } };
+            });
+        }
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+    };
+
+    runThreads(true);
+    BOOST_TEST(failures == 0);
+    BOOST_TEST(s.GetKeyCount() == keysCount);
+    for (uint64_t key = 0; key < keysCount; key++)
+    {
+        BOOST_TEST(s.Get(key).value_or(keysCount) == key);
+    }
+
+    runThreads(false);
+    BOOST_TEST(failures == 0);
+    BOOST_TEST(s.GetKeyCount() == 0);
+    BOOST_TEST(s.Enumerate()->MoveNext() == false);
+}
+
+BOOST_AUTO_TEST_CASE(UpsertTest)
+{
+    std::cout << "UpsertTest" << std::endl;
+
+    fs::path volumeDir("vol");
+
+    for (auto ttlMode : { kv_storage::TtlMode::Background, kv_storage::TtlMode::Inline })
+    {
+        fs::remove_all(volumeDir);
+
+        using VolumeType = kv_storage::Volume<std::string, 10>;
+        const kv_storage::Key count = 10000;
 
+        {
+            auto s = VolumeType(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Files, kv_storage::WalMode::Buffered, ttlMode);
+            s.Start();
 
-            std::thread t2{ [&]()
+            for (kv_storage::Key key = 0; key < count; key += 2)
             {
-                for (int i = count / 4; i < count / 2; i++)
-                {
-                    s.Put(i, value);
-                }
-            } };
+                s.Upsert(key, std::to_string(key));
+            }
+            BOOST_TEST(s.GetKeyCount() == count / 2);
+            const auto height = s.GetHeight();
 
-            std::thread t3{ [&]()
+            // Updates don't change the tree.
+            for (int round = 0; round < 3; round++)
             {
-                for (int i = count / 2; i < (count / 4) * 3; i++)
+                for (kv_storage::Key key = 0; key < count; key++)
                 {
-                    s.Put(i, value);
+                    BOOST_REQUIRE(s.Update(key, "updated" + std::to_string(key)) == (key % 2 == 0));
                 }
-            } };
+            }
+            BOOST_TEST(s.GetKeyCount() == count / 2);
+            BOOST_TEST(s.GetHeight() == height);
+
+            for (kv_storage::Key key = 0; key < count; key++)
+            {
+                s.Upsert(key, "upserted" + std::to_string(key));
+            }
+            BOOST_TEST(s.GetKeyCount() == count);
+
+            // Update keeps TTL, upsert replaces it.
+            s.Put(count, "value", 1);
+            BOOST_TEST(s.Update(count, "updated"));
+            s.Put(count + 1, "value", 1);
+            s.Upsert(count + 1, "upserted");
+            s.Upsert(count + 2, "value");
+            s.Upsert(count + 2, "upserted", 1);
+
+            std::this_thread::sleep_for(std::chrono::seconds(3));
+            BOOST_TEST(s.Get(count).has_value() == false);
+            BOOST_TEST(s.Update(count, "value") == false);
+            BOOST_TEST(s.Get(count + 1).value_or("") == "upserted");
+            BOOST_TEST(s.Get(count + 2).has_value() == false);
+
+            s.Upsert(count + 2, "value");
+            BOOST_TEST(s.Get(count + 2).value_or("") == "value");
+        }
+
+        // Changes are replayed from the log.
+        auto s = VolumeType(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Files, kv_storage::WalMode::Buffered, ttlMode);
+        for (kv_storage::Key key = 0; key < count; key++)
+        {
+            BOOST_REQUIRE(s.Get(key).value_or("") == "upserted" + std::to_string(key));
+        }
+        BOOST_TEST(s.Get(count + 1).value_or("") == "upserted");
+        BOOST_TEST(s.Get(count + 2).value_or("") == "value");
+    }
+}
 
-            std::thread t4{ [&]()
+BOOST_AUTO_TEST_CASE(MergeTest)
+{
+    std::cout << "MergeTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    const kv_storage::Key keyCount = 1000;
+    const uint64_t threadCount = 8;
+    const uint64_t rounds = 20;
+
+    {
+        auto s = kv_storage::Volume<uint64_t, 10>(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Files, kv_storage::WalMode::Buffered);
+
+        // Concurrent increments create keys and split leaves without lost updates.
+        std::vector<std::thread> threads;
+        for (uint64_t t = 0; t < threadCount; t++)
+        {
+            threads.emplace_back([&s, t]()
             {
-                for (int i = (count / 4) * 3; i < count; i++)
+                for (uint64_t round = 0; round < rounds; round++)
                 {
-                    s.Put(i, value);
+                    for (kv_storage::Key key = 0; key < keyCount; key++)
+                    {
+                        s.Merge((key * 7 + t) % keyCount, key + 1, kv_storage::MergeOperator::Add);
+                    }
                 }
-            } };
+            });
+        }
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
 
-            t1.join();
-            t2.join();
-            t3.join();
-            t4.join();
+        BOOST_TEST(s.GetKeyCount() == keyCount);
+        uint64_t sum = 0;
+        for (kv_storage::Key key = 0; key < keyCount; key++)
+        {
+            sum += s.Get(key).value_or(0);
         }
-        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-        std::cout << "Time elapsed for inserting values: " << std::chrono::duration_cast<std::chrono::seconds>(end - begin).count() << "[s]" << std::endl;
+        BOOST_TEST(sum == threadCount * rounds * keyCount * (keyCount + 1) / 2);
+
+        BOOST_TEST(s.Merge(keyCount, 5, kv_storage::MergeOperator::Min) == 5);
+        BOOST_TEST(s.Merge(keyCount, 7, kv_storage::MergeOperator::Min) == 5);
+        BOOST_TEST(s.Merge(keyCount, 3, kv_storage::MergeOperator::Min) == 3);
+        BOOST_TEST(s.Merge(keyCount + 1, 5, kv_storage::MergeOperator::Max) == 5);
+        BOOST_TEST(s.Merge(keyCount + 1, 7, kv_storage::MergeOperator::Max) == 7);
+        BOOST_TEST(s.Merge(keyCount + 1, 3, kv_storage::MergeOperator::Max) == 7);
+
+        const auto multiply = [](uint64_t value, uint64_t operand) { return value * operand; };
+        BOOST_TEST(s.Merge(keyCount + 2, 3, multiply) == 3);
+        BOOST_TEST(s.Merge(keyCount + 2, 3, multiply) == 9);
     }
 
+    // Merges are replayed from the log.
     {
-        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        auto s = kv_storage::Volume<uint64_t, 10>(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Files, kv_storage::WalMode::Buffered);
+        BOOST_TEST(s.GetKeyCount() == keyCount + 3);
+        BOOST_TEST(s.Get(keyCount).value_or(0) == 3);
+        BOOST_TEST(s.Get(keyCount + 1).value_or(0) == 7);
+        BOOST_TEST(s.Get(keyCount + 2).value_or(0) == 9);
 
-        auto s = kv_storage::Volume<std::string>(volumeDir);
+        // Merge keeps TTL of key.
+        s.Start();
+        s.Put(keyCount + 3, 1, 1);
+        s.Merge(keyCount + 3, 1, kv_storage::MergeOperator::Add);
+        std::this_thread::sleep_for(std::chrono::seconds(3));
+        BOOST_TEST(s.Get(keyCount + 3).has_value() == false);
+    }
+
+    // Floating point values.
+    fs::remove_all(volumeDir);
+    auto d = kv_storage::Volume<double>(volumeDir);
+    d.Merge(1, 0.5, kv_storage::MergeOperator::Add);
+    d.Merge(1, 0.25, kv_storage::MergeOperator::Add);
+    BOOST_TEST(d.Get(1).value_or(0) == 0.75);
+}
+
+BOOST_AUTO_TEST_CASE(AggregateTest)
+{
+    std::cout << "AggregateTest" << std::endl;
 
-        std::thread t1{ [&]()
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    const kv_storage::Key count = 1000000;
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> distribution(-1000.0f, 1000.0f);
+
+    std::map<kv_storage::Key, float> expected;
+
+    {
+        auto s = kv_storage::Volume<float>(volumeDir);
+        for (kv_storage::Key key = 0; key < count; key += 2)
         {
-            for (int i = 0; i < count / 2; i++)
+            const float value = distribution(rng);
+            s.Put(key, value);
+            expected[key] = value;
+        }
+
+        // Ranges inside one leaf, across leaves, out of keys and empty.
+        const std::vector<std::pair<kv_storage::Key, std::optional<kv_storage::Key>>> ranges = {
+            { 0, std::nullopt }, { 0, 1 }, { 1, 2 }, { 3, 9 }, { 5, 1000 }, { 999, 750001 },
+            { 750000, std::nullopt }, { count, std::nullopt }, { 100, 100 }, { 200, 100 }
+        };
+
+        for (const auto& [lo, hi] : ranges)
+        {
+            const auto aggregates = s.Aggregate(lo, hi);
+
+            uint64_t rangeCount = 0;
+            double sum = 0;
+            float min = std::numeric_limits<float>::max();
+            float max = std::numeric_limits<float>::lowest();
+            for (auto it = expected.lower_bound(lo); it != expected.end() && (!hi || it->first < *hi); ++it)
             {
-                auto res = s.Get(i);
-                if (!res)
-                    throw std::runtime_error("Failed to find value: " + std::to_string(i));
+                rangeCount++;
+                sum += it->second;
+                min = std::min(min, it->second);
+                max = std::max(max, it->second);
             }
-        } };
 
-        std::thread t2{ [&]()
-        {
-            for (int i = count / 2; i < count; i++)
+            BOOST_TEST(aggregates.count == rangeCount);
+            BOOST_TEST(std::abs(aggregates.sum - sum) < 1e-3 * (1 + std::abs(sum)));
+            BOOST_TEST(aggregates.min.has_value() == (rangeCount != 0));
+            BOOST_TEST(aggregates.max.has_value() == (rangeCount != 0));
+            if (rangeCount != 0)
             {
-                auto res = s.Get(i);
-                if (!res)
-                    throw std::runtime_error("Failed to find value: " + std::to_string(i));
+                BOOST_TEST(*aggregates.min == min);
+                BOOST_TEST(*aggregates.max == max);
             }
-        } };
+        }
 
-        t1.join();
-        t2.join();
+        const auto start = std::chrono::steady_clock::now();
+        const auto aggregates = s.Aggregate(0);
+        const std::chrono::duration<double, std::milli> aggregateTime = std::chrono::steady_clock::now() - start;
 
-        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-        std::cout << "Time elapsed for getting values: " << std::chrono::duration_cast<std::chrono::seconds>(end - begin).count() << "[s]" << std::endl;
+        double sum = 0;
+        const auto enumerationStart = std::chrono::steady_clock::now();
+        auto enumerator = s.Enumerate();
+        while (enumerator->MoveNext())
+        {
+            sum += enumerator->GetCurrent().second;
+        }
+        enumerator.reset();
+        const std::chrono::duration<double, std::milli> enumerationTime = std::chrono::steady_clock::now() - enumerationStart;
+
+        BOOST_TEST(std::abs(aggregates.sum - sum) < 1e-3 * (1 + std::abs(sum)));
+        std::cout << expected.size() << " floats, Aggregate: " << aggregateTime.count() << " ms, enumeration: " << enumerationTime.count() << " ms" << std::endl;
     }
 
+    // Outdated keys with inline TTL are skipped.
+    fs::remove_all(volumeDir);
+    auto s = kv_storage::Volume<uint32_t, 10>(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Files, kv_storage::WalMode::Disabled, kv_storage::TtlMode::Inline);
+    for (uint32_t key = 1; key <= 100; key++)
     {
-        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        if (key % 10 == 0)
+            s.Put(key, key, 0);
+        else
+            s.Put(key, key);
+    }
 
-        auto s = kv_storage::Volume<std::string>(volumeDir);
+    const auto aggregates = s.Aggregate(1, 101);
+    BOOST_TEST(aggregates.count == 90);
+    BOOST_TEST(aggregates.sum == 5050 - 550);
+    BOOST_TEST(aggregates.min.value_or(0) == 1);
+    BOOST_TEST(aggregates.max.value_or(0) == 99);
+
+    // Infinities are minimum and maximum, NaN is counted but doesn't affect them.
+    fs::remove_all(volumeDir);
+    auto d = kv_storage::Volume<double, 10>(volumeDir);
+    const double inf = std::numeric_limits<double>::infinity();
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    const std::vector<double> values = { nan, 1.0, inf, -2.0, nan, -inf, 3.0, nan, nan, nan, nan };
+    for (kv_storage::Key key = 0; key < values.size(); key++)
+    {
+        d.Put(key, values[key]);
+    }
+
+    const auto infinities = d.Aggregate(1, 7);
+    BOOST_TEST(infinities.count == 6);
+    BOOST_TEST(infinities.min.value_or(0) == -inf);
+    BOOST_TEST(infinities.max.value_or(0) == inf);
+
+    // Range of one infinite value has it as minimum and maximum.
+    const auto onlyInf = d.Aggregate(2, 3);
+    BOOST_TEST(onlyInf.min.value_or(0) == inf);
+    BOOST_TEST(onlyInf.max.value_or(0) == inf);
+
+    const auto onlyMinusInf = d.Aggregate(5, 6);
+    BOOST_TEST(onlyMinusInf.min.value_or(0) == -inf);
+    BOOST_TEST(onlyMinusInf.max.value_or(0) == -inf);
+
+    const auto positive = d.Aggregate(1, 3);
+    BOOST_TEST(positive.min.value_or(0) == 1.0);
+    BOOST_TEST(positive.max.value_or(0) == inf);
+    BOOST_TEST(positive.sum == inf);
+
+    const auto withNan = d.Aggregate(0, 2);
+    BOOST_TEST(withNan.count == 2);
+    BOOST_TEST(std::isnan(withNan.sum));
+    BOOST_TEST(withNan.min.value_or(0) == 1.0);
+    BOOST_TEST(withNan.max.value_or(0) == 1.0);
+
+    // Only NaN values, also more than one SIMD register of them.
+    const auto onlyNan = d.Aggregate(7);
+    BOOST_TEST(onlyNan.count == 4);
+    BOOST_TEST(!onlyNan.min.has_value());
+    BOOST_TEST(!onlyNan.max.has_value());
+}
 
-        std::thread t1{ [&]()
+BOOST_AUTO_TEST_CASE(EnumeratorBatchTest)
+{
+    std::cout << "EnumeratorBatchTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    {
+        auto s = kv_storage::Volume<std::string, 10>(volumeDir);
+        for (kv_storage::Key key = 0; key < 1000; key++)
+            s.Put(key, std::to_string(key));
+
+        // Batches cover the range without gaps and don't cross leaves.
+        auto enumerator = s.Scan(5, 995, 900);
+        kv_storage::VolumeEnumerator<std::string, 10>::Batch batch;
+        kv_storage::Key expectedKey = 5;
+        size_t batchCount = 0;
+        while (enumerator->NextBatch(batch))
         {
-            for (int i = 0; i < count / 2; i++)
+            BOOST_TEST(batch.GetSize() > 0);
+            BOOST_TEST(batch.GetSize() <= 9);
+            for (size_t i = 0; i < batch.GetSize(); i++)
             {
-                s.Delete(i);
+                BOOST_TEST(batch.GetKeys()[i] == expectedKey);
+                BOOST_TEST(batch.GetValue(i) == std::to_string(expectedKey));
+                expectedKey++;
             }
-        } };
+            batchCount++;
+        }
+        BOOST_TEST(expectedKey == 905);
+        BOOST_TEST(batchCount < 900);
+        BOOST_TEST(enumerator->NextBatch(batch) == false);
+        BOOST_TEST(enumerator->MoveNext() == false);
 
-        std::thread t2{ [&]()
+        // MoveNext continues after the last pair of a batch and vice versa.
+        enumerator.reset();
+        enumerator = s.Scan(100, 200);
+        BOOST_TEST(enumerator->MoveNext());
+        BOOST_TEST(enumerator->GetCurrent().first == 100);
+        BOOST_TEST(enumerator->NextBatch(batch));
+        BOOST_TEST(batch.GetKeys()[0] == 101);
+        const auto next = batch.GetKeys()[batch.GetSize() - 1] + 1;
+        BOOST_TEST(enumerator->MoveNext());
+        BOOST_TEST(enumerator->GetCurrent().first == next);
+        BOOST_TEST(enumerator->GetCurrent().second == std::to_string(next));
+
+        expectedKey = next + 1;
+        while (enumerator->NextBatch(batch))
         {
-            for (int i = count / 2; i < count; i++)
-            {
-                s.Delete(i);
-            }
-        } };
+            for (size_t i = 0; i < batch.GetSize(); i++)
+                BOOST_TEST(batch.GetKeys()[i] == expectedKey++);
+        }
+        BOOST_TEST(expectedKey == 200);
+    }
 
-        t2.join();
-        t1.join();
+    // Outdated keys with inline TTL are not included in batches.
+    fs::remove_all(volumeDir);
+    auto s = kv_storage::Volume<uint32_t, 10>(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Files, kv_storage::WalMode::Disabled, kv_storage::TtlMode::Inline);
+    for (uint32_t key = 1; key <= 100; key++)
+    {
+        if (key % 5 == 0)
+            s.Put(key, key, 0);
+        else
+            s.Put(key, key);
+    }
 
-        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-        std::cout << "Time elapsed for deleting values: " << std::chrono::duration_cast<std::chrono::seconds>(end - begin).count() << "[s]" << std::endl;
+    auto enumerator = s.Enumerate();
+    kv_storage::VolumeEnumerator<uint32_t, 10>::Batch batch;
+    uint32_t count = 0;
+    uint64_t sum = 0;
+    while (enumerator->NextBatch(batch))
+    {
+        for (size_t i = 0; i < batch.GetSize(); i++)
+            BOOST_TEST(batch.GetKeys()[i] % 5 != 0);
+        count += static_cast<uint32_t>(batch.GetSize());
+        sum = std::accumulate(batch.GetValues(), batch.GetValues() + batch.GetSize(), sum);
     }
+    BOOST_TEST(count == 80);
+    BOOST_TEST(sum == 5050 - 1050);
 }
 
-BOOST_AUTO_TEST_CASE(AutoDeleteTest)
+BOOST_AUTO_TEST_CASE(ReadAheadTest)
 {
-    std::cout << "AutoDeleteTest" << std::endl;
+    std::cout << "ReadAheadTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    const uint64_t count = 20000;
+    {
+        auto s = kv_storage::Volume<uint64_t, 10>(volumeDir);
+        for (uint64_t i = 0; i < count; i++)
+            s.Put(i, i * 3);
+    }
+
+    // Cold volume with cache smaller than the read-ahead window.
+    for (size_t readAhead : { 0, 1, 4, 64 })
+    {
+        auto s = kv_storage::Volume<uint64_t, 10>(volumeDir, 32);
+        s.SetReadAhead(readAhead);
+
+        auto enumerator = s.Enumerate();
+        uint64_t expected = 0;
+        while (enumerator->MoveNext())
+        {
+            BOOST_REQUIRE(enumerator->GetCurrent().first == expected);
+            BOOST_REQUIRE(enumerator->GetCurrent().second == expected * 3);
+            expected++;
+        }
+        BOOST_TEST(expected == count);
+
+        // Seek forward and backward restarts read-ahead from the new position.
+        for (kv_storage::Key key : { 15000, 100, 19990, 7 })
+        {
+            enumerator->Seek(key);
+            for (kv_storage::Key k = key; k < std::min<kv_storage::Key>(key + 500, count); k++)
+            {
+                BOOST_REQUIRE(enumerator->MoveNext());
+                BOOST_REQUIRE(enumerator->GetCurrent().first == k);
+            }
+        }
+    }
+
+    // Enumerator which is destroyed in the middle stops read-ahead and unlocks volume.
+    auto s = kv_storage::Volume<uint64_t, 10>(volumeDir, 32);
+    for (int i = 0; i < 10; i++)
+    {
+        auto enumerator = s.Scan(i * 1000);
+        for (int j = 0; j < 100 && enumerator->MoveNext(); j++)
+        {
+        }
+    }
+    s.Put(count, 0);
+    BOOST_TEST(s.Get(count).value_or(1) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(ConcurrentScansTest)
+{
+    std::cout << "ConcurrentScansTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    auto s = kv_storage::Volume<uint64_t, 10>(volumeDir);
+    for (uint64_t key = 0; key < 1000; key++)
+        s.Put(key, key);
+
+    // One thread holds two enumerators and aggregates meanwhile.
+    {
+        auto e1 = s.Enumerate();
+        auto e2 = s.Scan(5);
+        BOOST_TEST(s.Aggregate(0).count == 1000);
+
+        for (uint64_t key = 0; key < 1000; key++)
+        {
+            BOOST_REQUIRE(e1->MoveNext());
+            BOOST_REQUIRE(e1->GetCurrent().first == key);
+            if (key >= 5)
+            {
+                BOOST_REQUIRE(e2->MoveNext());
+                BOOST_REQUIRE(e2->GetCurrent().first == key);
+            }
+        }
+    }
+
+    // Scans of several threads overlap, writer waits for them and sees every scan consistent.
+    std::atomic<int> scanning{ 0 };
+    std::atomic<int> maxScanning{ 0 };
+    std::atomic<bool> writerDone{ false };
+    std::atomic<bool> failed{ false };
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back([&]()
+        {
+            for (int i = 0; i < 20; i++)
+            {
+                auto enumerator = s.Enumerate();
+                const int current = ++scanning;
+                int expected = maxScanning.load();
+                while (expected < current && !maxScanning.compare_exchange_weak(expected, current))
+                {
+                }
+
+                // Writes wait while the scan is open, so the keys don't change until it ends.
+                uint64_t count = 0;
+                while (enumerator->MoveNext())
+                    count++;
+                if (s.Aggregate(0).count != count)
+                    failed = true;
+
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                scanning--;
+            }
+        });
+    }
+
+    threads.emplace_back([&]()
+    {
+        for (uint64_t key = 1000; key < 1200; key += 2)
+        {
+            kv_storage::WriteBatch<uint64_t> batch;
+            batch.Put(key, key);
+            batch.Put(key + 1, key + 1);
+            s.Write(batch);
+        }
+        writerDone = true;
+    });
+
+    for (auto& thread : threads)
+        thread.join();
+
+    BOOST_TEST(!failed);
+    BOOST_TEST(writerDone);
+    BOOST_TEST(maxScanning > 1);
+    BOOST_TEST(s.Aggregate(0).count == 1200);
+}
+
+BOOST_AUTO_TEST_CASE(ScanFairnessTest)
+{
+    std::cout << "ScanFairnessTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    auto s = kv_storage::Volume<uint64_t, 10>(volumeDir, 1000, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Files, kv_storage::WalMode::Buffered);
+    for (uint64_t key = 0; key < 1000; key++)
+    {
+        s.Put(key, key);
+    }
+
+    // Scans of every thread overlap with scans of the others, so scan lock is never free.
+    // Scans stop anyway after the deadline, so starved writer would finish after it.
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(20);
+    std::atomic<bool> writerDone{ false };
+    std::atomic<uint64_t> scans{ 0 };
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back([&]()
+        {
+            while (!writerDone && std::chrono::steady_clock::now() < deadline)
+            {
+                auto enumerator = s.Scan(0, 100);
+                while (enumerator->MoveNext())
+                {
+                }
+                BOOST_TEST(s.Aggregate(0).count >= 1000);
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                scans++;
+            }
+        });
+    }
+
+    // Writes and checkpoints wait for running scans only.
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    for (uint64_t key = 1000; key < 1100; key++)
+    {
+        s.Put(key, key);
+        if (key % 20 == 0)
+            s.Checkpoint();
+    }
+    const bool beforeDeadline = std::chrono::steady_clock::now() < deadline;
+    writerDone = true;
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    BOOST_TEST(beforeDeadline);
+    BOOST_TEST(scans > 0);
+    BOOST_TEST(s.GetKeyCount() == 1100);
+}
+
+BOOST_AUTO_TEST_CASE(MultiGetTest)
+{
+    std::cout << "MultiGetTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    const kv_storage::Key count = 200000;
+
+    auto s = kv_storage::Volume<std::string>(volumeDir);
+    BOOST_TEST(s.MultiGet({ 1, 2 }) == std::vector<std::optional<std::string>>(2));
+
+    for (kv_storage::Key key = 0; key < count; key += 2)
+    {
+        s.Put(key, std::to_string(key));
+    }
+
+    std::mt19937_64 rng(42);
+
+    // Batches of random keys with absent and repeated ones.
+    std::vector<std::vector<kv_storage::Key>> batches(1000);
+    for (auto& batch : batches)
+    {
+        for (int i = 0; i < 200; i++)
+        {
+            batch.push_back(rng() % (count + 100));
+        }
+        batch.push_back(batch.front());
+    }
+
+    for (const auto& batch : batches)
+    {
+        const auto values = s.MultiGet(batch);
+        BOOST_REQUIRE(values.size() == batch.size());
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            const bool exists = batch[i] % 2 == 0 && batch[i] < count;
+            BOOST_REQUIRE(values[i].has_value() == exists);
+            BOOST_REQUIRE(!exists || *values[i] == std::to_string(batch[i]));
+        }
+    }
+
+    auto measure = [&](auto get)
+    {
+        size_t found = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (const auto& batch : batches)
+        {
+            found += get(batch);
+        }
+        const std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+        return std::make_pair(elapsed.count() / batches.size(), found);
+    };
+
+    const auto [getUs, getFound] = measure([&s](const std::vector<kv_storage::Key>& batch)
+    {
+        size_t found = 0;
+        for (const auto key : batch)
+        {
+            found += s.Get(key).has_value() ? 1 : 0;
+        }
+        return found;
+    });
+    const auto [multiGetUs, multiGetFound] = measure([&s](const std::vector<kv_storage::Key>& batch)
+    {
+        const auto values = s.MultiGet(batch);
+        return static_cast<size_t>(std::count_if(values.begin(), values.end(), [](const auto& value) { return value.has_value(); }));
+    });
+
+    BOOST_TEST(getFound == multiGetFound);
+
+    std::cout << batches.front().size() << " keys, loop of Get: " << getUs << " us, MultiGet: " << multiGetUs << " us per batch" << std::endl;
+}
+
+BOOST_AUTO_TEST_CASE(SmallCacheTest)
+{
+    std::cout << "SmallCacheTest" << std::endl;
+
+    fs::path volumeDir("vol");
+
+    const int count = 30000;
+
+    for (auto policy : { kv_storage::CachePolicy::Lfu, kv_storage::CachePolicy::ShardedClock })
+    {
+        fs::remove_all(volumeDir);
+
+        std::vector<int> keys;
+        for (int i = 0; i < count; i++)
+        {
+            keys.push_back(i);
+        }
+
+        std::mt19937 rng(42);
+        std::shuffle(keys.begin(), keys.end(), rng);
+
+        {
+            // Cache keeps only a small part of the tree, so nodes are evicted and reloaded all the time.
+            auto s = kv_storage::Volume<std::string, 10>(volumeDir, 100, policy);
+
+            for (auto k : keys)
+            {
+                s.Put(k, "value" + std::to_string(k));
+            }
+
+            for (int i = 0; i < count / 2; i++)
+            {
+                s.Delete(keys[i]);
+            }
+
+            for (int i = count / 2; i < count; i++)
+            {
+                BOOST_TEST(*s.Get(keys[i]) == "value" + std::to_string(keys[i]));
+            }
+        }
+
+        auto s = kv_storage::Volume<std::string, 10>(volumeDir, 100, policy);
+
+        for (int i = 0; i < count; i++)
+        {
+            BOOST_TEST(s.Get(keys[i]).has_value() == (i >= count / 2));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ColdCacheTest)
+{
+    std::cout << "ColdCacheTest" << std::endl;
+
+    using Value = std::shared_ptr<int>;
+    const auto disposer = [](Value& v) { return v.use_count() == 1; };
+
+    std::vector<std::unique_ptr<kv_storage::cache_base<int, Value>>> caches;
+    caches.push_back(std::make_unique<kv_storage::lfu_cache<int, Value>>(8, disposer));
+    caches.push_back(std::make_unique<kv_storage::sharded_clock_cache<int, Value>>(8, disposer, 1));
+
+    for (auto& cache : caches)
+    {
+        for (int key = 0; key < 4; key++)
+        {
+            cache->get_or_insert(key, std::make_shared<int>(key));
+            cache->get(key);
+        }
+
+        // Scan evicts only its own items, busy cold item stays.
+        auto pinned = cache->get_or_insert_cold(100, std::make_shared<int>(100));
+        for (int key = 101; key < 200; key++)
+        {
+            BOOST_TEST(*cache->get_or_insert_cold(key, std::make_shared<int>(key)) == key);
+            BOOST_TEST(cache->size() <= 8);
+        }
+
+        for (int key = 0; key < 4; key++)
+            BOOST_TEST(cache->contains(key));
+        BOOST_TEST(cache->contains(100));
+        BOOST_TEST(cache->contains(199));
+
+        // Usual insert into full cache still works.
+        cache->insert(1000, std::make_shared<int>(1000));
+        BOOST_TEST(cache->contains(1000));
+        BOOST_TEST(cache->size() <= 8);
+
+        cache->clear();
+        BOOST_TEST(cache->empty());
+    }
+
+    // Cold item of clock cache which is accessed again becomes a usual one.
+    auto& clock = *caches.back();
+    for (int key = 0; key < 8; key++)
+        clock.get_or_insert_cold(key, std::make_shared<int>(key));
+    clock.get(3);
+    for (int key = 100; key < 120; key++)
+        clock.get_or_insert_cold(key, std::make_shared<int>(key));
+    BOOST_TEST(clock.contains(3));
+    BOOST_TEST(!clock.contains(4));
+
+    // Enumeration of volume with small cache.
+    fs::path volumeDir("vol");
+    for (auto policy : { kv_storage::CachePolicy::Lfu, kv_storage::CachePolicy::ShardedClock })
+    {
+        fs::remove_all(volumeDir);
+        auto s = kv_storage::Volume<uint64_t, 10>(volumeDir, 100, policy);
+        for (uint64_t key = 0; key < 5000; key++)
+            s.Put(key, key);
+
+        for (int i = 0; i < 2; i++)
+        {
+            auto enumerator = s.Enumerate();
+            uint64_t expected = 0;
+            while (enumerator->MoveNext())
+                BOOST_REQUIRE(enumerator->GetCurrent().first == expected++);
+            BOOST_TEST(expected == 5000);
+        }
+
+        BOOST_TEST(s.Aggregate(0).count == 5000);
+        for (uint64_t key = 0; key < 5000; key += 7)
+            BOOST_TEST(s.Get(key).value_or(0) == key);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(PagedFormatTest)
+{
+    std::cout << "PagedFormatTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    const int count = 20000;
+
+    // Every 100th value is bigger than a page, so its leaf takes overflow pages.
+    auto value = [](int k) { return std::string(k % 100 == 0 ? 5000 : 10, 'a' + k % 26) + std::to_string(k); };
+
+    std::vector<int> keys;
+    for (int i = 0; i < count; i++)
+    {
+        keys.push_back(i);
+    }
+
+    std::mt19937 rng(42);
+    std::shuffle(keys.begin(), keys.end(), rng);
+
+    auto check = [&](kv_storage::StorageFormat format)
+    {
+        auto s = kv_storage::Volume<std::string, 10>(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, format);
+
+        for (int i = 0; i < count; i++)
+        {
+            auto res = s.Get(keys[i]);
+            BOOST_TEST(res.has_value() == (i >= count / 2));
+            if (res)
+                BOOST_TEST(*res == value(keys[i]));
+        }
+    };
+
+    {
+        auto s = kv_storage::Volume<std::string, 10>(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Paged);
+
+        for (auto k : keys)
+        {
+            s.Put(k, value(k));
+        }
+
+        for (int i = 0; i < count / 2; i++)
+        {
+            s.Delete(keys[i]);
+        }
+    }
+
+    BOOST_TEST(fs::exists(volumeDir / "volume.dat"));
+    BOOST_TEST(!fs::exists(volumeDir / "batch_1.dat"));
+    BOOST_CHECK_THROW(kv_storage::Volume<std::string>{ volumeDir }, std::runtime_error);
+
+    check(kv_storage::StorageFormat::Paged);
+
+    {
+        // Freed pages are reused.
+        auto s = kv_storage::Volume<std::string, 10>(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Paged);
+        const auto size = fs::file_size(volumeDir / "volume.dat");
+
+        for (int i = 0; i < count / 2; i++)
+        {
+            s.Put(keys[i], value(keys[i]));
+        }
+        for (int i = 0; i < count / 2; i++)
+        {
+            s.Delete(keys[i]);
+        }
+
+        s.StopAndFlush();
+        BOOST_TEST(fs::file_size(volumeDir / "volume.dat") <= size * 2);
+    }
+
+    kv_storage::ConvertStorageFormat(volumeDir, kv_storage::StorageFormat::Files);
+    BOOST_TEST(!fs::exists(volumeDir / "volume.dat"));
+    check(kv_storage::StorageFormat::Files);
+
+    kv_storage::ConvertStorageFormat(volumeDir, kv_storage::StorageFormat::Paged);
+    BOOST_TEST(!fs::exists(volumeDir / "batch_1.dat"));
+    check(kv_storage::StorageFormat::Paged);
+}
+
+BOOST_AUTO_TEST_CASE(IndexAllocationTest)
+{
+    std::cout << "IndexAllocationTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    const auto indicesPath = volumeDir / kv_storage::FileIndicesFileName;
+    const int count = 20000;
+
+    auto countBatches = [&volumeDir]()
+    {
+        return std::count_if(fs::directory_iterator(volumeDir), fs::directory_iterator(), [](const fs::directory_entry& entry)
+        {
+            return entry.path().filename().string().compare(0, 6, "batch_") == 0;
+        });
+    };
+
+    {
+        auto s = kv_storage::Volume<std::string, 10>(volumeDir, 1000);
+        for (int i = 0; i < count; i++)
+        {
+            s.Put(i, "value" + std::to_string(i));
+        }
+        BOOST_TEST(!fs::exists(indicesPath));
+    }
+    BOOST_TEST(fs::exists(indicesPath));
+    const auto filled = countBatches();
+
+    // Indices of removed nodes are reused after reopening.
+    {
+        auto s = kv_storage::Volume<std::string, 10>(volumeDir, 1000);
+        BOOST_TEST(!fs::exists(indicesPath));
+        for (int i = 0; i < count; i++)
+        {
+            s.Delete(i);
+        }
+    }
+    BOOST_TEST(countBatches() == 1);
+
+    {
+        auto s = kv_storage::Volume<std::string, 10>(volumeDir, 1000);
+        for (int i = 0; i < count; i++)
+        {
+            s.Put(i, "value" + std::to_string(i));
+        }
+    }
+    BOOST_TEST(countBatches() == filled);
+
+    // Without the indices file they are restored from node files.
+    {
+        kv_storage::FileNodeStorage storage(volumeDir);
+        BOOST_TEST(!fs::exists(indicesPath));
+
+        std::set<kv_storage::FileIndex> allocated;
+        storage.Free(5);
+        storage.Free(7);
+        allocated.insert(storage.Allocate());
+        allocated.insert(storage.Allocate());
+        BOOST_TEST((allocated == std::set<kv_storage::FileIndex>{ 5, 7 }));
+        BOOST_TEST(storage.Allocate() == static_cast<kv_storage::FileIndex>(filled + 1));
+
+        storage.Write(filled + 10, "data");
+        storage.Free(6);
+    }
+    {
+        fs::remove(indicesPath);
+        kv_storage::FileNodeStorage storage(volumeDir);
+        BOOST_TEST(storage.Allocate() == 5);
+        BOOST_TEST(storage.Allocate() == 6);
+        BOOST_TEST(storage.Allocate() == 7);
+        for (int i = 1; i < 10; i++)
+        {
+            BOOST_TEST(storage.Allocate() == static_cast<kv_storage::FileIndex>(filled + i));
+        }
+        BOOST_TEST(storage.Allocate() == static_cast<kv_storage::FileIndex>(filled + 11));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(FilePoolTest)
+{
+    std::cout << "FilePoolTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+    fs::create_directories(volumeDir);
+
+    {
+        kv_storage::FileNodeStorage storage(volumeDir);
+
+        // Node from the pool is read by one system call and written in place.
+        storage.Write(2, "long data");
+        BOOST_TEST(storage.Read(2) == "long data");
+        BOOST_TEST(storage.Read(2) == "long data");
+        auto stats = storage.GetIoStats();
+        BOOST_TEST(stats.opens == 1);
+        BOOST_TEST(stats.reads == 2);
+        BOOST_TEST(stats.writes == 1);
+
+        storage.Write(2, "short");
+        BOOST_TEST(storage.Read(2) == "short");
+        storage.Write(2, "longer data");
+        BOOST_TEST(storage.Read(2) == "longer data");
+        BOOST_TEST(storage.GetIoStats().opens == 1);
+
+        // Freed node is closed and removed.
+        storage.Free(2);
+        BOOST_CHECK_THROW(storage.Read(2), std::runtime_error);
+        storage.Write(2, "new");
+        BOOST_TEST(storage.Read(2) == "new");
+
+        // Files evicted from the pool are opened again.
+        const kv_storage::FileIndex count = kv_storage::FilePoolSize * 2;
+        for (kv_storage::FileIndex idx = 3; idx < 3 + count; idx++)
+            storage.Write(idx, std::to_string(idx));
+
+        stats = storage.GetIoStats();
+        for (kv_storage::FileIndex idx = 3 + count - kv_storage::FilePoolSize; idx < 3 + count; idx++)
+            BOOST_TEST(storage.Read(idx) == std::to_string(idx));
+        BOOST_TEST(storage.GetIoStats().opens == stats.opens);
+
+        for (kv_storage::FileIndex idx = 3; idx < 3 + count; idx++)
+            BOOST_TEST(storage.Read(idx) == std::to_string(idx));
+        BOOST_TEST(storage.GetIoStats().opens > stats.opens);
+    }
+
+    {
+        // Node which is not in the pool costs open and one read, size of file is not queried.
+        kv_storage::FileNodeStorage storage(volumeDir);
+        auto stats = storage.GetIoStats();
+        BOOST_TEST(storage.Read(2) == "new");
+        BOOST_TEST(storage.GetIoStats().opens - stats.opens == 1);
+        BOOST_TEST(storage.GetIoStats().reads - stats.reads == 1);
+
+        storage.Write(3, std::string(20000, 'a'));
+    }
+
+    {
+        // Node bigger than all previous ones is read in several calls, then in one.
+        kv_storage::FileNodeStorage storage(volumeDir);
+        auto stats = storage.GetIoStats();
+        BOOST_TEST(storage.Read(3) == std::string(20000, 'a'));
+        BOOST_TEST(storage.GetIoStats().reads - stats.reads > 1);
+        stats = storage.GetIoStats();
+        BOOST_TEST(storage.Read(3) == std::string(20000, 'a'));
+        BOOST_TEST(storage.GetIoStats().reads - stats.reads == 1);
+    }
+
+    // Every node loaded from disk by Get costs one read, and open only if its file is not in the pool.
+    fs::remove_all(volumeDir);
+    {
+        auto s = kv_storage::Volume<uint64_t, 10>(volumeDir);
+        for (uint64_t key = 0; key < 5000; key++)
+            s.Put(key, key);
+    }
+
+    auto s = kv_storage::Volume<uint64_t, 10>(volumeDir, 10);
+    const auto before = s.GetIoStats();
+    for (uint64_t key = 0; key < 5000; key += 13)
+        BOOST_TEST(s.Get(key).value_or(0) == key);
+
+    const auto after = s.GetIoStats();
+    const auto loads = after.loads - before.loads;
+    BOOST_TEST(loads > 0);
+    BOOST_TEST(after.writes == before.writes);
+    BOOST_TEST(after.reads - before.reads == loads);
+    BOOST_TEST(after.opens - before.opens <= loads);
+    std::cout << loads << " node loads, " << (after.reads - before.reads) << " reads, " << (after.opens - before.opens) << " opens" << std::endl;
+}
+
+BOOST_AUTO_TEST_CASE(SuperblockTest)
+{
+    std::cout << "SuperblockTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    const int count = 20000;
+
+    {
+        auto s = kv_storage::Volume<uint64_t, 10>(volumeDir, 1000);
+        BOOST_TEST(s.GetKeyCount() == 0);
+        BOOST_TEST(s.GetHeight() == 1);
+
+        for (int i = 0; i < count; i++)
+        {
+            s.Put(i, i);
+        }
+        BOOST_TEST(s.GetKeyCount() == count);
+        BOOST_TEST(s.GetHeight() > 3);
+    }
+
+    uint32_t height = 0;
+    {
+        auto s = kv_storage::Volume<uint64_t, 10>(volumeDir, 1000);
+        BOOST_TEST(s.GetKeyCount() == count);
+        height = s.GetHeight();
+
+        for (int i = 0; i < count; i += 2)
+        {
+            s.Delete(i);
+        }
+        BOOST_TEST(s.GetKeyCount() == count / 2);
+    }
+
+    // Template parameters of volume are checked.
+    BOOST_CHECK_THROW((kv_storage::Volume<uint64_t, 20>(volumeDir)), std::runtime_error);
+    BOOST_CHECK_THROW((kv_storage::Volume<double, 10>(volumeDir)), std::runtime_error);
+
+    // Statistics of closed volume are taken from superblock without scan.
+    auto superblock = kv_storage::Superblock::Read(volumeDir);
+    BOOST_REQUIRE(superblock.has_value());
+    BOOST_TEST(superblock->exact);
+    BOOST_TEST(superblock->keyCount == count / 2);
+
+    superblock->keyCount = 12345;
+    superblock->Write(volumeDir);
+    {
+        auto s = kv_storage::Volume<uint64_t, 10>(volumeDir, 1000);
+        BOOST_TEST(s.GetKeyCount() == 12345);
+        BOOST_TEST(!kv_storage::Superblock::Read(volumeDir)->exact);
+    }
+
+    // Outdated statistics are counted again.
+    superblock->keyCount = 12345;
+    superblock->height = 100;
+    superblock->exact = false;
+    superblock->Write(volumeDir);
+    {
+        auto s = kv_storage::Volume<uint64_t, 10>(volumeDir, 1000);
+        BOOST_TEST(s.GetKeyCount() == count / 2);
+        BOOST_TEST(s.GetHeight() <= height);
+
+        for (int i = 1; i < count; i += 2)
+        {
+            s.Delete(i);
+        }
+        BOOST_TEST(s.GetKeyCount() == 0);
+        BOOST_TEST(s.GetHeight() == 1);
+    }
+
+    std::ofstream(volumeDir / kv_storage::SuperblockFileName) << "garbage";
+    BOOST_CHECK_THROW((kv_storage::Volume<uint64_t, 10>(volumeDir)), std::runtime_error);
+
+    // Loaded tree has statistics too.
+    fs::remove_all(volumeDir);
+    std::vector<std::pair<uint64_t, uint64_t>> pairs;
+    for (int i = 0; i < count; i++)
+    {
+        pairs.emplace_back(i, i);
+    }
+
+    {
+        auto s = kv_storage::Volume<uint64_t, 10>(volumeDir, 1000, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Paged, kv_storage::WalMode::Buffered);
+        s.BulkLoad(pairs.begin(), pairs.end());
+        BOOST_TEST(s.GetKeyCount() == count);
+        height = s.GetHeight();
+    }
+
+    fs::remove(volumeDir / kv_storage::SuperblockFileName);
+    auto s = kv_storage::Volume<uint64_t, 10>(volumeDir, 1000, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Paged, kv_storage::WalMode::Buffered);
+    BOOST_TEST(s.GetKeyCount() == count);
+    BOOST_TEST(s.GetHeight() == height);
+}
+
+BOOST_AUTO_TEST_CASE(WalTest)
+{
+    std::cout << "WalTest" << std::endl;
+
+    fs::path volumeDir("vol");
+
+    const int count = 20000;
+
+    std::vector<int> keys;
+    for (int i = 0; i < count; i++)
+    {
+        keys.push_back(i);
+    }
+
+    std::mt19937 rng(42);
+    std::shuffle(keys.begin(), keys.end(), rng);
+
+    for (auto format : { kv_storage::StorageFormat::Files, kv_storage::StorageFormat::Paged })
+    {
+        fs::remove_all(volumeDir);
+
+        using VolumeType = kv_storage::Volume<std::string, 10>;
+
+        {
+            auto s = VolumeType(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, format, kv_storage::WalMode::Buffered);
+            // Only the explicit checkpoint is made, changes after it are recovered from the log.
+            s.SetDirtyWatermarks(count, count);
+
+            for (int i = 0; i < count / 2; i++)
+            {
+                s.Put(keys[i], "value" + std::to_string(keys[i]));
+            }
+
+            s.Checkpoint();
+
+            for (int i = count / 2; i < count; i++)
+            {
+                s.Put(keys[i], "value" + std::to_string(keys[i]));
+            }
+
+            for (int i = 0; i < count / 4; i++)
+            {
+                s.Delete(keys[i]);
+            }
+
+            // Nodes are not flushed, like after crash of the process.
+            s.Abandon();
+        }
+        BOOST_TEST(fs::file_size(volumeDir / "wal.log") > 0);
+
+        {
+            auto s = VolumeType(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, format, kv_storage::WalMode::Sync);
+            s.SetDirtyWatermarks(count, count);
+
+            for (int i = 0; i < count; i++)
+            {
+                BOOST_TEST(s.Get(keys[i]).has_value() == (i >= count / 4));
+            }
+            BOOST_TEST(s.GetKeyCount() == static_cast<uint64_t>(count - count / 4));
+
+            // Concurrent writers share syncs of the log.
+            std::vector<std::thread> threads;
+            for (int t = 0; t < 4; t++)
+            {
+                threads.emplace_back([&s, t, &keys]()
+                {
+                    for (int i = t; i < count / 4; i += 40)
+                    {
+                        s.Put(keys[i], "new" + std::to_string(keys[i]));
+                    }
+                });
+            }
+
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+
+            s.Abandon();
+        }
+
+        auto s = VolumeType(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, format, kv_storage::WalMode::Sync);
+
+        uint64_t found = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (i >= count / 4)
+                BOOST_TEST(*s.Get(keys[i]) == "value" + std::to_string(keys[i]));
+            else if (i % 40 < 4)
+                BOOST_TEST(*s.Get(keys[i]) == "new" + std::to_string(keys[i]));
+            else
+                BOOST_TEST(!s.Get(keys[i]).has_value());
+
+            found += s.Get(keys[i]).has_value();
+        }
+        BOOST_TEST(s.GetKeyCount() == found);
+    }
+
+    BOOST_TEST(fs::file_size(volumeDir / "wal.log") == 0);
+}
+
+#ifndef _WIN32
+BOOST_AUTO_TEST_CASE(WalFailureTest)
+{
+    std::cout << "WalFailureTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    using VolumeType = kv_storage::Volume<std::string, 10>;
+
+    const std::string value(1000, 'v');
+    uint64_t written = 0;
+
+    {
+        auto s = VolumeType(volumeDir, 1000, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Files, kv_storage::WalMode::Sync);
+
+        // Write which crosses the file size limit fails with EFBIG instead of the signal.
+        rlimit limit{};
+        BOOST_REQUIRE(getrlimit(RLIMIT_FSIZE, &limit) == 0);
+        rlimit smallLimit = limit;
+        smallLimit.rlim_cur = 64 * 1024;
+        const auto oldHandler = std::signal(SIGXFSZ, SIG_IGN);
+        BOOST_REQUIRE(setrlimit(RLIMIT_FSIZE, &smallLimit) == 0);
+
+        bool failed = false;
+        while (!failed && written < 1000)
+        {
+            try
+            {
+                s.Put(written, value);
+                written++;
+            }
+            catch (const std::exception&)
+            {
+                failed = true;
+            }
+        }
+
+        setrlimit(RLIMIT_FSIZE, &limit);
+        std::signal(SIGXFSZ, oldHandler);
+
+        BOOST_TEST(failed);
+        BOOST_TEST(written > 0);
+
+        // Log works again, but the volume doesn't accept changes until it is reopened.
+        BOOST_CHECK_THROW(s.Put(written + 1, value), std::runtime_error);
+        BOOST_CHECK_THROW(s.Upsert(0, "new"), std::runtime_error);
+        BOOST_CHECK_THROW(s.Delete(0), std::runtime_error);
+        BOOST_CHECK_THROW(s.Checkpoint(), std::runtime_error);
+        BOOST_TEST(*s.Get(0) == value);
+    }
+
+    // Only committed puts are recovered from the log.
+    auto s = VolumeType(volumeDir, 1000, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Files, kv_storage::WalMode::Sync);
+    for (uint64_t key = 0; key < written; key++)
+    {
+        BOOST_TEST(*s.Get(key) == value);
+    }
+    BOOST_TEST(s.Get(written).has_value() == false);
+    BOOST_TEST(s.GetKeyCount() == written);
+
+    s.Put(written, value);
+    BOOST_TEST(s.GetKeyCount() == written + 1);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(CheckpointSyncTest)
+{
+    std::cout << "CheckpointSyncTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+    fs::create_directories(volumeDir);
+
+    {
+        // Every written file is synced once, also after it left the pool, and then the directory.
+        kv_storage::FileNodeStorage storage(volumeDir);
+        const kv_storage::FileIndex count = kv_storage::FilePoolSize * 2;
+        for (kv_storage::FileIndex idx = 2; idx < 2 + count; idx++)
+        {
+            storage.Write(idx, std::to_string(idx));
+            storage.Write(idx, std::to_string(idx));
+        }
+        storage.Free(2);
+
+        BOOST_TEST(storage.GetIoStats().syncs == 0);
+        storage.Sync();
+        BOOST_TEST(storage.GetIoStats().syncs == count);
+
+        storage.Sync();
+        BOOST_TEST(storage.GetIoStats().syncs == count);
+
+        storage.Free(3);
+        storage.Sync();
+        BOOST_TEST(storage.GetIoStats().syncs == count + 1);
+    }
+
+    fs::remove_all(volumeDir);
+    auto s = kv_storage::Volume<uint64_t, 10>(volumeDir, 1000, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Files, kv_storage::WalMode::Sync);
+    for (uint64_t key = 0; key < 1000; key++)
+        s.Put(key, key);
+    s.Checkpoint();
+
+    // Changed leaf is synced with the directory by checkpoint before the log is cleared.
+    const auto before = s.GetIoStats();
+    s.Upsert(500, 0);
+    BOOST_TEST(s.GetIoStats().syncs == before.syncs);
+    BOOST_TEST(fs::file_size(volumeDir / kv_storage::WalFileName) > 0);
+
+    s.Checkpoint();
+    const auto after = s.GetIoStats();
+    BOOST_TEST(after.writes - before.writes == 1);
+    BOOST_TEST(after.syncs - before.syncs == 2);
+    BOOST_TEST(fs::file_size(volumeDir / kv_storage::WalFileName) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(WritebackTest)
+{
+    std::cout << "WritebackTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    const int count = 20000;
+
+    auto countBatches = [&volumeDir]()
+    {
+        return std::distance(fs::directory_iterator(volumeDir), fs::directory_iterator());
+    };
+
+    {
+        auto s = kv_storage::Volume<std::string, 10>(volumeDir, 1000);
+        BOOST_CHECK_THROW(s.SetDirtyWatermarks(50, 10), std::runtime_error);
+        s.SetDirtyWatermarks(10, 50);
+
+        for (int i = 0; i < count; i++)
+        {
+            s.Put(i, "value" + std::to_string(i));
+        }
+
+        // Nodes are written by the background thread while volume is open.
+        for (int i = 0; i < 50 && countBatches() < count / 10; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        BOOST_TEST(countBatches() >= count / 10);
+
+        for (int i = 0; i < count; i += 2)
+        {
+            s.Delete(i);
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            BOOST_TEST(s.Get(i).has_value() == (i % 2 == 1));
+        }
+    }
+
+    auto s = kv_storage::Volume<std::string, 10>(volumeDir, 1000);
+
+    for (int i = 0; i < count; i++)
+    {
+        if (i % 2)
+            BOOST_TEST(*s.Get(i) == "value" + std::to_string(i));
+        else
+            BOOST_TEST(!s.Get(i).has_value());
+    }
+}
+
+template<size_t N>
+void KeySearchBenchmark()
+{
+    std::mt19937_64 rng(42);
+
+    std::vector<std::pair<std::array<uint64_t, N>, uint32_t>> arrays(200);
+    for (auto& [arr, count] : arrays)
+    {
+        count = static_cast<uint32_t>(rng() % (N + 1));
+        arr.fill(0);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            arr[i] = rng() % (N * 4);
+        }
+        std::sort(arr.begin(), arr.begin() + count);
+
+        for (uint64_t value = 0; value < N * 4 + 1; value++)
+        {
+            const auto lower = static_cast<uint32_t>(std::lower_bound(arr.begin(), arr.begin() + count, value) - arr.begin());
+            const auto upper = static_cast<uint32_t>(std::upper_bound(arr.begin(), arr.begin() + count, value) - arr.begin());
+
+            BOOST_TEST(kv_storage::LowerBound(arr, count, value) == lower);
+            BOOST_TEST(kv_storage::UpperBound(arr, count, value) == upper);
+            BOOST_TEST(kv_storage::CountLess<false>(arr, count, value) == lower);
+            BOOST_TEST(kv_storage::BinarySearch<true>(arr, count, value) == upper);
+        }
+    }
+
+    std::vector<uint64_t> values(1000000);
+    for (auto& value : values)
+    {
+        value = rng() % (N * 4);
+    }
+
+    auto measure = [&](auto search)
+    {
+        uint64_t checksum = 0;
+        const auto start = std::chrono::steady_clock::now();
+#if defined(__x86_64__) || defined(_M_X64)
+        const auto startCycles = __rdtsc();
+#endif
+        for (size_t i = 0; i < values.size(); i++)
+        {
+            const auto& [arr, count] = arrays[i % arrays.size()];
+            checksum += search(arr, count, values[i]);
+        }
+#if defined(__x86_64__) || defined(_M_X64)
+        const double cycles = static_cast<double>(__rdtsc() - startCycles) / values.size();
+#else
+        const double cycles = 0;
+#endif
+        const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        return std::make_tuple(elapsed.count() / values.size(), cycles, checksum);
+    };
+
+    // Loop which nodes used before search kernels.
+    const auto [linearNs, linearCycles, linearSum] = measure([](const std::array<uint64_t, N>& arr, uint32_t count, uint64_t value)
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (value < arr[i])
+                return i;
+        }
+        return count;
+    });
+    const auto [countNs, countCycles, countSum] = measure(kv_storage::CountLess<true, N>);
+    const auto [binaryNs, binaryCycles, binarySum] = measure(kv_storage::BinarySearch<true, N>);
+
+    BOOST_TEST(countSum == linearSum);
+    BOOST_TEST(binarySum == linearSum);
+
+    std::cout << N << " keys, linear: " << linearNs << " ns (" << linearCycles << " cycles)"
+        << ", count: " << countNs << " ns (" << countCycles << " cycles)"
+        << ", binary: " << binaryNs << " ns (" << binaryCycles << " cycles) per lookup" << std::endl;
+}
+
+BOOST_AUTO_TEST_CASE(KeySearchTest)
+{
+    std::cout << "KeySearchTest" << std::endl;
+
+    KeySearchBenchmark<9>();
+    KeySearchBenchmark<31>();
+    KeySearchBenchmark<149>();
+    KeySearchBenchmark<511>();
+}
+
+template<class V>
+void CheckLeafValues(std::function<V(int)> makeValue)
+{
+    std::mt19937 rng(42);
+
+    kv_storage::LeafValues<V, 149> values;
+    std::vector<V> expected;
+
+    for (int i = 0; i < 30000; i++)
+    {
+        if (expected.size() < 149 && (expected.empty() || rng() % 3))
+        {
+            const size_t pos = rng() % (expected.size() + 1);
+            values.insert(pos, makeValue(i));
+            expected.insert(expected.begin() + pos, makeValue(i));
+        }
+        else if (expected.size() > 100 && rng() % 10 == 0)
+        {
+            // Split as leaf does.
+            const size_t pos = expected.size() / 2;
+            const auto tail = values.take_tail(pos);
+            BOOST_TEST((tail == std::vector<V>(expected.begin() + pos, expected.end())));
+            expected.resize(pos);
+        }
+        else
+        {
+            const size_t pos = rng() % expected.size();
+            values.erase(pos);
+            expected.erase(expected.begin() + pos);
+        }
+
+        BOOST_REQUIRE(values.size() == expected.size());
+        for (size_t j = 0; j < expected.size(); j++)
+        {
+            BOOST_REQUIRE(values[j] == expected[j]);
+        }
+    }
+
+    BOOST_CHECK_THROW(values.erase(expected.size()), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(NodeArraysTest)
+{
+    std::cout << "NodeArraysTest" << std::endl;
+
+    std::array<uint64_t, 5> arr{};
+    kv_storage::InsertToArray(arr, 0, 0, 20);
+    kv_storage::InsertToArray(arr, 1, 0, 10);
+    kv_storage::InsertToArray(arr, 2, 2, 40);
+    kv_storage::InsertToSortedArray<5>(arr, 3, 30);
+    BOOST_TEST((arr == std::array<uint64_t, 5>{ 10, 20, 30, 40, 0 }));
+    BOOST_CHECK_THROW(kv_storage::InsertToArray(arr, 4, 5, 50), std::runtime_error);
+
+    kv_storage::RemoveFromArray(arr, 4, 1);
+    BOOST_TEST((arr == std::array<uint64_t, 5>{ 10, 30, 40, 0, 0 }));
+    kv_storage::RemoveFromArray(arr, 3, 2);
+    BOOST_TEST((arr == std::array<uint64_t, 5>{ 10, 30, 0, 0, 0 }));
+    BOOST_CHECK_THROW(kv_storage::RemoveFromArray(arr, 2, 2), std::runtime_error);
+
+    CheckLeafValues<std::string>([](int i) { return "value" + std::to_string(i); });
+    CheckLeafValues<uint64_t>([](int i) { return static_cast<uint64_t>(i); });
+}
+
+BOOST_AUTO_TEST_CASE(MillionsTest)
+{
+    std::cout << "MillionsTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    const auto count = 5000000;
+    std::string value = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";
+
+    {
+        auto s = kv_storage::Volume<std::string>(volumeDir);
+
+        {
+            std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+            for (int i = 0; i < count; i++)
+            {
+                s.Put(i, value);
+            }
+
+            std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+            std::cout << "Time elapsed for inserting values: " << std::chrono::duration_cast<std::chrono::seconds>(end - begin).count() << "[s]" << std::endl;
+        }
+    }
+
+    {
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+        auto s = kv_storage::Volume<std::string>(volumeDir);
+
+        for (int i = 0; i < count; i++)
+        {
+            BOOST_TEST(*s.Get(i) == value);
+        }
+
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        std::cout << "Time elapsed for getting values: " << std::chrono::duration_cast<std::chrono::seconds>(end - begin).count() << "[s]" << std::endl;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(FloatsTest)
+{
+    std::cout << "FloatsTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    const auto count = 1000000;
+
+    auto floatingTest = [&](auto dummy)
+    {
+        {
+            auto s = kv_storage::Volume<decltype(dummy)>(volumeDir);
+
+            {
+                std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+                for (int i = 0; i < count; i++)
+                {
+                    decltype(dummy) key = static_cast<decltype(dummy)>(i) / count;
+                    s.Put(i, key);
+                }
+
+                std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+                std::cout << "Time elapsed for inserting floats: " << std::chrono::duration_cast<std::chrono::seconds>(end - begin).count() << "[s]" << std::endl;
+            }
+        }
+
+        {
+            std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+            auto s = kv_storage::Volume<decltype(dummy)>(volumeDir);
+
+            for (int i = 0; i < count; i++)
+            {
+                decltype(dummy) key = *s.Get(i);
+                BOOST_TEST(key == static_cast<decltype(dummy)>(i) / count);
+            }
+
+            std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+            std::cout << "Time elapsed for getting floats: " << std::chrono::duration_cast<std::chrono::seconds>(end - begin).count() << "[s]" << std::endl;
+        }
+    };
+
+    floatingTest(1.0f);
+
+    fs::remove_all(volumeDir);
+
+    floatingTest((double)1.0);
+}
+
+BOOST_AUTO_TEST_CASE(ManyVolumesTest)
+{
+    std::cout << "ManyVolumesTest" << std::endl;
+
+    std::vector<kv_storage::Volume<std::string>> volumes;
+
+    for (int i = 0; i < 11; i++)
+    {
+        fs::path volumeDir("vol" + std::to_string(i));
+        fs::remove_all(volumeDir);
+
+        volumes.emplace_back(volumeDir);
+
+        for (int j = i*10000; j < (i+1)*10000; j++)
+        {
+            volumes[i].Put(j, "value" + std::to_string(j));
+        }
+    }
+
+    kv_storage::StorageNode<std::string> storageRoot;
+    storageRoot.Mount(volumes[0]);
+    storageRoot.Mount(volumes[1]);
+    auto child1 = storageRoot.CreateChildNode();
+    child1->Mount(volumes[2]);
+    child1->Mount(volumes[3]);
+    child1->Mount(volumes[4]);
+    auto child2 = child1->CreateChildNode();
+    auto child3 = child2->CreateChildNode();
+    child3->Mount(volumes[5]);
+    child3->Mount(volumes[6]);
+    child3->Mount(volumes[7]);
+    auto child4 = child2->CreateChildNode();
+    child4->Mount(volumes[8]);
+    child4->Mount(volumes[9]);
+    child4->Mount(volumes[10]);
+
+    for (int i = 0; i < 110000; i++)
+    {
+        auto found = storageRoot.Get(i);
+        BOOST_TEST(found.size() == 1);
+        BOOST_TEST(found[0] == "value" + std::to_string(i));
+    }
+}
+
+// Scaling benchmark for concurrent operations. Every thread works with its own range of keys,
+// so threads mostly modify different leaves. Thread count is doubled until it reaches
+// hardware concurrency.
+BOOST_AUTO_TEST_CASE(MultithreadingTest)
+{
+    std::cout << "MultithreadingTest" << std::endl;
+
+    fs::path volumeDir("vol");
+
+    const uint32_t count = 2000000;
+    std::string value = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";
+
+    std::atomic_uint32_t failures{ 0 };
+
+    // Run func for every key in [0, count) in threadsCount threads. Return throughput in operations per second.
+    const auto runThreads = [&](uint32_t threadsCount, auto func)
+    {
+        std::vector<std::thread> threads;
+
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+        for (uint32_t t = 0; t < threadsCount; t++)
+        {
+            const uint32_t first = count / threadsCount * t;
+            const uint32_t last = t == threadsCount - 1 ? count : count / threadsCount * (t + 1);
+
+            threads.emplace_back([&, first, last]()
+            {
+                for (uint32_t i = first; i < last; i++)
+                {
+                    try
+                    {
+                        func(i);
+                    }
+                    catch (const std::exception& e)
+                    {
+                        if (failures++ == 0)
+                            std::cout << "Key " << i << ": " << e.what() << std::endl;
+                    }
+                }
+            });
+        }
+
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+        return static_cast<uint64_t>(count) * 1000 / std::max<int64_t>(elapsed, 1);
+    };
+
+    const uint32_t maxThreads = std::max(4U, std::thread::hardware_concurrency());
+
+    for (uint32_t threadsCount = 1; threadsCount <= maxThreads; threadsCount *= 2)
+    {
+        fs::remove_all(volumeDir);
+
+        {
+            auto s = kv_storage::Volume<std::string>(volumeDir);
+
+            const auto opsPerSecond = runThreads(threadsCount, [&](uint32_t i) { s.Put(i, value); });
+            std::cout << threadsCount << " threads, put: " << opsPerSecond << " ops/s" << std::endl;
+        }
+
+        {
+            auto s = kv_storage::Volume<std::string>(volumeDir);
+
+            const auto opsPerSecond = runThreads(threadsCount, [&](uint32_t i)
+            {
+                if (s.Get(i) != value)
+                    throw std::runtime_error("Failed to find value");
+            });
+            std::cout << threadsCount << " threads, get: " << opsPerSecond << " ops/s" << std::endl;
+        }
+
+        {
+            auto s = kv_storage::Volume<std::string>(volumeDir);
+
+            const auto opsPerSecond = runThreads(threadsCount, [&](uint32_t i) { s.Delete(i); });
+            std::cout << threadsCount << " threads, delete: " << opsPerSecond << " ops/s" << std::endl;
+
+            BOOST_TEST(s.Enumerate()->MoveNext() == false);
+        }
+
+        BOOST_TEST(failures == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(OptimisticReadTest)
+{
+    std::cout << "OptimisticReadTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    // Value length and content depend on key, so a torn value doesn't match.
+    const auto makeValue = [](uint64_t key)
+    {
+        return std::string(8 + key % 40, static_cast<char>('a' + key % 26)) + std::to_string(key);
+    };
+
+    const uint64_t keysCount = 6000;
+    const uint32_t writersCount = 2;
+    const uint32_t readersCount = 4;
+
+    // Every tenth key is present all the time, writers insert and delete the other ones.
+    auto s = kv_storage::Volume<std::string, 10>(volumeDir);
+    for (uint64_t key = 0; key < keysCount; key += 10)
+    {
+        s.Put(key, makeValue(key));
+    }
+
+    const auto initialHeight = s.GetHeight();
+    std::atomic<uint32_t> maxHeight{ initialHeight };
+    std::atomic<uint32_t> writersDone{ 0 };
+    std::atomic<uint32_t> missed{ 0 };
+    std::atomic<uint32_t> torn{ 0 };
+    std::atomic<uint64_t> reads{ 0 };
+
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < writersCount; t++)
+    {
+        threads.emplace_back([&, t]()
+        {
+            // Inserts grow the tree by root splits, deletes shrink it back by merges.
+            for (int round = 0; round < 5; round++)
+            {
+                for (uint64_t key = t; key < keysCount; key += writersCount)
+                {
+                    if (key % 10 != 0)
+                        s.Put(key, makeValue(key));
+                }
+
+                uint32_t height = s.GetHeight();
+                uint32_t expected = maxHeight.load();
+                while (expected < height && !maxHeight.compare_exchange_weak(expected, height))
+                {
+                }
+
+                for (uint64_t key = t; key < keysCount; key += writersCount)
+                {
+                    if (key % 10 != 0)
+                        s.Delete(key);
+                }
+            }
+            writersDone++;
+        });
+    }
+
+    for (uint32_t t = 0; t < readersCount; t++)
+    {
+        threads.emplace_back([&, t]()
+        {
+            std::mt19937 rng(t);
+            std::uniform_int_distribution<uint64_t> dist(0, keysCount / 10 - 1);
+            while (writersDone < writersCount)
+            {
+                const uint64_t key = dist(rng) * 10;
+                const auto value = s.Get(key);
+                if (!value)
+                    missed++;
+                else if (*value != makeValue(key))
+                    torn++;
+                reads++;
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    BOOST_TEST(missed == 0);
+    BOOST_TEST(torn == 0);
+    BOOST_TEST(reads > 0);
+    BOOST_TEST(maxHeight > initialHeight);
+    BOOST_TEST(s.GetHeight() == initialHeight);
+    BOOST_TEST(s.GetKeyCount() == keysCount / 10);
+}
+
+BOOST_AUTO_TEST_CASE(ReplacedRootTest)
+{
+    std::cout << "ReplacedRootTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    auto s = kv_storage::Volume<uint64_t, 10>(volumeDir, 50);
+    for (uint64_t key = 0; key < 9; key++)
+    {
+        s.Put(key, key);
+    }
+
+    // Root leaf becomes a usual leaf after the split, it is evicted from the cache like others.
+    std::weak_ptr<kv_storage::BPNode<uint64_t, 10>> oldRoot = s.GetCustomNode(1);
+    for (uint64_t key = 9; key < 5000; key++)
+    {
+        s.Put(key, key);
+    }
+    BOOST_TEST(s.GetHeight() > 1);
+
+    s.Checkpoint();
+    for (uint64_t key = 1000; key < 5000; key++)
+    {
+        BOOST_TEST(s.Get(key).value_or(0) == key);
+    }
+    BOOST_TEST(oldRoot.expired());
+
+    // Root which is merged away is released too.
+    std::weak_ptr<kv_storage::BPNode<uint64_t, 10>> mergedRoot = s.GetCustomNode(1);
+    for (uint64_t key = 0; key < 5000; key++)
+    {
+        s.Delete(key);
+    }
+    BOOST_TEST(s.GetHeight() == 1);
+    BOOST_TEST(mergedRoot.expired());
+}
+
+BOOST_AUTO_TEST_CASE(AutoDeleteTest)
+{
+    std::cout << "AutoDeleteTest" << std::endl;
 
     fs::path volumeDir("vol");
     fs::remove_all(volumeDir);
@@ -474,6 +2464,11 @@ BOOST_AUTO_TEST_CASE(AutoDeleteTest)
     auto s = kv_storage::Volume<std::string>(volumeDir);
     s.Start();
 
+    // Time of the deleted key doesn't affect the key which is put again.
+    s.Put(11, "val11", 1);
+    s.Delete(11);
+    s.Put(11, "val11", 5);
+
     std::this_thread::sleep_for(std::chrono::seconds(2));
     BOOST_TEST(s.Get(1).has_value() == false);
     BOOST_TEST(s.Get(2).has_value() == false);
@@ -485,6 +2480,7 @@ BOOST_AUTO_TEST_CASE(AutoDeleteTest)
     BOOST_TEST(s.Get(8).has_value() == true);
     BOOST_TEST(s.Get(9).has_value() == true);
     BOOST_TEST(s.Get(10).has_value() == true);
+    BOOST_TEST(s.Get(11).has_value() == true);
 
     std::this_thread::sleep_for(std::chrono::seconds(4));
     BOOST_TEST(s.Get(6).has_value() == false);
@@ -492,6 +2488,373 @@ BOOST_AUTO_TEST_CASE(AutoDeleteTest)
     BOOST_TEST(s.Get(8).has_value() == false);
     BOOST_TEST(s.Get(9).has_value() == false);
     BOOST_TEST(s.Get(10).has_value() == false);
+    BOOST_TEST(s.Get(11).has_value() == false);
+}
+
+BOOST_AUTO_TEST_CASE(AutoDeleteStaleDeadlinesTest)
+{
+    std::cout << "AutoDeleteStaleDeadlinesTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    auto s = kv_storage::Volume<uint64_t, 10>(volumeDir);
+    s.Start();
+
+    for (uint64_t key = 0; key < 10; key++)
+    {
+        s.Put(key, key, 2);
+    }
+
+    // Keys are put again before their old deadline with longer TTL.
+    for (uint64_t key = 100; key < 110; key++)
+    {
+        s.Put(key, key, 1);
+        s.Delete(key);
+        s.Put(key, key, 1000);
+    }
+
+    // Deadlines of the deleted key outnumber live ones, so the queue is rebuilt several times.
+    for (int i = 0; i < 3000; i++)
+    {
+        s.Put(1000, 1000, 1);
+        s.Delete(1000);
+    }
+    s.Put(1000, 1000, 1000);
+
+    std::this_thread::sleep_for(std::chrono::seconds(4));
+    for (uint64_t key = 0; key < 10; key++)
+    {
+        BOOST_TEST(s.Get(key).has_value() == false);
+    }
+    for (uint64_t key = 100; key < 110; key++)
+    {
+        BOOST_TEST(s.Get(key).has_value() == true);
+    }
+    BOOST_TEST(s.Get(1000).has_value() == true);
+    BOOST_TEST(s.Aggregate(0).count == 11);
+}
+
+BOOST_AUTO_TEST_CASE(AutoDeleteRetryTest)
+{
+    std::cout << "AutoDeleteRetryTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::path hiddenDir("vol_hidden");
+    fs::remove_all(volumeDir);
+    fs::remove_all(hiddenDir);
+
+    {
+        auto s = kv_storage::Volume<uint64_t, 10>(volumeDir);
+        s.Start();
+        for (uint64_t key = 0; key < 100; key++)
+        {
+            s.Put(key, key, key < 10 ? 2 : 1000);
+        }
+    }
+
+    auto s = kv_storage::Volume<uint64_t, 10>(volumeDir);
+
+    // Only the root is loaded, leaves can't be read while their files are hidden.
+    fs::create_directories(hiddenDir);
+    for (const auto& entry : fs::directory_iterator(volumeDir))
+    {
+        if (entry.path().filename().string().rfind("batch_", 0) == 0)
+            fs::rename(entry.path(), hiddenDir / entry.path().filename());
+    }
+
+    s.Start();
+    std::this_thread::sleep_for(std::chrono::seconds(4));
+
+    for (const auto& entry : fs::directory_iterator(hiddenDir))
+    {
+        fs::rename(entry.path(), volumeDir / entry.path().filename());
+    }
+    fs::remove_all(hiddenDir);
+
+    // Keys which failed to be deleted keep their TTL and are deleted after the error is gone.
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    for (uint64_t key = 0; key < 100; key++)
+    {
+        BOOST_TEST(s.Get(key).has_value() == (key >= 10));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(InlineTtlTest)
+{
+    std::cout << "InlineTtlTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    using VolumeType = kv_storage::Volume<std::string, 10>;
+
+    const int count = 5000;
+
+    // TTL 0 makes key outdated at once, so deletion times are checked after splits and merges.
+    auto ttl = [](int key) -> std::optional<uint32_t>
+    {
+        if (key % 3 == 0)
+            return 0;
+        if (key % 3 == 1)
+            return 1000;
+        return std::nullopt;
+    };
+
+    auto check = [&count](VolumeType& s, int deleted)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            BOOST_REQUIRE(s.Get(i).has_value() == (i % 3 != 0 && i >= deleted));
+        }
+
+        auto enumerator = s.Enumerate();
+        int expected = deleted;
+        while (enumerator->MoveNext())
+        {
+            while (expected % 3 == 0)
+                expected++;
+            BOOST_REQUIRE(enumerator->GetCurrent().first == static_cast<uint64_t>(expected));
+            expected++;
+        }
+        while (expected % 3 == 0)
+            expected++;
+        BOOST_TEST(expected >= count);
+    };
+
+    {
+        auto s = VolumeType(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Files, kv_storage::WalMode::Disabled, kv_storage::TtlMode::Inline);
+
+        std::vector<int> keys;
+        for (int i = 0; i < count; i++)
+        {
+            keys.push_back(i);
+        }
+        std::shuffle(keys.begin(), keys.end(), std::mt19937(42));
+
+        for (auto key : keys)
+        {
+            s.Put(key, "value", ttl(key));
+        }
+        check(s, 0);
+
+        // Outdated keys don't prevent puts and are removed from changed leaves.
+        for (int i = 0; i < count; i += 3)
+        {
+            s.Put(i, "new", 0);
+        }
+        BOOST_TEST(s.GetKeyCount() < static_cast<uint64_t>(count + count / 3));
+
+        for (int i = 0; i < count / 2; i++)
+        {
+            if (i % 3 != 0)
+                s.Delete(i);
+        }
+        check(s, count / 2);
+    }
+
+    {
+        // Deletion times are stored in leaves.
+        auto s = VolumeType(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Files, kv_storage::WalMode::Disabled, kv_storage::TtlMode::Inline);
+        check(s, count / 2);
+
+        s.Put(count, "short", 1);
+        BOOST_TEST(s.Get(count).has_value());
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+        BOOST_TEST(!s.Get(count).has_value());
+    }
+
+    // Deletion times are replayed from the log.
+    fs::remove_all(volumeDir);
+    {
+        auto s = VolumeType(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Paged, kv_storage::WalMode::Buffered, kv_storage::TtlMode::Inline);
+        // No checkpoint is made, all puts are replayed.
+        s.SetDirtyWatermarks(count * 2, count * 2);
+
+        for (int i = 0; i < count; i++)
+        {
+            s.Put(i, "value", ttl(i));
+        }
+
+        // These keys are outdated before reopening: one is deleted in the log, other one is put only.
+        s.Put(count, "short", 1);
+        s.Delete(count);
+        s.Put(count + 1, "short", 1);
+        s.Put(count + 2, "long", 1000);
+        s.Upsert(count + 2, "short", 1);
+
+        s.Abandon();
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+
+    auto s = VolumeType(volumeDir, 100, kv_storage::CachePolicy::ShardedClock, kv_storage::StorageFormat::Paged, kv_storage::WalMode::Buffered, kv_storage::TtlMode::Inline);
+    check(s, 0);
+    BOOST_TEST(!s.Get(count).has_value());
+    BOOST_TEST(!s.Get(count + 1).has_value());
+    BOOST_TEST(!s.Get(count + 2).has_value());
+}
+
+BOOST_AUTO_TEST_CASE(TtlLogTest)
+{
+    std::cout << "TtlLogTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+    fs::create_directories(volumeDir);
+
+    using Deleter = kv_storage::OutdatedKeysDeleter<std::string, 150>;
+
+    const auto ttlsPath = volumeDir / kv_storage::KeysTtlsFileName;
+    const uint64_t recordSize = 17;
+
+    // Old format is converted to the log.
+    {
+        std::ofstream out(ttlsPath, std::ios::binary);
+        const uint32_t count = 3;
+        out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        for (uint64_t key = 1; key <= count; key++)
+        {
+            const uint64_t time = 4000000000 + key;
+            out.write(reinterpret_cast<const char*>(&key), sizeof(key));
+            out.write(reinterpret_cast<const char*>(&time), sizeof(time));
+        }
+    }
+
+    {
+        Deleter deleter(nullptr, volumeDir);
+        BOOST_TEST(fs::file_size(ttlsPath) == 8 + 3 * recordSize);
+
+        // Flush appends only changes.
+        for (kv_storage::Key key = 100; key < 200; key++)
+        {
+            deleter.Put(key, 1000);
+        }
+        for (kv_storage::Key key = 100; key < 150; key++)
+        {
+            deleter.Delete(key);
+        }
+        deleter.Delete(1000);
+        deleter.Flush();
+        BOOST_TEST(fs::file_size(ttlsPath) == 8 + 153 * recordSize);
+
+        deleter.Flush();
+        BOOST_TEST(fs::file_size(ttlsPath) == 8 + 153 * recordSize);
+
+        deleter.Compact();
+        BOOST_TEST(fs::file_size(ttlsPath) == 8 + 53 * recordSize);
+
+        deleter.Delete(2);
+    }
+
+    // Destructor flushes the last change, torn record at the end is ignored.
+    BOOST_TEST(fs::file_size(ttlsPath) == 8 + 54 * recordSize);
+    fs::resize_file(ttlsPath, fs::file_size(ttlsPath) + 5);
+
+    {
+        Deleter deleter(nullptr, volumeDir);
+        deleter.Compact();
+        BOOST_TEST(fs::file_size(ttlsPath) == 8 + 52 * recordSize);
+    }
+
+    // Keys expire after reopening of volume.
+    {
+        auto s = kv_storage::Volume<std::string>(volumeDir);
+        s.Start();
+        for (kv_storage::Key key = 100; key < 200; key++)
+        {
+            s.Put(key, "value", key < 150 ? 1 : 1000);
+        }
+    }
+
+    auto s = kv_storage::Volume<std::string>(volumeDir);
+    s.Start();
+    std::this_thread::sleep_for(std::chrono::seconds(3));
+
+    for (kv_storage::Key key = 100; key < 200; key++)
+    {
+        BOOST_TEST(s.Get(key).has_value() == (key >= 150));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ExpiryBatchTest)
+{
+    std::cout << "ExpiryBatchTest" << std::endl;
+
+    fs::path volumeDir("vol");
+    fs::remove_all(volumeDir);
+
+    const kv_storage::Key count = 30000;
+
+    // Keys of the middle range expire all together, the others expire one of two.
+    const auto expires = [](kv_storage::Key key)
+    {
+        return (key >= 10000 && key < 20000) || key % 2 == 1;
+    };
+
+    auto s = kv_storage::Volume<std::string, 10>(volumeDir, 100);
+    s.Start();
+
+    for (kv_storage::Key key = 0; key < count; key++)
+    {
+        if (expires(key))
+            s.Put(key, "value", 1);
+        else
+            s.Put(key, "value");
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(3));
+
+    uint64_t kept = 0;
+    for (kv_storage::Key key = 0; key < count; key++)
+    {
+        BOOST_REQUIRE(s.Get(key).has_value() == !expires(key));
+        kept += expires(key) ? 0 : 1;
+    }
+    BOOST_TEST(s.GetKeyCount() == kept);
+
+    auto enumerator = s.Enumerate();
+    uint64_t enumerated = 0;
+    while (enumerator->MoveNext())
+    {
+        BOOST_REQUIRE(!expires(enumerator->GetCurrent().first));
+        enumerated++;
+    }
+    BOOST_TEST(enumerated == kept);
+}
+
+// Test for deleting millions of keys which expire at once.
+BOOST_AUTO_TEST_CASE(ExpiryLoadTest, *boost::unit_test::disabled())
+{
+    std::cout << "Expiry load test" << std::endl;
+
+    fs::path volumeDir("volume_expiry");
+    fs::remove_all(volumeDir);
+
+    const kv_storage::Key count = 5000000;
+
+    {
+        auto s = kv_storage::Volume<std::string>(volumeDir);
+        s.Start();
+        for (kv_storage::Key key = 0; key < count; key++)
+        {
+            s.Put(key, "value", 1);
+        }
+    }
+
+    // All keys are outdated when volume is opened again.
+    auto s = kv_storage::Volume<std::string>(volumeDir);
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    s.Start();
+    while (s.GetKeyCount() != 0)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    std::cout << "Time elapsed for deleting outdated values: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << "[ms]" << std::endl;
 }
 
 // Test for putting 200 millions keys with small string values.